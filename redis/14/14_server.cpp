@@ -7,12 +7,37 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+// 事件循环后端: 默认 epoll, -DUSE_POLL 使用 poll(), -DUSE_IO_URING 使用 io_uring
+#if defined(USE_IO_URING)
+#if !__has_include(<linux/io_uring.h>)
+#error "the io_uring backend needs <linux/io_uring.h>"
+#endif
+#include <sys/uio.h>
+#include "uring.h"
+#define EV_BACKEND "io_uring"
+#elif defined(USE_POLL)
+#define EV_BACKEND "poll"
+#else
+#define USE_EPOLL
+#include <sys/epoll.h>
+#define EV_BACKEND "epoll"
+#endif
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <algorithm>
+#include <new>
 #include <string>
+#include <string_view>
 #include <vector>
 // proj
 #include "hashtable.h"
@@ -20,6 +45,12 @@
 #include "list.h"
 #include "heap.h"
 #include "thread_pool.h"
+#include "mailbox.h"
+#include "buffer.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "repl.h"
+#include "slab.h"
 #include "common.h"
 
 static void msg(const char *msg)
@@ -43,6 +74,13 @@ static uint64_t get_monotonic_usec()
     return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
 
+static int64_t get_realtime_msec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
+
 static void fd_set_nb(int fd)
 {
     errno = 0;
@@ -64,39 +102,134 @@ static void fd_set_nb(int fd)
 
 struct Conn;
 
-static struct
+// 每个 reactor 线程负责一个分片, key 按 hash 落到分片上
+struct Shard
+{
+    size_t id = 0;
+    pthread_t thread;
+    // 其它分片转发过来的请求和返回的结果
+    Mailbox mailbox;
+    // 邮箱从空变成非空的时候通知一下
+    int efd = -1;
+    // 这个分片的数据, 快照的时候由发起的线程 (或者 fork 出来的子进程) 读取
+    HMap *db = NULL;
+    std::vector<HeapItem> *heap = NULL;
+    // 有回复在等 AOF 的 fsync, fsync 线程完成之后通过 efd 叫醒
+    bool aof_waiting = false;
+};
+
+static Shard *g_shards = NULL;
+static size_t g_nshards = 1;
+static uint16_t g_port = 1234;
+// 积压的响应超过这个大小就暂停读取, 先把数据发出去
+static size_t g_out_hwm = 64 * 1024;
+// 每个连接缓冲区的上限, 也就是单个请求或者响应的最大长度
+static size_t g_max_conn_buf = (size_t)32 << 20;
+// 每轮事件循环最多花这么多时间在后台迁移 HMap 上, 0 表示只在访问的时候迁移
+static uint64_t g_rehash_budget_us = 1000;
+
+// 每个线程一份, 只有自己的 reactor 会访问, 所以不需要加锁
+static thread_local struct
 {
+    Shard *shard = NULL;
     HMap db;
     std::vector<Conn *> fd2conn;
     DList idle_list;
     // 自动变长数组
     std::vector<HeapItem> heap;
-    // 线程池 new
-    ThreadPool tp;
+    // epoll 实例, 只在 epoll 后端中使用
+    int epfd = -1;
+#if defined(USE_IO_URING)
+    URing ring;
+    // 是否成功注册了固定缓冲区
+    bool uring_fixed = false;
+#endif
+    // 本线程发起的后台快照的子进程, 和接收结果的管道
+    pid_t save_child = -1;
+    int save_pipe = -1;
+    // 这一轮事件循环里要追加到 AOF 和复制积压缓冲区的记录, 循环结尾一次写出去
+    bool aof_on = false;
+    std::string aof_buf;
+    // 写过多少次 aof_buf, 用来判断一个命令有没有写日志
+    uint64_t aof_fed = 0;
+    // always 模式下等 fsync 的连接和转发过来的请求, 按批的序号排好
+    DList aof_conns;
+    DList aof_mails;
+    // 本线程发起的 AOF 重写
+    pid_t aof_child = -1;
+    int aof_pipe = -1;
+    int64_t aof_rewrite_id = -1;
+    uint64_t aof_retry_us = 0;
 } g_data;
 
-const size_t k_max_msg = 4096;
+// 当前线程接管一个分片
+static void shard_attach(Shard *shard)
+{
+    g_data.shard = shard;
+    shard->db = &g_data.db;
+    shard->heap = &g_data.heap;
+}
+
+// key 属于哪个分片: 分片用哈希的高 32 位, 分片内的哈希表用低位, 两者互不影响.
+// key 里有 {...} 的时候只看第一对花括号里的部分 (不能是空的), 多个 key 的命令可以用它把 key 放在同一个分片
+static Shard *key_owner(std::string_view key)
+{
+    size_t l = key.find('{');
+    if (l != std::string_view::npos)
+    {
+        size_t r = key.find('}', l + 1);
+        if (r != std::string_view::npos && r > l + 1)
+        {
+            key = key.substr(l + 1, r - l - 1);
+        }
+    }
+    uint64_t h = str_hash((uint8_t *)key.data(), key.size());
+    return &g_shards[(h >> 32) % g_nshards];
+}
+
+// 线程池 new, 所有分片共用
+static ThreadPool g_tp;
 
 enum
 {
     STATE_REQ = 0,
-    STATE_RES = 1,
+    STATE_RES = 1, // 积压的响应太多, 暂停读取
     STATE_END = 2, // 标记连接已经被删除
+    STATE_WAIT = 3, // 请求转发给了其它分片, 等待结果
+};
+
+// always 模式下等 fsync 的回复
+struct AofWait
+{
+    // 不在等待的时候是 NULL
+    DList link;
+    // 回复所在的批的序号, 0 表示还在本轮的缓冲区里
+    uint64_t seq = 0;
 };
 
 struct Conn
 {
     int fd = -1;
-    uint32_t state = 0; // 可能是 STATE_REQ 或者 STATE_RES
-    // 读缓存区
-    size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
-    // 写缓冲区
-    size_t wbuf_size = 0;
-    size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+    uint32_t state = 0; // 可能是 STATE_REQ, STATE_RES 或者 STATE_WAIT
+    // 读缓存区, 按需从缓冲池借内存, 空闲的连接不占内存
+    Buffer rbuf;
+    // 写缓冲区, 一次读到的所有请求的响应都追加在这里, 最后统一发送
+    Buffer wbuf;
+#if defined(USE_IO_URING)
+    // 正在发送的数据, 发送期间新的响应继续追加到 wbuf
+    Buffer wbuf_inflight;
+#endif
     uint64_t idle_start = 0;
     DList idle_list;
+    // 当前在 epoll 中注册的事件
+    uint32_t events = 0;
+    // 进行中的 io_uring 操作
+    uint32_t uring_ops = 0;
+    bool uring_cancel = false;
+    // 写缓冲区里有回复在等 AOF 的 fsync, 这期间不发送
+    AofWait aof;
+    // 有请求转发给了其它分片, 结果还没回来. 这期间 Mail 指着这个连接, 出错了也不能释放
+    bool mail_out = false;
 };
 
 // 将连接对象放到集合中
@@ -109,45 +242,169 @@ static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
     fd2conn[conn->fd] = conn;
 }
 
-// 接收一个新的连接，通过fd的方式
-static int32_t accept_new_conn(int fd)
+// 是否还有没发出去的响应
+static bool conn_out_pending(Conn *conn)
 {
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
-    if (connfd < 0)
+#if defined(USE_IO_URING)
+    if (buf_size(&conn->wbuf_inflight))
     {
-        msg("accept() error");
-        return -1;
+        return true;
+    }
+#endif
+    return buf_size(&conn->wbuf) > 0;
+}
+
+// 回复在等 AOF 的 fsync, 先不发
+static bool conn_aof_held(Conn *conn)
+{
+    return conn->aof.link.next != NULL;
+}
+
+static void aof_unhold(AofWait *w)
+{
+    if (w->link.next)
+    {
+        dlist_detach(&w->link);
+        w->link.prev = w->link.next = NULL;
+    }
+}
+
+// epoll 后端: 每个连接只在创建时注册一次, 之后只有 state 变化时才修改关注的事件
+// 使用边缘触发, 所以读写都必须做到 EAGAIN 为止
+static uint32_t conn_events(Conn *conn)
+{
+#if !defined(USE_EPOLL)
+    (void)conn;
+    return 0;
+#else
+    uint32_t events = 0;
+    if (conn->state == STATE_REQ)
+    {
+        events |= EPOLLIN;
+    }
+    if (conn_out_pending(conn) && !conn_aof_held(conn))
+    {
+        events |= EPOLLOUT;
+    }
+    return events | EPOLLET;
+#endif
+}
+
+#if defined(USE_IO_URING)
+static void state_req(Conn *conn);
+#endif
+
+static void ev_add(Conn *conn)
+{
+    conn->events = conn_events(conn);
+#if defined(USE_IO_URING)
+    // io_uring 没有"关注"的概念, 直接投递第一个读
+    state_req(conn);
+#endif
+#if defined(USE_EPOLL)
+    struct epoll_event ev = {};
+    ev.events = conn->events;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, conn->fd, &ev))
+    {
+        die("epoll_ctl(ADD)");
+    }
+#endif
+}
+
+static void ev_update(Conn *conn)
+{
+    uint32_t events = conn_events(conn);
+    if (events == conn->events)
+    {
+        return;
+    }
+    conn->events = events;
+#if defined(USE_EPOLL)
+    // EPOLL_CTL_MOD 会重新检查就绪状态, 切换之后不会丢失边缘
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_MOD, conn->fd, &ev))
+    {
+        die("epoll_ctl(MOD)");
     }
+#endif
+}
+
+static void ev_del(Conn *conn)
+{
+#if defined(USE_EPOLL)
+    (void)epoll_ctl(g_data.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+#else
+    (void)conn;
+#endif
+}
+
+// 为已经 accept 的 fd 创建连接
+static int32_t conn_new(int connfd)
+{
     // 设置连接为非阻塞模式
     fd_set_nb(connfd);
     // 创建Conn 结构体
-    struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn));
-    if (!conn)
-    {
-        close(connfd);
-        return -1;
-    }
+    struct Conn *conn = new Conn();
     conn->fd = connfd;
     conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
     conn->idle_start = get_monotonic_usec();
     dlist_insert_before(&g_data.idle_list, &conn->idle_list);
     // 将conn放到全局变量中
     conn_put(g_data.fd2conn, conn);
+    ev_add(conn);
     return 0;
 }
 
+#if !defined(USE_IO_URING)
+// 接收一个新的连接，通过fd的方式
+static int32_t accept_new_conn(int fd)
+{
+    struct sockaddr_in client_addr = {};
+    socklen_t socklen = sizeof(client_addr);
+    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+    if (connfd < 0)
+    {
+        if (errno != EAGAIN)
+        {
+            msg("accept() error");
+        }
+        return -1;
+    }
+    return conn_new(connfd);
+}
+#endif
+
 static void state_req(Conn *conn);
 static void state_res(Conn *conn);
+static void conn_done(Conn *conn);
+
+// 总长度还受 --max-buf 限制, 一个大的 ZADD 可以带很多成员
+const size_t k_max_args = (size_t)4 << 20;
+// 大部分命令的参数不超过这个数, 直接放在栈上
+const size_t k_cmd_inline = 8;
+
+// 解析好的请求, 参数只是指向读缓冲区的切片, 不拷贝
+// 需要保存下来的值 (key, value, zset 成员名) 由各个命令自己拷贝到最终的位置
+struct Cmd
+{
+    size_t argc = 0;
+    std::string_view args[k_cmd_inline];
+    // 参数太多的时候全部放到这里
+    std::vector<std::string_view> spill;
+
+    size_t size() const { return argc; }
+    bool empty() const { return argc == 0; }
+    std::string_view &operator[](size_t i)
+    {
+        return argc <= k_cmd_inline ? args[i] : spill[i];
+    }
+};
 
-const size_t k_max_args = 1024;
 // why 4
-static int32_t parse_req(
-    const uint8_t *data, size_t len, std::vector<std::string> &out)
+static int32_t parse_req(const uint8_t *data, size_t len, Cmd &out)
 {
     if (len < 4)
     {
@@ -156,14 +413,20 @@ static int32_t parse_req(
     uint32_t n = 0;
     // 获取参数的长度
     memcpy(&n, &data[0], 4);
-    if (n > k_max_args)
+    // 每个参数至少有 4 字节的长度, 先检查再分配
+    if (n > k_max_args || 4 + 4 * (size_t)n > len)
     {
         return -1;
     }
+    out.argc = n;
+    if (n > k_cmd_inline)
+    {
+        out.spill.resize(n);
+    }
 
     size_t pos = 4;
     // why pos = 4
-    while (n--)
+    for (size_t i = 0; i < out.argc; i++)
     {
         if (pos + 4 > len)
         {
@@ -175,7 +438,7 @@ static int32_t parse_req(
         {
             return -1;
         }
-        out.push_back(std::string((char *)&data[pos + 4], sz));
+        out[i] = std::string_view((char *)&data[pos + 4], sz);
         pos += 4 + sz;
     }
     if (pos != len)
@@ -185,28 +448,224 @@ static int32_t parse_req(
     return 0;
 }
 
+// 命令名和选项不区分大小写
+static bool cmd_is(std::string_view word, const char *cmd)
+{
+    return word.size() == strlen(cmd)
+        && 0 == strncasecmp(word.data(), cmd, word.size());
+}
+
+// 参数不是以 0 结尾的, 先拷贝到栈上再转换
+static bool str2cstr(std::string_view s, char *buf, size_t cap)
+{
+    if (s.size() >= cap)
+    {
+        return false;
+    }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    return true;
+}
+
+static bool str2int(std::string_view s, int64_t &out)
+{
+    char buf[32];
+    if (!str2cstr(s, buf, sizeof(buf)))
+    {
+        return false;
+    }
+    // 空串和超出范围的都不算整数
+    char *endp = NULL;
+    errno = 0;
+    out = strtoll(buf, &endp, 10);
+    return !s.empty() && endp == buf + s.size() && errno != ERANGE;
+}
+
+// 整数转成字符串最多要的字节数 (-9223372036854775808)
+const size_t k_int_str = 24;
+
+// 写在 buf 的末尾, 返回写好的部分
+static std::string_view int2str(int64_t v, char *buf)
+{
+    char *end = buf + k_int_str;
+    char *p = end;
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    do
+    {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0)
+    {
+        *--p = '-';
+    }
+    return std::string_view(p, (size_t)(end - p));
+}
+
+// 规范写法的 int64: 没有正号, 空格和多余的 0, 转回字符串和原来完全一样, 所以可以只存整数
+static bool str_as_int(std::string_view s, int64_t &out)
+{
+    if (s.empty() || s.size() > 20 || !(s[0] == '-' || (s[0] >= '0' && s[0] <= '9')))
+    {
+        return false;
+    }
+    char buf[k_int_str];
+    return str2int(s, out) && int2str(out, buf) == s;
+}
+
 enum
 {
     T_STR = 0,
     T_ZSET = 1,
 };
 
-// key的结构
+// key的结构. 一次分配, 头部后面紧跟着变长的部分:
+//   [堆里的下标 size_t, 只有设了 TTL 才有] [ZSet 指针, 或者字符串值的长度 uint32_t] [key] [字符串的值]
+// 字符串的值是规范写法的整数的时候 (E_INT), 长度和值换成一个 int64_t: [堆里的下标] [整数] [key]
+// 改值或者加 TTL 放不下的时候换一块新的, 见 entry_resize
 struct Entry
 {
     struct HNode node;
-    std::string key;
-    std::string val;
-    uint32_t type = 0;
-    ZSet *zset = NULL;
-    size_t heap_idx = -1;
+    uint32_t klen = 0;
+    uint8_t type = 0;
+    uint8_t flags = 0;
+    uint64_t data[0];
+};
+
+// Entry::flags
+enum
+{
+    E_TTL = 1,
+    E_INT = 2,
+};
+
+static size_t entry_size(uint32_t type, uint8_t flags, size_t klen, size_t vlen)
+{
+    size_t size = sizeof(Entry) + (flags & E_TTL ? sizeof(size_t) : 0) + klen;
+    if (type == T_ZSET || (flags & E_INT))
+    {
+        return size + 8;
+    }
+    return size + sizeof(uint32_t) + vlen;
+}
+
+// 变长部分的开头, 跳过 TTL 的下标
+static uint8_t *entry_body(Entry *ent)
+{
+    return (uint8_t *)ent->data + (ent->flags & E_TTL ? sizeof(size_t) : 0);
+}
+
+// 堆里的下标, 没有 TTL 的 Entry 返回 NULL
+static size_t *entry_heap_idx(Entry *ent)
+{
+    return ent->flags & E_TTL ? (size_t *)ent->data : NULL;
+}
+
+// 堆里的引用指向的 Entry, 下标就在头部后面
+static Entry *entry_from_heap_idx(size_t *idx)
+{
+    return (Entry *)((uint8_t *)idx - offsetof(Entry, data));
+}
+
+static ZSet *&entry_zset(Entry *ent)
+{
+    assert(ent->type == T_ZSET);
+    return *(ZSet **)entry_body(ent);
+}
+
+static int64_t &entry_int(Entry *ent)
+{
+    assert(ent->flags & E_INT);
+    return *(int64_t *)entry_body(ent);
+}
+
+// 字符串值的字节数, 整数编码的是 0
+static uint32_t entry_vlen(Entry *ent)
+{
+    return ent->type == T_STR && !(ent->flags & E_INT) ? *(uint32_t *)entry_body(ent) : 0;
+}
+
+static char *entry_key_ptr(Entry *ent)
+{
+    bool word = ent->type == T_ZSET || (ent->flags & E_INT);
+    return (char *)entry_body(ent) + (word ? 8 : sizeof(uint32_t));
+}
+
+static std::string_view entry_key(Entry *ent)
+{
+    return std::string_view(entry_key_ptr(ent), ent->klen);
+}
+
+// 字符串的值. 整数编码的这时候才转成字符串, 写在 buf 里 (k_int_str 字节)
+static std::string_view entry_val(Entry *ent, char *buf)
+{
+    if (ent->flags & E_INT)
+    {
+        return int2str(entry_int(ent), buf);
+    }
+    return std::string_view(entry_key_ptr(ent) + ent->klen, entry_vlen(ent));
+}
+
+// 新建一个还没插进 db 的 Entry. 字符串的值是 val (能存成整数的自动存成整数), zset 的指针由调用方设置
+static Entry *entry_new(std::string_view key, uint64_t hcode, uint32_t type, uint8_t flags,
+                        std::string_view val = {})
+{
+    int64_t ival = 0;
+    flags &= ~E_INT;
+    if (type == T_STR && str_as_int(val, ival))
+    {
+        flags |= E_INT;
+    }
+    size_t size = entry_size(type, flags, key.size(), val.size());
+    Entry *ent = new (slab_alloc(size)) Entry();
+    ent->node.hcode = hcode;
+    ent->klen = (uint32_t)key.size();
+    ent->type = (uint8_t)type;
+    ent->flags = flags;
+    if (flags & E_TTL)
+    {
+        *entry_heap_idx(ent) = -1;
+    }
+    if (type == T_ZSET)
+    {
+        entry_zset(ent) = NULL;
+    }
+    else if (flags & E_INT)
+    {
+        entry_int(ent) = ival;
+    }
+    else
+    {
+        *(uint32_t *)entry_body(ent) = (uint32_t)val.size();
+        memcpy(entry_key_ptr(ent) + key.size(), val.data(), val.size());
+    }
+    memcpy(entry_key_ptr(ent), key.data(), key.size());
+    return ent;
+}
+
+static void entry_free(Entry *ent)
+{
+    slab_free(ent, entry_size(ent->type, ent->flags, ent->klen, entry_vlen(ent)));
+}
+
+// 查找用的 key, 直接指向请求里的参数
+struct EKey
+{
+    HNode node;
+    std::string_view key;
 };
 
-static bool entry_eq(HNode *lhs, HNode *rhs)
+static void ekey_init(EKey *key, std::string_view s)
+{
+    key->key = s;
+    key->node.hcode = str_hash((uint8_t *)s.data(), s.size());
+}
+
+static bool entry_eq(HNode *node, HNode *key)
 {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return lhs->hcode == rhs->hcode && le->key == re->key;
+    struct Entry *ent = container_of(node, struct Entry, node);
+    struct EKey *ekey = container_of(key, struct EKey, node);
+    return node->hcode == key->hcode && entry_key(ent) == ekey->key;
 }
 
 enum
@@ -215,69 +674,126 @@ enum
     ERR_2BIG = 2,
     ERR_TYPE = 3,
     ERR_ARG = 4,
+    ERR_READONLY = 5,
+    ERR_CROSS_SHARD = 6,
 };
 
-static void out_nil(std::string &out)
+// 响应直接序列化到连接的写缓冲区里
+static void out_nil(Buffer &out)
 {
-    out.push_back(SER_NIL);
+    uint8_t type = SER_NIL;
+    buf_append(&out, &type, 1);
 }
 
 // 使用char + len 替换 std::string
-static void out_str(std::string &out, const char *s, size_t size)
+static void out_str(Buffer &out, const char *s, size_t size)
 {
-    out.push_back(SER_STR);
+    uint8_t type = SER_STR;
     uint32_t len = (uint32_t)size;
-    out.append((char *)&len, 4);
-    out.append(s, len);
+    buf_reserve(&out, 1 + 4 + size);
+    buf_append(&out, &type, 1);
+    buf_append(&out, &len, 4);
+    buf_append(&out, s, len);
 }
 
-static void out_str(std::string &out, const std::string &val)
+static void out_str(Buffer &out, std::string_view val)
 {
     return out_str(out, val.data(), val.size());
 }
 
-static void out_int(std::string &out, int64_t val)
+static void out_int(Buffer &out, int64_t val)
 {
-    out.push_back(SER_INT);
-    out.append((char *)&val, 8);
+    uint8_t type = SER_INT;
+    buf_append(&out, &type, 1);
+    buf_append(&out, &val, 8);
 }
 
-static void out_dbl(std::string &out, double val)
+static void out_dbl(Buffer &out, double val)
 {
-    out.push_back(SER_DBL);
-    out.append((char *)&val, 8);
+    uint8_t type = SER_DBL;
+    buf_append(&out, &type, 1);
+    buf_append(&out, &val, 8);
 }
 
-static void out_err(std::string &out, int32_t code, const std::string &msg)
+static void out_err(Buffer &out, int32_t code, const std::string &msg)
 {
-    out.push_back(SER_ERR);
-    out.append((char *)&code, 4);
+    uint8_t type = SER_ERR;
     uint32_t len = (uint32_t)msg.size();
-    out.append((char *)&len, 4);
-    out.append(msg);
+    buf_append(&out, &type, 1);
+    buf_append(&out, &code, 4);
+    buf_append(&out, &len, 4);
+    buf_append(&out, msg.data(), len);
+}
+
+static void out_arr(Buffer &out, uint32_t n)
+{
+    uint8_t type = SER_ARR;
+    buf_append(&out, &type, 1);
+    buf_append(&out, &n, 4);
+}
+
+// 元素个数事先不知道的数组, 先占位, 最后再填
+static size_t out_begin_arr(Buffer &out)
+{
+    size_t pos = buf_size(&out);
+    out_arr(out, 0);
+    return pos;
+}
+
+static void out_end_arr(Buffer &out, size_t pos, uint32_t n)
+{
+    assert(buf_head(&out)[pos] == SER_ARR);
+    memcpy(&buf_head(&out)[pos + 1], &n, 4);
 }
 
-static void out_arr(std::string &out, uint32_t n)
+// 复制积压缓冲区, 第一个从节点来全量同步的时候才分配, 之后所有的写命令都追加进去
+static ReplBacklog g_backlog;
+static size_t g_backlog_size = (size_t)1 << 20;
+// 只在所有分片都暂停的时候打开, 所以分片线程读它不用加锁
+static bool g_repl_feed = false;
+// 从节点要连的主节点 (--replicaof), NULL 表示自己是主节点
+static const char *g_replicaof = NULL;
+// 复制的统计, 原子地读写
+static struct
+{
+    // 主节点: 连着的从节点个数
+    uint64_t replicas = 0;
+    // 全量同步和部分同步的次数, 主节点和从节点各自统计
+    uint64_t full_syncs = 0;
+    uint64_t partial_syncs = 0;
+    // 从节点: 已经收到的命令流的偏移量, 和主节点的连接是否正常
+    uint64_t offset = 0;
+    uint64_t link_up = 0;
+} g_repl_stats;
+
+// 主节点的复制 id, 启动时随机生成. 重启之后命令流重新开始, 从节点只能全量同步
+static std::string g_repl_id;
+
+// 修改了数据的命令追加到本轮的 AOF 缓冲区 (同时也是复制的命令流). 由各个写命令在真正改了数据之后调用,
+// 出错或者没有效果的命令不写, 和时间有关的参数换成绝对时间
+static void aof_feed(const std::string_view *args, size_t n)
 {
-    out.push_back(SER_ARR);
-    out.append((char *)&n, 4);
+    if (!g_data.aof_on && !g_repl_feed)
+    {
+        return;
+    }
+    aof_encode(g_data.aof_buf, args, n);
+    g_data.aof_fed++;
 }
 
-static void out_update_arr(std::string &out, uint32_t n)
+static void aof_feed_cmd(Cmd &cmd)
 {
-    assert(out[0] == SER_ARR);
-    memcpy(&out[1], &n, 4);
+    aof_feed(cmd.argc <= k_cmd_inline ? cmd.args : cmd.spill.data(), cmd.argc);
 }
 
 /**
  * 将返回的res和reslen替换成out
  */
 static void do_get(
-    std::vector<std::string> &cmd, std::string &out)
+    Cmd &cmd, Buffer &out)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    EKey key;
+    ekey_init(&key, cmd[1]);
     // lookup
     HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
     if (!node)
@@ -291,16 +807,68 @@ static void do_get(
         return out_err(out, ERR_TYPE, "expect string type");
     }
 
-    return out_str(out, ent->val);
+    char buf[k_int_str];
+    return out_str(out, entry_val(ent, buf));
+}
+
+static bool hnode_same(HNode *lhs, HNode *rhs)
+{
+    return lhs == rhs;
+}
+
+// 换一个字符串值, 或者加上/去掉 TTL 的下标. 新的大小还在同一个 slab 类里就原地改,
+// 否则换一块新的: 替换掉 db 里的节点, 堆里的引用指向新的下标. 返回新的 Entry, 旧的指针不能再用
+static Entry *entry_resize(Entry *ent, uint8_t flags, std::string_view val)
+{
+    int64_t ival = 0;
+    flags &= ~E_INT;
+    if (ent->type == T_STR && str_as_int(val, ival))
+    {
+        flags |= E_INT;
+    }
+    size_t old_size = entry_size(ent->type, ent->flags, ent->klen, entry_vlen(ent));
+    size_t new_size = entry_size(ent->type, flags, ent->klen, val.size());
+    if (flags == ent->flags && slab_size(new_size) == slab_size(old_size))
+    {
+        if (flags & E_INT)
+        {
+            entry_int(ent) = ival;
+        }
+        else if (ent->type == T_STR)
+        {
+            *(uint32_t *)entry_body(ent) = (uint32_t)val.size();
+            memmove(entry_key_ptr(ent) + ent->klen, val.data(), val.size());
+        }
+        return ent;
+    }
+    Entry *copy = entry_new(entry_key(ent), ent->node.hcode, ent->type, flags, val);
+    if (ent->type == T_ZSET)
+    {
+        entry_zset(copy) = entry_zset(ent);
+    }
+    size_t *idx = entry_heap_idx(ent);
+    if (idx && entry_heap_idx(copy))
+    {
+        *entry_heap_idx(copy) = *idx;
+        if (*idx != (size_t)-1)
+        {
+            g_data.heap[*idx].ref = entry_heap_idx(copy);
+        }
+    }
+    HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    (void)node;
+    hm_insert(&g_data.db, &copy->node);
+    entry_free(ent);
+    return copy;
 }
 
 static void do_set(
-    std::vector<std::string> &cmd, std::string &out)
+    Cmd &cmd, Buffer &out)
 {
-    // 构建 Entry
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    // 构建查找用的 key
+    EKey key;
+    ekey_init(&key, cmd[1]);
 
     // 先看看是否已经存在了key
     HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
@@ -312,86 +880,198 @@ static void do_set(
         {
             return out_err(out, ERR_TYPE, "expect string type");
         }
-        ent->val.swap(cmd[2]);
+        entry_resize(ent, ent->flags, cmd[2]);
     }
     else
     {
         // 插入
-        Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->val.swap(cmd[2]);
+        Entry *ent = entry_new(key.key, key.node.hcode, T_STR, 0, cmd[2]);
         hm_insert(&g_data.db, &ent->node);
     }
+    aof_feed_cmd(cmd);
 
     return out_nil(out);
 }
 
-// 设置或删除 TTL
-static void entry_set_ttl(Entry *ent, int64_t ttl_ms)
+// INCR 一族共用: 整数编码的值原地加, 不存在的 key 当成 0. 命令原样写进 AOF, 重放的结果是一样的
+static void do_incr_by(Cmd &cmd, Buffer &out, int64_t delta)
 {
-    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1)
+    EKey key;
+    ekey_init(&key, cmd[1]);
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!node)
     {
-        // 从heap中擦除item，通过将item替换到末尾
-        size_t pos = ent->heap_idx;
-        g_data.heap[pos] = g_data.heap.back();
-        g_data.heap.pop_back();
-        if (pos < g_data.heap.size())
-        {
-            heap_update(g_data.heap.data(), pos, g_data.heap.size());
-        }
-        ent->heap_idx = -1;
+        char buf[k_int_str];
+        Entry *ent = entry_new(key.key, key.node.hcode, T_STR, 0, int2str(delta, buf));
+        hm_insert(&g_data.db, &ent->node);
+        aof_feed_cmd(cmd);
+        return out_int(out, delta);
+    }
+
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR)
+    {
+        return out_err(out, ERR_TYPE, "expect string type");
     }
-    else if (ttl_ms >= 0)
+    if (!(ent->flags & E_INT))
     {
-        size_t pos = ent->heap_idx;
-        if (pos == (size_t)-1)
-        {
-            // add an new item to the heap
-            HeapItem item;
-            item.ref = &ent->heap_idx;
-            g_data.heap.push_back(item);
-            pos = g_data.heap.size() - 1;
-        }
-        g_data.heap[pos].val = get_monotonic_usec() + (uint64_t)ttl_ms * 1000;
-        heap_update(g_data.heap.data(), pos, g_data.heap.size());
+        return out_err(out, ERR_TYPE, "value is not an integer");
+    }
+    int64_t val = 0;
+    if (__builtin_add_overflow(entry_int(ent), delta, &val))
+    {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
     }
+    entry_int(ent) = val;
+    aof_feed_cmd(cmd);
+    return out_int(out, val);
 }
 
-static bool str2int(const std::string &s, int64_t &out)
+static void do_incr(Cmd &cmd, Buffer &out)
 {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    return do_incr_by(cmd, out, 1);
 }
 
-static void do_expire(std::vector<std::string> &cmd, std::string &out)
+static void do_decr(Cmd &cmd, Buffer &out)
 {
-    int64_t ttl_ms = 0;
-    if (!str2int(cmd[2], ttl_ms))
-    {
-        return out_err(out, ERR_ARG, "expect int64");
-    }
-
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    return do_incr_by(cmd, out, -1);
+}
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node)
+static void do_incrby(Cmd &cmd, Buffer &out)
+{
+    int64_t delta = 0;
+    if (!str2int(cmd[2], delta))
     {
-        Entry *ent = container_of(node, Entry, node);
-        entry_set_ttl(ent, ttl_ms);
+        return out_err(out, ERR_ARG, "value is not an integer");
     }
-    return out_int(out, node ? 1 : 0);
+    return do_incr_by(cmd, out, delta);
 }
 
-static void do_ttl(std::vector<std::string> &cmd, std::string &out)
+static void do_decrby(Cmd &cmd, Buffer &out)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
+    int64_t delta = 0;
+    if (!str2int(cmd[2], delta))
+    {
+        return out_err(out, ERR_ARG, "value is not an integer");
+    }
+    if (delta == INT64_MIN)
+    {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    return do_incr_by(cmd, out, -delta);
+}
+
+// 从堆里去掉, Entry 本身不变
+static void entry_heap_del(Entry *ent)
+{
+    size_t *idx = entry_heap_idx(ent);
+    if (!idx || *idx == (size_t)-1)
+    {
+        return;
+    }
+    // 从heap中擦除item，通过将item替换到末尾
+    size_t pos = *idx;
+    g_data.heap[pos] = g_data.heap.back();
+    g_data.heap.pop_back();
+    if (pos < g_data.heap.size())
+    {
+        heap_update(g_data.heap.data(), pos, g_data.heap.size());
+    }
+    *idx = -1;
+}
+
+// 设置或删除 TTL, 可能换成新的 Entry (见 entry_resize), 返回新的
+static Entry *entry_set_ttl(Entry *ent, int64_t ttl_ms)
+{
+    if (ttl_ms < 0)
+    {
+        if (ent->flags & E_TTL)
+        {
+            char buf[k_int_str];
+            entry_heap_del(ent);
+            ent = entry_resize(ent, ent->flags & ~E_TTL, entry_val(ent, buf));
+        }
+        return ent;
+    }
+    if (!(ent->flags & E_TTL))
+    {
+        char buf[k_int_str];
+        ent = entry_resize(ent, ent->flags | E_TTL, entry_val(ent, buf));
+    }
+    size_t pos = *entry_heap_idx(ent);
+    if (pos == (size_t)-1)
+    {
+        // add an new item to the heap
+        HeapItem item;
+        item.ref = entry_heap_idx(ent);
+        g_data.heap.push_back(item);
+        pos = g_data.heap.size() - 1;
+    }
+    g_data.heap[pos].val = get_monotonic_usec() + (uint64_t)ttl_ms * 1000;
+    heap_update(g_data.heap.data(), pos, g_data.heap.size());
+    return ent;
+}
+
+static void do_expire(Cmd &cmd, Buffer &out)
+{
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms))
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+
+    EKey key;
+    ekey_init(&key, cmd[1]);
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (node)
+    {
+        Entry *ent = container_of(node, Entry, node);
+        entry_set_ttl(ent, ttl_ms);
+        if (ttl_ms < 0)
+        {
+            aof_feed_cmd(cmd);
+        }
+        else
+        {
+            // 重放的时候过期时间不能从重放的那一刻算起
+            std::string at = std::to_string(get_realtime_msec() + ttl_ms);
+            std::string_view args[3] = {"pexpireat", cmd[1], at};
+            aof_feed(args, 3);
+        }
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+// pexpireat key unix_ms, 主要用于 AOF 记录过期时间
+static void do_expireat(Cmd &cmd, Buffer &out)
+{
+    int64_t at_ms = 0;
+    if (!str2int(cmd[2], at_ms))
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+
+    EKey key;
+    ekey_init(&key, cmd[1]);
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (node)
+    {
+        Entry *ent = container_of(node, Entry, node);
+        int64_t ttl_ms = at_ms - get_realtime_msec();
+        // 已经过了的时间点, 交给定时器马上删掉
+        entry_set_ttl(ent, ttl_ms > 0 ? ttl_ms : 0);
+        aof_feed_cmd(cmd);
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+static void do_ttl(Cmd &cmd, Buffer &out)
+{
+    EKey key;
+    ekey_init(&key, cmd[1]);
+
     HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
     if (!node)
     {
@@ -399,12 +1079,13 @@ static void do_ttl(std::vector<std::string> &cmd, std::string &out)
     }
 
     Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1)
+    size_t *idx = entry_heap_idx(ent);
+    if (!idx || *idx == (size_t)-1)
     {
         return out_int(out, -1);
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t expire_at = g_data.heap[*idx].val;
     uint64_t now_us = get_monotonic_usec();
     return out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0);
 }
@@ -415,11 +1096,11 @@ static void entry_destroy(Entry *ent)
     switch (ent->type)
     {
     case T_ZSET:
-        zset_dispose(ent->zset);
-        delete ent->zset;
+        zset_dispose(entry_zset(ent));
+        delete entry_zset(ent);
         break;
     }
-    delete ent;
+    entry_free(ent);
 }
 
 static void entry_del_async(void *arg)
@@ -430,20 +1111,22 @@ static void entry_del_async(void *arg)
 // 重新包装一下
 static void entry_del(Entry *ent)
 {
-    entry_set_ttl(ent, -1);
+    entry_heap_del(ent);
 
     const size_t k_large_container_size = 10000;
     bool too_big = false;
     switch (ent->type)
     {
     case T_ZSET:
-        too_big = hm_size(&ent->zset->hmap) > k_large_container_size;
+        too_big = zset_size(entry_zset(ent)) > k_large_container_size;
         break;
     }
 
     if (too_big)
     {
-        thread_pool_queue(&g_data.tp, &entry_del_async, ent);
+        // 交给线程池之前, 从本线程的后台迁移列表里去掉
+        hm_untrack(&entry_zset(ent)->hmap);
+        thread_pool_queue(&g_tp, &entry_del_async, ent);
     }
     else
     {
@@ -452,348 +1135,3059 @@ static void entry_del(Entry *ent)
 }
 
 static void do_del(
-    std::vector<std::string> &cmd, std::string &out)
+    Cmd &cmd, Buffer &out)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    EKey key;
+    ekey_init(&key, cmd[1]);
     HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
     if (node)
     {
         entry_del(container_of(node, Entry, node));
+        aof_feed_cmd(cmd);
     }
     return out_int(out, node ? 1 : 0);
 }
 
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg)
+// 多个 key 的命令每批查这么多个 key
+const size_t k_mkey_batch = 32;
+// 每个 Entry 预取的字节数, 短的 key 和值都在里面
+const size_t k_mkey_prefetch = 128;
+
+// 多个 key 一起查之前, 先算好这一批所有 key 的哈希, 预取所有的桶, 再预取桶里的 Entry,
+// 之后真正查找的时候各个 key 的 cache miss 已经重叠着在路上了, 不用一个等完再等下一个
+static void db_prefetch(Cmd &cmd, size_t first, size_t step, size_t n, EKey *keys)
 {
-    if (tab->size == 0)
+    for (size_t i = 0; i < n; i++)
     {
-        return;
+        ekey_init(&keys[i], cmd[first + i * step]);
+        hm_prefetch(&g_data.db, keys[i].node.hcode);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        hm_prefetch_node(&g_data.db, keys[i].node.hcode, k_mkey_prefetch);
+    }
+}
+
+// mget key [key ...], 不存在的和不是字符串的 key 返回 nil
+static void do_mget(Cmd &cmd, Buffer &out)
+{
+    size_t nkeys = cmd.size() - 1;
+    out_arr(out, (uint32_t)nkeys);
+    EKey keys[k_mkey_batch];
+    for (size_t base = 0; base < nkeys; base += k_mkey_batch)
+    {
+        size_t n = nkeys - base < k_mkey_batch ? nkeys - base : k_mkey_batch;
+        db_prefetch(cmd, 1 + base, 1, n, keys);
+        for (size_t i = 0; i < n; i++)
+        {
+            HNode *node = hm_lookup(&g_data.db, &keys[i].node, &entry_eq);
+            Entry *ent = node ? container_of(node, Entry, node) : NULL;
+            if (!ent || ent->type != T_STR)
+            {
+                out_nil(out);
+                continue;
+            }
+            char buf[k_int_str];
+            out_str(out, entry_val(ent, buf));
+        }
+    }
+}
+
+// mset key value [key value ...]. 有一个 key 不是字符串就什么都不改.
+// AOF 和复制流里记成一个个 set: 重放的时候分片数可能不一样, 一条记录只能有一个 key
+static void do_mset(Cmd &cmd, Buffer &out)
+{
+    if (cmd.size() % 2 != 1)
+    {
+        return out_err(out, ERR_ARG, "expect key value pairs");
+    }
+    size_t nkeys = cmd.size() / 2;
+    EKey keys[k_mkey_batch];
+    // 先检查类型, 预取之后第二遍的查找基本都在 cache 里
+    for (size_t base = 0; base < nkeys; base += k_mkey_batch)
+    {
+        size_t n = nkeys - base < k_mkey_batch ? nkeys - base : k_mkey_batch;
+        db_prefetch(cmd, 1 + 2 * base, 2, n, keys);
+        for (size_t i = 0; i < n; i++)
+        {
+            HNode *node = hm_lookup(&g_data.db, &keys[i].node, &entry_eq);
+            if (node && container_of(node, Entry, node)->type != T_STR)
+            {
+                return out_err(out, ERR_TYPE, "expect string type");
+            }
+        }
+    }
+    for (size_t base = 0; base < nkeys; base += k_mkey_batch)
+    {
+        size_t n = nkeys - base < k_mkey_batch ? nkeys - base : k_mkey_batch;
+        db_prefetch(cmd, 1 + 2 * base, 2, n, keys);
+        for (size_t i = 0; i < n; i++)
+        {
+            // 同一个 key 可能出现多次, 所以每个都要重新查
+            std::string_view val = cmd[2 + 2 * (base + i)];
+            HNode *node = hm_lookup(&g_data.db, &keys[i].node, &entry_eq);
+            if (node)
+            {
+                Entry *ent = container_of(node, Entry, node);
+                entry_resize(ent, ent->flags, val);
+            }
+            else
+            {
+                Entry *ent = entry_new(keys[i].key, keys[i].node.hcode, T_STR, 0, val);
+                hm_insert(&g_data.db, &ent->node);
+            }
+            std::string_view args[3] = {"set", keys[i].key, val};
+            aof_feed(args, 3);
+        }
     }
-    for (size_t i = 0; i < tab->mask + 1; i++)
+    return out_nil(out);
+}
+
+// mdel key [key ...], 返回删掉的个数. 和 mset 一样, 记成一个个 del
+static void do_mdel(Cmd &cmd, Buffer &out)
+{
+    size_t nkeys = cmd.size() - 1;
+    int64_t deleted = 0;
+    EKey keys[k_mkey_batch];
+    for (size_t base = 0; base < nkeys; base += k_mkey_batch)
     {
-        HNode *node = tab->tab[i];
-        while (node)
+        size_t n = nkeys - base < k_mkey_batch ? nkeys - base : k_mkey_batch;
+        db_prefetch(cmd, 1 + base, 1, n, keys);
+        for (size_t i = 0; i < n; i++)
         {
-            f(node, arg);
-            node = node->next;
+            HNode *node = hm_pop(&g_data.db, &keys[i].node, &entry_eq);
+            if (node)
+            {
+                entry_del(container_of(node, Entry, node));
+                std::string_view args[2] = {"del", keys[i].key};
+                aof_feed(args, 2);
+                deleted++;
+            }
         }
     }
+    return out_int(out, deleted);
 }
 
-static void cb_scan(HNode *node, void *arg)
+static bool cb_scan(HNode *node, void *arg)
 {
-    std::string &out = *(std::string *)arg;
-    out_str(out, container_of(node, Entry, node)->key);
+    Buffer &out = *(Buffer *)arg;
+    out_str(out, entry_key(container_of(node, Entry, node)));
+    return true;
 }
 
-static void do_keys(std::vector<std::string> &cmd, std::string &out)
+static void do_keys(Cmd &cmd, Buffer &out)
 {
     (void)cmd;
     out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
+    hm_foreach(&g_data.db, &cb_scan, &out);
 }
-static bool str2dbl(const std::string &s, double &out)
+
+// 匹配 [...] 里的字符集合, pos 指向 '[' 后面, 返回时指向 ']' 后面
+static bool glob_class(std::string_view pat, size_t &pos, char c)
 {
-    char *endp = NULL;
-    // 将字符串转换成浮点数
-    out = strtod(s.c_str(), &endp);
-    // 返回是否转换成功
-    return endp == s.c_str() + s.size() && !isnan(out);
+    bool neg = pos < pat.size() && (pat[pos] == '^' || pat[pos] == '!');
+    pos += neg;
+    bool hit = false;
+    for (bool first = true; pos < pat.size() && (first || pat[pos] != ']'); first = false)
+    {
+        char lo = pat[pos];
+        if (lo == '\\' && pos + 1 < pat.size())
+        {
+            lo = pat[++pos];
+        }
+        pos++;
+        char hi = lo;
+        if (pos + 1 < pat.size() && pat[pos] == '-' && pat[pos + 1] != ']')
+        {
+            hi = pat[pos + 1];
+            pos += 2;
+        }
+        hit = hit || (lo <= c && c <= hi);
+    }
+    pos += pos < pat.size();
+    return hit != neg;
 }
 
-static void do_zadd(std::vector<std::string> &cmd, std::string &out)
+// glob 风格的匹配: * ? [abc] [^a-z] 和 \ 转义
+// 遇到 * 的时候记下位置, 后面匹配失败就回到这里让 * 多吃一个字符
+static bool glob_match(std::string_view pat, std::string_view str)
 {
-    double score = 0;
-    if (!str2dbl(cmd[2], score))
+    size_t p = 0;
+    size_t s = 0;
+    size_t star_p = std::string_view::npos;
+    size_t star_s = 0;
+    while (s < str.size())
     {
-        return out_err(out, ERR_ARG, "expect fp number");
+        if (p < pat.size() && pat[p] == '*')
+        {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (p < pat.size())
+        {
+            size_t np = p + 1;
+            bool ok = false;
+            if (pat[p] == '?')
+            {
+                ok = true;
+            }
+            else if (pat[p] == '[')
+            {
+                ok = glob_class(pat, np, str[s]);
+            }
+            else if (pat[p] == '\\' && p + 1 < pat.size())
+            {
+                ok = pat[p + 1] == str[s];
+                np = p + 2;
+            }
+            else
+            {
+                ok = pat[p] == str[s];
+            }
+            if (ok)
+            {
+                p = np;
+                s++;
+                continue;
+            }
+        }
+        if (star_p == std::string_view::npos)
+        {
+            return false;
+        }
+        p = star_p;
+        s = ++star_s;
     }
-    // 创建
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // 查找
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    Entry *ent = NULL;
-    if (!hnode)
+    while (p < pat.size() && pat[p] == '*')
     {
-        // 如果不存在就新建一个并插入 hashtable中
-        ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->type = T_ZSET;
-        ent->zset = new ZSet();
-        hm_insert(&g_data.db, &ent->node);
+        p++;
     }
-    else
+    return p == pat.size();
+}
+
+// 分片的编号放在游标的高位, 低位是分片内哈希表的游标
+const int k_scan_shard_shift = 48;
+
+struct ScanCtx
+{
+    Buffer *out = NULL;
+    std::string_view pattern;
+    bool match_all = true;
+    uint32_t n = 0;
+};
+
+static void cb_scan_match(HNode *node, void *arg)
+{
+    ScanCtx *ctx = (ScanCtx *)arg;
+    std::string_view key = entry_key(container_of(node, Entry, node));
+    if (ctx->match_all || glob_match(ctx->pattern, key))
     {
-        // 如果hashtable中存在，要判定对应的这个node是否为ZSET
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET)
+        out_str(*ctx->out, key);
+        ctx->n++;
+    }
+}
+
+// SCAN cursor [MATCH pattern] [COUNT n], 返回 [下一个游标, [key ...]]
+// 每次只扫一部分桶, 不会像 KEYS 一样卡住整个事件循环
+static void do_scan(Cmd &cmd, Buffer &out)
+{
+    int64_t cursor = 0;
+    if (!str2int(cmd[1], cursor) || cursor < 0)
+    {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+    ScanCtx ctx;
+    ctx.out = &out;
+    int64_t count = 10;
+    for (size_t i = 2; i < cmd.size(); i += 2)
+    {
+        if (i + 1 >= cmd.size())
         {
-            return out_err(out, ERR_TYPE, "expect zset");
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+        if (cmd_is(cmd[i], "match"))
+        {
+            ctx.pattern = cmd[i + 1];
+            ctx.match_all = ctx.pattern == "*";
+        }
+        else if (cmd_is(cmd[i], "count"))
+        {
+            if (!str2int(cmd[i + 1], count) || count < 1)
+            {
+                return out_err(out, ERR_ARG, "expect positive int");
+            }
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "syntax error");
         }
     }
-    // 添加到zset中
-    const std::string &name = cmd[3];
-    bool added = zset_add(ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+
+    size_t shard = (uint64_t)cursor >> k_scan_shard_shift;
+    uint64_t pos = (uint64_t)cursor & ((1ull << k_scan_shard_shift) - 1);
+    if (shard != (g_data.shard ? g_data.shard->id : 0))
+    {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+
+    // 游标先占位, 扫完再填
+    out_arr(out, 2);
+    size_t cursor_pos = buf_size(&out);
+    out_int(out, 0);
+    size_t arr = out_begin_arr(out);
+    // COUNT 只是提示: 找到这么多个就停, 最多看 COUNT * 10 个桶. 除过去比较, 很大的 COUNT 乘 10 会溢出
+    int64_t nbuckets = 0;
+    do
+    {
+        pos = hm_scan(&g_data.db, pos, &cb_scan_match, &ctx);
+        nbuckets++;
+    } while (pos != 0 && ctx.n < (uint64_t)count && nbuckets / 10 < count);
+    out_end_arr(out, arr, ctx.n);
+
+    // 本分片扫完了, 游标指向下一个分片的开头
+    int64_t next = (int64_t)pos | ((int64_t)shard << k_scan_shard_shift);
+    if (pos == 0)
+    {
+        next = shard + 1 < g_nshards ? (int64_t)(shard + 1) << k_scan_shard_shift : 0;
+    }
+    memcpy(&buf_head(&out)[cursor_pos + 1], &next, 8);
 }
 
-static bool expect_zset(std::string &out, std::string &s, Entry **ent)
+// 快照: SAVE 在当前线程里写, BGSAVE fork 一个子进程来写, 父进程接着处理请求.
+// 数据分在各个分片线程里, 写之前 (或者 fork 之前) 让其它分片停在一轮事件循环的结尾,
+// 这时候它们的数据结构都是完整的. fork 之后马上恢复, 子进程看到的是 fork 那一刻的内存
+static pthread_mutex_t g_pause_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pause_cv = PTHREAD_COND_INITIALIZER;
+static bool g_pause = false;
+static size_t g_paused = 0;
+
+// 返回 false 表示别的分片正在暂停所有分片
+static bool shards_pause()
 {
-    // 通过s 来判定
-    Entry key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    pthread_mutex_lock(&g_pause_mu);
+    if (g_pause)
+    {
+        pthread_mutex_unlock(&g_pause_mu);
+        return false;
+    }
+    __atomic_store_n(&g_pause, true, __ATOMIC_RELEASE);
+    g_paused = 0;
+    pthread_mutex_unlock(&g_pause_mu);
 
-    if (!hnode)
+    // 通过邮箱的 eventfd 叫醒其它分片
+    for (size_t i = 0; i < g_nshards; i++)
+    {
+        if (&g_shards[i] != g_data.shard)
+        {
+            uint64_t one = 1;
+            ssize_t rv = write(g_shards[i].efd, &one, sizeof(one));
+            (void)rv;
+        }
+    }
+    pthread_mutex_lock(&g_pause_mu);
+    while (g_paused + 1 < g_nshards)
+    {
+        pthread_cond_wait(&g_pause_cv, &g_pause_mu);
+    }
+    pthread_mutex_unlock(&g_pause_mu);
+    return true;
+}
+
+static void shards_resume()
+{
+    pthread_mutex_lock(&g_pause_mu);
+    __atomic_store_n(&g_pause, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&g_pause_cv);
+    pthread_mutex_unlock(&g_pause_mu);
+}
+
+// 每轮事件循环结尾调用, 有分片要暂停的时候在这里等着
+static void shard_park()
+{
+    if (!__atomic_load_n(&g_pause, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    pthread_mutex_lock(&g_pause_mu);
+    if (g_pause)
+    {
+        g_paused++;
+        pthread_cond_broadcast(&g_pause_cv);
+        while (g_pause)
+        {
+            pthread_cond_wait(&g_pause_cv, &g_pause_mu);
+        }
+    }
+    pthread_mutex_unlock(&g_pause_mu);
+}
+
+static const char *g_snap_path = "dump.snap";
+
+// 一次快照的结果, 后台快照的时候由子进程通过管道传回来
+struct SaveInfo
+{
+    bool ok = false;
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    uint64_t save_us = 0;
+    // 子进程里被复制出来的页 (Private_Dirty), 也就是写时复制的开销
+    uint64_t cow_bytes = 0;
+};
+
+// 所有分片共用, 用 g_save_mu 保护
+static pthread_mutex_t g_save_mu = PTHREAD_MUTEX_INITIALIZER;
+static bool g_save_running = false;
+static struct
+{
+    uint64_t saves = 0;
+    uint64_t failures = 0;
+    uint64_t fork_us = 0;
+    SaveInfo last;
+} g_save_stats;
+
+struct SnapCtx
+{
+    SnapWriter *w = NULL;
+    std::vector<HeapItem> *heap = NULL;
+    uint64_t now_us = 0;
+    int64_t now_ms = 0;
+};
+
+// 成员按 (score, name) 排好序写出去
+static void snap_write_zset(SnapWriter *w, ZSet *zset)
+{
+    ZIter it;
+    for (zset_at(zset, 0, &it); it.valid; zset_next(&it))
+    {
+        snap_write_f64(w, it.score);
+        snap_write_str(w, it.name, it.len);
+    }
+}
+
+static bool cb_snap_entry(HNode *node, void *arg)
+{
+    SnapCtx *ctx = (SnapCtx *)arg;
+    SnapWriter *w = ctx->w;
+    Entry *ent = container_of(node, Entry, node);
+    // 堆里是单调时钟, 换算成绝对时间, 重启之后还能用
+    int64_t expire_at = -1;
+    size_t *idx = entry_heap_idx(ent);
+    if (idx && *idx != (size_t)-1)
+    {
+        uint64_t val = (*ctx->heap)[*idx].val;
+        expire_at = ctx->now_ms + ((int64_t)val - (int64_t)ctx->now_us) / 1000;
+    }
+    snap_write_u8(w, (uint8_t)ent->type);
+    snap_write_u64(w, (uint64_t)expire_at);
+    std::string_view key = entry_key(ent);
+    snap_write_str(w, key.data(), key.size());
+    switch (ent->type)
+    {
+    case T_STR:
+    {
+        char buf[k_int_str];
+        std::string_view val = entry_val(ent, buf);
+        snap_write_str(w, val.data(), val.size());
+        break;
+    }
+    case T_ZSET:
+        snap_write_u64(w, zset_size(entry_zset(ent)));
+        snap_write_zset(w, entry_zset(ent));
+        break;
+    }
+    snap_end_key(w);
+    return !w->err;
+}
+
+// 把所有分片写到 path, 先写临时文件再改名, 中途失败不会破坏旧的快照
+static bool snapshot_write(const char *path, SaveInfo *info)
+{
+    uint64_t start_us = get_monotonic_usec();
+    std::string tmp = std::string(path) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    uint64_t nkeys = 0;
+    for (size_t i = 0; i < g_nshards; i++)
+    {
+        nkeys += hm_size(g_shards[i].db);
+    }
+    SnapWriter w;
+    snap_writer_init(&w, fd, nkeys);
+
+    SnapCtx ctx;
+    ctx.w = &w;
+    ctx.now_us = get_monotonic_usec();
+    ctx.now_ms = get_realtime_msec();
+    for (size_t i = 0; i < g_nshards; i++)
+    {
+        ctx.heap = g_shards[i].heap;
+        hm_foreach(g_shards[i].db, &cb_snap_entry, &ctx);
+    }
+    bool ok = snap_writer_finish(&w);
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path) == 0;
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+    }
+    info->ok = ok;
+    info->keys = nkeys;
+    info->bytes = w.bytes;
+    info->save_us = get_monotonic_usec() - start_us;
+    return ok;
+}
+
+// 从 /proc/self/smaps_rollup 里读 Private_Dirty
+static uint64_t proc_private_dirty()
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp)
+    {
+        return 0;
+    }
+    char line[256];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        unsigned long long v = 0;
+        if (sscanf(line, "Private_Dirty: %llu kB", &v) == 1)
+        {
+            kb = v;
+            break;
+        }
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+static void save_done(const SaveInfo &info)
+{
+    pthread_mutex_lock(&g_save_mu);
+    g_save_running = false;
+    if (info.ok)
+    {
+        g_save_stats.saves++;
+        g_save_stats.last = info;
+    }
+    else
+    {
+        g_save_stats.failures++;
+    }
+    pthread_mutex_unlock(&g_save_mu);
+}
+
+static bool save_begin()
+{
+    pthread_mutex_lock(&g_save_mu);
+    bool ok = !g_save_running;
+    g_save_running = true;
+    pthread_mutex_unlock(&g_save_mu);
+    return ok;
+}
+
+static void do_save(Cmd &cmd, Buffer &out)
+{
+    (void)cmd;
+    if (!save_begin())
+    {
+        return out_err(out, ERR_UNKNOWN, "save already in progress");
+    }
+    if (!shards_pause())
+    {
+        save_done(SaveInfo{});
+        return out_err(out, ERR_UNKNOWN, "save already in progress");
+    }
+    SaveInfo info;
+    snapshot_write(g_snap_path, &info);
+    shards_resume();
+    save_done(info);
+    if (!info.ok)
+    {
+        return out_err(out, ERR_UNKNOWN, "save failed");
+    }
+    return out_nil(out);
+}
+
+// 开始后台快照, 结果由 process_bgsave 收回来
+static bool bgsave_start()
+{
+    if (!save_begin())
+    {
+        return false;
+    }
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        save_done(SaveInfo{});
+        return false;
+    }
+    if (!shards_pause())
+    {
+        close(fds[0]);
+        close(fds[1]);
+        save_done(SaveInfo{});
+        return false;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // 子进程: 只有当前这一个线程, 其它分片的内存停在暂停的那一刻
+        close(fds[0]);
+        SaveInfo info;
+        snapshot_write(g_snap_path, &info);
+        info.cow_bytes = proc_private_dirty();
+        ssize_t rv = write(fds[1], &info, sizeof(info));
+        (void)rv;
+        _exit(info.ok ? 0 : 1);
+    }
+    uint64_t fork_us = get_monotonic_usec() - start_us;
+    shards_resume();
+    close(fds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        save_done(SaveInfo{});
+        return false;
+    }
+    pthread_mutex_lock(&g_save_mu);
+    g_save_stats.fork_us = fork_us;
+    pthread_mutex_unlock(&g_save_mu);
+    g_data.save_child = pid;
+    g_data.save_pipe = fds[0];
+    return true;
+}
+
+static void do_bgsave(Cmd &cmd, Buffer &out)
+{
+    (void)cmd;
+    if (!bgsave_start())
+    {
+        return out_err(out, ERR_UNKNOWN, "save already in progress or fork failed");
+    }
+    return out_nil(out);
+}
+
+// 每轮事件循环检查一下本线程发起的后台快照有没有结束
+static void process_bgsave()
+{
+    if (g_data.save_child < 0)
+    {
+        return;
+    }
+    int status = 0;
+    if (waitpid(g_data.save_child, &status, WNOHANG) != g_data.save_child)
+    {
+        return;
+    }
+    SaveInfo info;
+    if (read(g_data.save_pipe, &info, sizeof(info)) != (ssize_t)sizeof(info)
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        info.ok = false;
+    }
+    close(g_data.save_pipe);
+    g_data.save_child = -1;
+    g_data.save_pipe = -1;
+    save_done(info);
+}
+
+// AOF 的文件名前缀, NULL 表示不开启
+static const char *g_aof_prefix = NULL;
+static AofLog g_aof;
+// 当前的清单. 只在重写开始和结束的时候由发起重写的线程修改, 重写之间由 g_save_mu 保证先后
+static AofManifest g_aof_manifest;
+static int64_t g_aof_next_id = 1;
+// 增量文件超过这个大小, 并且比基础文件大, 就自动重写. 0 表示不自动重写
+static uint64_t g_aof_rewrite_min = (uint64_t)64 << 20;
+// 自动重写失败之后, 过这么久再试
+const uint64_t k_aof_retry_us = 5 * 1000 * 1000;
+// 用 g_save_mu 保护, 重写和快照不会同时进行
+static struct
+{
+    uint64_t rewrites = 0;
+    uint64_t failures = 0;
+    // 最近一次重写写出的基础文件
+    SaveInfo last;
+} g_aof_stats;
+
+// fsync 完成之后, 在 fsync 线程里叫醒有回复在等的分片
+static void aof_on_synced()
+{
+    for (size_t i = 0; i < g_nshards; i++)
+    {
+        if (__atomic_load_n(&g_shards[i].aof_waiting, __ATOMIC_ACQUIRE))
+        {
+            uint64_t one = 1;
+            ssize_t rv = write(g_shards[i].efd, &one, sizeof(one));
+            (void)rv;
+        }
+    }
+}
+
+// always 模式下, 写了日志的命令要等 fsync 之后才能回复
+static bool aof_must_wait(uint64_t fed_before)
+{
+    return g_data.aof_on && g_data.aof_fed != fed_before && g_aof.fsync_mode == AOF_FSYNC_ALWAYS;
+}
+
+static void aof_hold(DList *list, AofWait *w)
+{
+    aof_unhold(w);
+    dlist_insert_before(list, &w->link);
+    w->seq = 0;
+}
+
+// 本轮挡住的回复都在刚写出去的这一批里, 它们在列表的末尾
+static void aof_stamp(DList *list, uint64_t seq)
+{
+    for (DList *node = list->prev; node != list; node = node->prev)
+    {
+        AofWait *w = container_of(node, AofWait, link);
+        if (w->seq)
+        {
+            break;
+        }
+        w->seq = seq;
+    }
+}
+
+// 本轮攒下的记录一次写进文件和复制积压缓冲区, 返回是否写了
+static bool aof_flush()
+{
+    if (g_data.aof_buf.empty())
+    {
+        return false;
+    }
+    if (g_data.aof_on)
+    {
+        // 先标记再写, fsync 线程完成之后一定能看到
+        if (!dlist_empty(&g_data.aof_conns) || !dlist_empty(&g_data.aof_mails))
+        {
+            __atomic_store_n(&g_data.shard->aof_waiting, true, __ATOMIC_RELEASE);
+        }
+        uint64_t seq = aof_write(&g_aof, g_data.aof_buf.data(), g_data.aof_buf.size());
+        if (!seq)
+        {
+            // 日志不能有缺口
+            die("aof write");
+        }
+        aof_stamp(&g_data.aof_conns, seq);
+        aof_stamp(&g_data.aof_mails, seq);
+    }
+    if (g_repl_feed)
+    {
+        backlog_append(&g_backlog, g_data.aof_buf.data(), g_data.aof_buf.size());
+    }
+    g_data.aof_buf.clear();
+    return true;
+}
+
+static void aof_rewrite_done(const SaveInfo &info)
+{
+    pthread_mutex_lock(&g_save_mu);
+    g_save_running = false;
+    if (info.ok)
+    {
+        g_aof_stats.rewrites++;
+        g_aof_stats.last = info;
+    }
+    else
+    {
+        g_aof_stats.failures++;
+    }
+    pthread_mutex_unlock(&g_save_mu);
+}
+
+// 开始后台重写: 所有分片暂停的时候换一个新的增量文件并更新清单, 然后 fork,
+// 子进程把当时的数据写成新的基础文件. 结果由 process_aof_rewrite 收回来
+static bool aof_rewrite_start()
+{
+    if (!g_aof_prefix || !save_begin())
+    {
+        return false;
+    }
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        aof_rewrite_done(SaveInfo{});
+        return false;
+    }
+    if (!shards_pause())
+    {
+        close(fds[0]);
+        close(fds[1]);
+        aof_rewrite_done(SaveInfo{});
+        return false;
+    }
+    // 其它分片停下之前都写过了, 本分片这一轮的记录也要写进旧的文件
+    aof_flush();
+    int64_t id = g_aof_next_id++;
+    std::string incr = aof_incr_path(g_aof_prefix, id);
+    AofManifest m = g_aof_manifest;
+    m.incrs.push_back(id);
+    int fd = open(incr.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0 || !aof_manifest_write(g_aof_prefix, m))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(incr.c_str());
+        }
+        shards_resume();
+        close(fds[0]);
+        close(fds[1]);
+        aof_rewrite_done(SaveInfo{});
+        return false;
+    }
+    aof_switch(&g_aof, fd);
+    g_aof_manifest = m;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        SaveInfo info;
+        snapshot_write(aof_base_path(g_aof_prefix, id).c_str(), &info);
+        info.cow_bytes = proc_private_dirty();
+        ssize_t rv = write(fds[1], &info, sizeof(info));
+        (void)rv;
+        _exit(info.ok ? 0 : 1);
+    }
+    shards_resume();
+    close(fds[1]);
+    if (pid < 0)
+    {
+        // 已经换了增量文件, 清单里多一个文件也没关系
+        close(fds[0]);
+        aof_rewrite_done(SaveInfo{});
+        return false;
+    }
+    g_data.aof_child = pid;
+    g_data.aof_pipe = fds[0];
+    g_data.aof_rewrite_id = id;
+    return true;
+}
+
+static void do_bgrewriteaof(Cmd &cmd, Buffer &out)
+{
+    (void)cmd;
+    if (!g_aof_prefix)
+    {
+        return out_err(out, ERR_UNKNOWN, "aof is not enabled");
+    }
+    if (!aof_rewrite_start())
+    {
+        return out_err(out, ERR_UNKNOWN, "save already in progress or rewrite failed");
+    }
+    return out_nil(out);
+}
+
+// 每轮事件循环检查一下本线程发起的重写有没有结束
+static void process_aof_rewrite()
+{
+    if (g_data.aof_child < 0)
+    {
+        return;
+    }
+    int status = 0;
+    if (waitpid(g_data.aof_child, &status, WNOHANG) != g_data.aof_child)
+    {
+        return;
+    }
+    SaveInfo info;
+    if (read(g_data.aof_pipe, &info, sizeof(info)) != (ssize_t)sizeof(info)
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        info.ok = false;
+    }
+    close(g_data.aof_pipe);
+    g_data.aof_child = -1;
+    g_data.aof_pipe = -1;
+
+    // 新的基础文件加上重写开始之后的增量文件就是全部的数据, 旧的文件都可以删了
+    int64_t id = g_data.aof_rewrite_id;
+    AofManifest m;
+    m.base = id;
+    m.incrs.push_back(id);
+    info.ok = info.ok && aof_manifest_write(g_aof_prefix, m);
+    if (info.ok)
+    {
+        if (g_aof_manifest.base >= 0)
+        {
+            unlink(aof_base_path(g_aof_prefix, g_aof_manifest.base).c_str());
+        }
+        for (int64_t old : g_aof_manifest.incrs)
+        {
+            if (old != id)
+            {
+                unlink(aof_incr_path(g_aof_prefix, old).c_str());
+            }
+        }
+        g_aof_manifest = m;
+    }
+    else
+    {
+        unlink(aof_base_path(g_aof_prefix, id).c_str());
+        g_data.aof_retry_us = get_monotonic_usec() + k_aof_retry_us;
+    }
+    aof_rewrite_done(info);
+}
+
+// 启动时加载快照分两步: 先由几个线程并行地校验和解码各段, 生成的 Entry 按所属分片分好;
+// 然后每个分片在自己的线程里按总数一次分配好 db, 再把自己的 Entry 插进去
+struct LoadBatch
+{
+    std::vector<Entry *> ents;
+    // 有 TTL 的 key, 要在分片自己的线程里放进堆
+    std::vector<std::pair<Entry *, int64_t>> ttls;
+};
+
+// 解码用的线程数, 0 表示 CPU 的个数
+static size_t g_load_threads = 0;
+// 每个解码线程一行, 每个分片一列
+static std::vector<std::vector<LoadBatch>> g_load;
+
+static void cb_load_member(void *arg, double *score, const char **name, size_t *len)
+{
+    SnapReader *r = (SnapReader *)arg;
+    *score = snap_read_f64(r);
+    uint32_t n = 0;
+    *name = snap_read_str(r, &n);
+    *name = *name ? *name : "";
+    *len = n;
+}
+
+// 解码一段, 已经过期的 key 直接丢掉
+static bool load_section(const SnapSection &sec, std::vector<LoadBatch> &out, int64_t now_ms)
+{
+    if (!snap_section_ok(sec))
+    {
+        return false;
+    }
+    SnapReader r;
+    r.data = sec.data;
+    r.size = sec.size;
+    for (uint64_t i = 0; i < sec.keys && !r.err; i++)
+    {
+        uint8_t type = snap_read_u8(&r);
+        int64_t expire_at = (int64_t)snap_read_u64(&r);
+        uint32_t klen = 0;
+        const char *kdata = snap_read_str(&r, &klen);
+        bool keep = expire_at < 0 || expire_at > now_ms;
+
+        std::string_view key(kdata ? kdata : "", klen);
+        uint64_t hcode = str_hash((uint8_t *)key.data(), klen);
+        // 有 TTL 的一开始就留好堆的下标
+        uint8_t flags = expire_at >= 0 ? E_TTL : 0;
+
+        Entry *ent = NULL;
+        switch (type)
+        {
+        case T_STR:
+        {
+            uint32_t vlen = 0;
+            const char *vdata = snap_read_str(&r, &vlen);
+            if (keep && vdata)
+            {
+                ent = entry_new(key, hcode, T_STR, flags, std::string_view(vdata, vlen));
+            }
+            break;
+        }
+        case T_ZSET:
+        {
+            uint64_t n = snap_read_u64(&r);
+            if (keep)
+            {
+                ent = entry_new(key, hcode, T_ZSET, flags);
+                entry_zset(ent) = new ZSet();
+                // 成员是排好序的, 直接建好
+                zset_build(entry_zset(ent), n, &cb_load_member, &r);
+                break;
+            }
+            for (uint64_t j = 0; j < n && !r.err; j++)
+            {
+                double score = 0;
+                const char *name = NULL;
+                size_t len = 0;
+                cb_load_member(&r, &score, &name, &len);
+            }
+            break;
+        }
+        default:
+            r.err = true;
+        }
+        // 不保留的 key 没有建 Entry
+        if (r.err || !ent)
+        {
+            if (ent)
+            {
+                entry_destroy(ent);
+            }
+            continue;
+        }
+        LoadBatch &b = out[g_nshards == 1 ? 0 : key_owner(key)->id];
+        if (expire_at >= 0)
+        {
+            b.ttls.push_back({ent, expire_at});
+        }
+        else
+        {
+            b.ents.push_back(ent);
+        }
+    }
+    return !r.err && r.pos == r.size;
+}
+
+struct LoadJob
+{
+    const std::vector<SnapSection> *sections = NULL;
+    // 下一个要解码的段, 所有线程共用
+    size_t *next = NULL;
+    std::vector<LoadBatch> *out = NULL;
+    int64_t now_ms = 0;
+    bool ok = true;
+};
+
+static void *load_worker(void *arg)
+{
+    LoadJob *job = (LoadJob *)arg;
+    while (true)
+    {
+        size_t i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->sections->size())
+        {
+            break;
+        }
+        job->ok = load_section((*job->sections)[i], *job->out, job->now_ms) && job->ok;
+    }
+    // zset 的 hmap 都预先分配好了, 不会开始迁移. 万一有, 在线程退出之前做完
+    while (hm_rehash_pending())
+    {
+        hm_rehash_step();
+    }
+    return NULL;
+}
+
+// 启动时在主线程里调用, 分片线程启动之前; 从节点全量同步的时候在复制线程里调用.
+// 解码的结果放在 g_load 里, 由各个分片的 snapshot_insert 取走. 文件不存在返回 true
+static bool snapshot_decode(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return errno == ENOENT;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    // 各个线程同时从不同的位置读, 让内核提前把整个文件读进来
+    madvise(data, size, MADV_WILLNEED);
+
+    uint64_t start_us = get_monotonic_usec();
+    uint64_t nkeys = 0;
+    std::vector<SnapSection> sections;
+    bool ok = snap_open((const uint8_t *)data, size, &nkeys, &sections);
+    size_t nthreads = g_load_threads ? g_load_threads : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = nthreads < sections.size() ? nthreads : sections.size();
+    nthreads = nthreads ? nthreads : 1;
+    if (ok)
+    {
+        g_load.assign(nthreads, std::vector<LoadBatch>(g_nshards));
+        std::vector<LoadJob> jobs(nthreads);
+        std::vector<pthread_t> threads(nthreads);
+        size_t next = 0;
+        int64_t now_ms = get_realtime_msec();
+        for (size_t i = 0; i < nthreads; i++)
+        {
+            jobs[i].sections = &sections;
+            jobs[i].next = &next;
+            jobs[i].out = &g_load[i];
+            jobs[i].now_ms = now_ms;
+            // 主线程自己也干活
+            if (i > 0 && pthread_create(&threads[i], NULL, &load_worker, &jobs[i]) != 0)
+            {
+                die("pthread_create()");
+            }
+        }
+        load_worker(&jobs[0]);
+        for (size_t i = 0; i < nthreads; i++)
+        {
+            if (i > 0)
+            {
+                pthread_join(threads[i], NULL);
+            }
+            ok = ok && jobs[i].ok;
+        }
+    }
+    munmap(data, size);
+    if (ok)
+    {
+        fprintf(stderr, "snapshot: %llu keys, %zu sections, decoded by %zu threads in %llu ms\n",
+                (unsigned long long)nkeys, sections.size(), nthreads,
+                (unsigned long long)(get_monotonic_usec() - start_us) / 1000);
+    }
+    return ok;
+}
+
+// 在分片自己的线程里调用, 把解码好的 Entry 插进 g_data.db
+static void snapshot_insert()
+{
+    size_t id = g_data.shard->id;
+    size_t total = 0;
+    for (std::vector<LoadBatch> &row : g_load)
+    {
+        total += row[id].ents.size() + row[id].ttls.size();
+    }
+    if (total == 0)
+    {
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    // 按总数一次分配好, 插入的过程中不会扩容
+    hm_reserve(&g_data.db, total);
+    int64_t now_ms = get_realtime_msec();
+    for (std::vector<LoadBatch> &row : g_load)
+    {
+        LoadBatch &b = row[id];
+        for (Entry *ent : b.ents)
+        {
+            hm_insert(&g_data.db, &ent->node);
+        }
+        for (std::pair<Entry *, int64_t> &p : b.ttls)
+        {
+            hm_insert(&g_data.db, &p.first->node);
+            entry_set_ttl(p.first, p.second > now_ms ? p.second - now_ms : 0);
+        }
+        b = LoadBatch{};
+    }
+    fprintf(stderr, "shard %zu: inserted %zu keys in %llu ms\n", id, total,
+            (unsigned long long)(get_monotonic_usec() - start_us) / 1000);
+}
+
+static void out_stat(Buffer &out, const char *name, int64_t val)
+{
+    out_str(out, name, strlen(name));
+    out_int(out, val);
+}
+
+// 本分片的统计, 名字和值交替排列. 多个分片的时候每个分片一段, 以 shard 开头
+static void do_stats(Cmd &cmd, Buffer &out)
+{
+    (void)cmd;
+    HMStats *hs = hm_stats();
+    BufPoolStats bs;
+    buf_pool_stats(&bs);
+    pthread_mutex_lock(&g_save_mu);
+    bool saving = g_save_running;
+    auto save = g_save_stats;
+    auto rewrite = g_aof_stats;
+    pthread_mutex_unlock(&g_save_mu);
+    pthread_mutex_lock(&g_aof.mu);
+    uint64_t aof_bytes = g_aof.bytes;
+    uint64_t aof_incr_bytes = g_aof.incr_bytes;
+    uint64_t aof_batches = g_aof.written;
+    uint64_t aof_fsyncs = g_aof.fsyncs;
+    uint64_t aof_fsync_us = g_aof.fsync_us;
+    uint64_t aof_fsync_max_us = g_aof.fsync_max_us;
+    pthread_mutex_unlock(&g_aof.mu);
+    uint64_t aof_synced = __atomic_load_n(&g_aof.synced, __ATOMIC_ACQUIRE);
+    uint64_t repl_offset = __atomic_load_n(&g_repl_stats.offset, __ATOMIC_RELAXED);
+    if (g_repl_feed)
+    {
+        uint64_t begin = 0;
+        backlog_range(&g_backlog, &begin, &repl_offset);
+    }
+    SlabStats slab;
+    slab_stats(&slab);
+    const uint32_t k_nstats = 43;
+    out_arr(out, 2 * k_nstats);
+    out_stat(out, "shard", g_data.shard ? (int64_t)g_data.shard->id : 0);
+    out_stat(out, "keys", (int64_t)hm_size(&g_data.db));
+    out_stat(out, "db_buckets", (int64_t)hm_capacity(&g_data.db));
+    out_stat(out, "hm_grows", (int64_t)hs->grows);
+    out_stat(out, "hm_shrinks", (int64_t)hs->shrinks);
+    out_stat(out, "hm_rehashes", (int64_t)hs->rehashes);
+    out_stat(out, "hm_migrated", (int64_t)hs->migrated);
+    out_stat(out, "hm_bg_migrated", (int64_t)hs->bg_migrated);
+    out_stat(out, "hm_resizing", (int64_t)hs->resizing);
+    out_stat(out, "hm_pending", (int64_t)hs->pending);
+    out_stat(out, "buf_in_use", (int64_t)bs.in_use);
+    out_stat(out, "buf_cached", (int64_t)bs.cached);
+    // 快照是全局的, 每个分片返回的都一样
+    out_stat(out, "save_in_progress", saving);
+    out_stat(out, "saves", (int64_t)save.saves);
+    out_stat(out, "save_failures", (int64_t)save.failures);
+    out_stat(out, "save_fork_us", (int64_t)save.fork_us);
+    out_stat(out, "save_last_us", (int64_t)save.last.save_us);
+    out_stat(out, "save_last_bytes", (int64_t)save.last.bytes);
+    out_stat(out, "save_cow_bytes", (int64_t)save.last.cow_bytes);
+    // AOF 也是全局的. aof_fsync: 0 是 no, 1 是 everysec, 2 是 always
+    out_stat(out, "aof_enabled", g_aof_prefix != NULL);
+    out_stat(out, "aof_fsync", g_aof.fsync_mode);
+    out_stat(out, "aof_bytes", (int64_t)aof_bytes);
+    out_stat(out, "aof_incr_bytes", (int64_t)aof_incr_bytes);
+    out_stat(out, "aof_batches", (int64_t)aof_batches);
+    out_stat(out, "aof_pending_batches", (int64_t)(aof_batches - aof_synced));
+    out_stat(out, "aof_fsyncs", (int64_t)aof_fsyncs);
+    out_stat(out, "aof_fsync_avg_us", (int64_t)(aof_fsyncs ? aof_fsync_us / aof_fsyncs : 0));
+    out_stat(out, "aof_fsync_max_us", (int64_t)aof_fsync_max_us);
+    out_stat(out, "aof_base_bytes", (int64_t)rewrite.last.bytes);
+    out_stat(out, "aof_rewrites", (int64_t)rewrite.rewrites);
+    out_stat(out, "aof_rewrite_failures", (int64_t)rewrite.failures);
+    out_stat(out, "aof_rewrite_last_us", (int64_t)rewrite.last.save_us);
+    // 复制. repl_offset 在主节点上是命令流的总长度, 在从节点上是收到的位置
+    out_stat(out, "repl_replica", g_replicaof != NULL);
+    out_stat(out, "repl_offset", (int64_t)repl_offset);
+    out_stat(out, "repl_replicas", (int64_t)__atomic_load_n(&g_repl_stats.replicas, __ATOMIC_RELAXED));
+    out_stat(out, "repl_full_syncs", (int64_t)__atomic_load_n(&g_repl_stats.full_syncs, __ATOMIC_RELAXED));
+    out_stat(out, "repl_partial_syncs",
+             (int64_t)__atomic_load_n(&g_repl_stats.partial_syncs, __ATOMIC_RELAXED));
+    out_stat(out, "repl_link_up", (int64_t)__atomic_load_n(&g_repl_stats.link_up, __ATOMIC_RELAXED));
+    // Entry 和 ZNode 的 slab 也是全局的. 碎片率是页里没有借出去的部分, 千分比
+    out_stat(out, "slab_page_bytes", (int64_t)slab.page_bytes);
+    out_stat(out, "slab_in_use_bytes", (int64_t)slab.in_use_bytes);
+    out_stat(out, "slab_free_bytes", (int64_t)slab.free_bytes);
+    out_stat(out, "slab_frag_permille",
+             (int64_t)(slab.page_bytes ? 1000 * (slab.page_bytes - slab.in_use_bytes) / slab.page_bytes : 0));
+    out_stat(out, "slab_large_allocs", (int64_t)slab.large_allocs);
+}
+static bool str2dbl(std::string_view s, double &out)
+{
+    char buf[64];
+    if (!str2cstr(s, buf, sizeof(buf)))
+    {
+        return false;
+    }
+    char *endp = NULL;
+    // 将字符串转换成浮点数
+    out = strtod(buf, &endp);
+    // 返回是否转换成功. 空字符串 strtod 一个字符都不读, endp 也在末尾, 要单独排除
+    return !s.empty() && endp == buf + s.size() && !isnan(out);
+}
+
+// ZADD 的选项
+enum
+{
+    // 只加新成员
+    ZADD_NX = 1,
+    // 只改已有的成员
+    ZADD_XX = 2,
+    // 已有的成员只在新分数更大 (更小) 的时候改, 新成员照样加
+    ZADD_GT = 4,
+    ZADD_LT = 8,
+    // 返回加上的和分数变了的成员数, 默认只算加上的
+    ZADD_CH = 16,
+    // 像 ZINCRBY 一样加到原来的分数上, 只能有一对, 返回新的分数
+    ZADD_INCR = 32,
+};
+
+// 一次 ZADD 里成员至少这么多, 并且不比 zset 原有的少, 就合并起来整个重建
+const size_t k_zadd_bulk = 64;
+
+// 成员现在是否存在 (分数是 cur), 按选项能不能写成 score
+static bool zadd_allow(uint32_t flags, bool exists, double cur, double score)
+{
+    if (!exists)
+    {
+        return !(flags & ZADD_XX);
+    }
+    if (flags & ZADD_NX)
+    {
+        return false;
+    }
+    if ((flags & ZADD_GT) && !(score > cur))
+    {
+        return false;
+    }
+    if ((flags & ZADD_LT) && !(score < cur))
+    {
+        return false;
+    }
+    return true;
+}
+
+// 批量 ZADD 的一项, 原有的成员 exists 是 true
+struct ZAddItem
+{
+    double score = 0;
+    std::string_view name;
+    bool exists = false;
+};
+
+static void cb_build_item(void *arg, double *score, const char **name, size_t *len)
+{
+    ZAddItem *&item = *(ZAddItem **)arg;
+    *score = item->score;
+    *name = item->name.data();
+    *len = item->name.size();
+    item++;
+}
+
+// 把原有的成员和命令里的成员放在一起, 同名的按出现的顺序算出最后的分数,
+// 再按 (score, name) 排序直接建一个新的 zset (AVL 树是 O(n) 建好的), 不用一个个插入再旋转
+static void zadd_bulk(Entry *ent, Cmd &cmd, size_t first, const std::vector<double> &scores,
+                      uint32_t flags, int64_t &added, int64_t &changed)
+{
+    ZSet *old = entry_zset(ent);
+    std::vector<ZAddItem> items;
+    items.reserve(zset_size(old) + scores.size());
+    ZIter it;
+    for (zset_at(old, 0, &it); it.valid; zset_next(&it))
+    {
+        items.push_back({it.score, std::string_view(it.name, it.len), true});
+    }
+    for (size_t i = 0; i < scores.size(); i++)
+    {
+        items.push_back({scores[i], cmd[first + 2 * i + 1], false});
+    }
+    // 按名字去重: 开放寻址的表, 存每个名字第一次出现的下标 + 1, 后面同名的都合并到这一项上.
+    // 比按名字排序快得多, 名字的比较基本只在哈希相同的时候才有
+    size_t cap = 4;
+    while (cap < 2 * items.size())
+    {
+        cap *= 2;
+    }
+    std::vector<uint32_t> slots(cap, 0);
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        ZAddItem &item = items[i];
+        size_t pos = str_hash((uint8_t *)item.name.data(), item.name.size()) & (cap - 1);
+        while (slots[pos] && items[slots[pos] - 1].name != item.name)
+        {
+            pos = (pos + 1) & (cap - 1);
+        }
+        if (!slots[pos])
+        {
+            slots[pos] = (uint32_t)(i + 1);
+            if (item.exists || !zadd_allow(flags, false, 0, item.score))
+            {
+                continue;
+            }
+            added++;
+            item.exists = true;
+            continue;
+        }
+        ZAddItem &prev = items[slots[pos] - 1];
+        if (!zadd_allow(flags, prev.exists, prev.score, item.score))
+        {
+            continue;
+        }
+        added += !prev.exists;
+        changed += prev.exists && item.score != prev.score;
+        prev.exists = true;
+        prev.score = item.score;
+    }
+    // 留下每个名字第一次出现的那一项, 写回到 items 的前 n 项
+    size_t n = 0;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        if (items[i].exists)
+        {
+            items[n++] = items[i];
+        }
+    }
+    items.resize(n);
+    std::sort(items.begin(), items.end(), [](const ZAddItem &a, const ZAddItem &b) {
+        return a.score != b.score ? a.score < b.score : a.name < b.name;
+    });
+    // 新的建好之后才能释放原来的, items 里的名字还指着它
+    ZSet *zset = new ZSet();
+    ZAddItem *next = items.data();
+    zset_build(zset, n, &cb_build_item, &next);
+    entry_zset(ent) = zset;
+    zset_dispose(old);
+    delete old;
+}
+
+// zadd zset [NX|XX] [GT|LT] [CH] [INCR] score name [score name ...]
+// 返回加上的成员数, INCR 返回新的分数 (没改就是 nil). 改了数据才把命令原样写进 AOF
+static void do_zadd(Cmd &cmd, Buffer &out)
+{
+    uint32_t flags = 0;
+    size_t first = 2;
+    for (; first < cmd.size(); first++)
+    {
+        std::string_view arg = cmd[first];
+        if (cmd_is(arg, "nx"))
+        {
+            flags |= ZADD_NX;
+        }
+        else if (cmd_is(arg, "xx"))
+        {
+            flags |= ZADD_XX;
+        }
+        else if (cmd_is(arg, "gt"))
+        {
+            flags |= ZADD_GT;
+        }
+        else if (cmd_is(arg, "lt"))
+        {
+            flags |= ZADD_LT;
+        }
+        else if (cmd_is(arg, "ch"))
+        {
+            flags |= ZADD_CH;
+        }
+        else if (cmd_is(arg, "incr"))
+        {
+            flags |= ZADD_INCR;
+        }
+        else
+        {
+            break;
+        }
+    }
+    size_t nargs = cmd.size() - first;
+    if (nargs == 0 || nargs % 2 != 0)
+    {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    if (((flags & ZADD_NX) && (flags & (ZADD_XX | ZADD_GT | ZADD_LT)))
+        || ((flags & ZADD_GT) && (flags & ZADD_LT)))
+    {
+        return out_err(out, ERR_ARG, "conflicting options");
+    }
+    if ((flags & ZADD_INCR) && nargs != 2)
+    {
+        return out_err(out, ERR_ARG, "INCR expects one score-name pair");
+    }
+    // 先检查所有的分数, 有一个不对就什么都不改
+    std::vector<double> scores(nargs / 2);
+    for (size_t i = 0; i < scores.size(); i++)
+    {
+        if (!str2dbl(cmd[first + 2 * i], scores[i]))
+        {
+            return out_err(out, ERR_ARG, "expect fp number");
+        }
+    }
+    // 查找用的 key
+    EKey key;
+    ekey_init(&key, cmd[1]);
+    // 查找
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = NULL;
+    if (hnode)
+    {
+        // 如果hashtable中存在，要判定对应的这个node是否为ZSET
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_ZSET)
+        {
+            return out_err(out, ERR_TYPE, "expect zset");
+        }
+    }
+    else if (flags & ZADD_XX)
+    {
+        // 没有可改的成员, 也不建空的 zset
+        return (flags & ZADD_INCR) ? out_nil(out) : out_int(out, 0);
+    }
+    else
+    {
+        // 如果不存在就新建一个并插入 hashtable中
+        ent = entry_new(key.key, key.node.hcode, T_ZSET, 0);
+        entry_zset(ent) = new ZSet();
+        hm_insert(&g_data.db, &ent->node);
+    }
+    ZSet *zset = entry_zset(ent);
+
+    if (flags & ZADD_INCR)
+    {
+        std::string_view name = cmd[first + 1];
+        double cur = 0;
+        bool exists = zset_score(zset, name.data(), name.size(), &cur);
+        double score = exists ? cur + scores[0] : scores[0];
+        if (isnan(score))
+        {
+            return out_err(out, ERR_ARG, "resulting score is not a number");
+        }
+        if (!zadd_allow(flags, exists, cur, score))
+        {
+            return out_nil(out);
+        }
+        zset_add(zset, name.data(), name.size(), score);
+        aof_feed_cmd(cmd);
+        return out_dbl(out, score);
+    }
+
+    int64_t added = 0;
+    int64_t changed = 0;
+    if (scores.size() >= k_zadd_bulk && zset_size(zset) <= scores.size() && !(flags & ZADD_XX))
+    {
+        zadd_bulk(ent, cmd, first, scores, flags, added, changed);
+    }
+    else
+    {
+        for (size_t i = 0; i < scores.size(); i++)
+        {
+            std::string_view name = cmd[first + 2 * i + 1];
+            double cur = 0;
+            bool exists = zset_score(zset, name.data(), name.size(), &cur);
+            if (!zadd_allow(flags, exists, cur, scores[i]) || (exists && scores[i] == cur))
+            {
+                continue;
+            }
+            // 添加到zset中
+            zset_add(zset, name.data(), name.size(), scores[i]);
+            added += !exists;
+            changed += exists;
+        }
+    }
+    if (added + changed > 0)
+    {
+        aof_feed_cmd(cmd);
+    }
+    return out_int(out, (flags & ZADD_CH) ? added + changed : added);
+}
+
+static bool expect_zset(Buffer &out, std::string_view s, Entry **ent)
+{
+    // 通过s 来判定
+    EKey key;
+    ekey_init(&key, s);
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+
+    if (!hnode)
+    {
+        out_nil(out);
+        return false;
+    }
+
+    *ent = container_of(hnode, Entry, node);
+    if ((*ent)->type != T_ZSET)
+    {
+        out_err(out, ERR_TYPE, "expect zset");
+        return false;
+    }
+    return true;
+}
+// 删除zset 中的一个key
+static void do_zrem(Cmd &cmd, Buffer &out)
+{
+    Entry *ent = NULL;
+    // 判定是否存在zset
+    if (!expect_zset(out, cmd[1], &ent))
+    {
+        return;
+    }
+    // 要删除的key
+    std::string_view name = cmd[2];
+    // 在zset中删除节点
+    bool removed = zset_rem(entry_zset(ent), name.data(), name.size());
+    if (removed)
+    {
+        aof_feed_cmd(cmd);
+    }
+    // 返回删除结果,可能zset中不存在对应key
+    return out_int(out, removed ? 1 : 0);
+}
+
+// 根据名字获取对应score
+static void do_zscore(Cmd &cmd, Buffer &out)
+{
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent))
+    {
+        return;
+    }
+    // 获取name
+    std::string_view name = cmd[2];
+    // 根据name获取score
+    double score = 0;
+    bool found = zset_score(entry_zset(ent), name.data(), name.size(), &score);
+    // 如果存在通过out返回结果。。。 为啥要用return....
+    return found ? out_dbl(out, score) : out_nil(out);
+}
+
+// 查询 命令: zquery zset score name offset limit
+static void do_zquery(Cmd &cmd, Buffer &out)
+{
+    // 校验参数
+    double score = 0;
+    if (!str2dbl(cmd[2], score))
+    {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    std::string_view name = cmd[3];
+    int64_t offset = 0;
+    int64_t limit = 0;
+    // 获取偏移量
+    if (!str2int(cmd[4], offset))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    // 获取需要查询的数量
+    if (!str2int(cmd[5], limit))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+
+    // 从 zset 中获取数据
+    Entry *ent = NULL;
+    size_t start = buf_size(&out);
+    // 如果zset不存在
+    if (!expect_zset(out, cmd[1], &ent))
+    {
+        if (buf_head(&out)[start] == SER_NIL)
+        {
+            buf_truncate(&out, start);
+            out_arr(out, 0);
+        }
+        return;
+    }
+
+    // 查询
+    if (limit <= 0)
+    {
+        return out_arr(out, 0);
+    }
+    ZIter it;
+    zset_query(entry_zset(ent), score, name.data(), name.size(), offset, &it);
+
+    // 输出
+    size_t arr = out_begin_arr(out);
+    uint32_t n = 0;
+    // 遍历 成员存在 并且在limit范围内
+    while (it.valid && (int64_t)n < limit)
+    {
+        // 包装out
+        out_str(out, it.name, it.len);
+        out_dbl(out, it.score);
+        zset_next(&it);
+        n += 2;
+    }
+    return out_end_arr(out, arr, n);
+}
+
+// zrank / zrevrank 命令: zrank zset name, 不存在返回 nil
+static void do_zrank_by(Cmd &cmd, Buffer &out, bool rev)
+{
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent))
+    {
+        return;
+    }
+    ZSet *zset = entry_zset(ent);
+    std::string_view name = cmd[2];
+    int64_t rank = zset_rank(zset, name.data(), name.size());
+    if (rank < 0)
+    {
+        return out_nil(out);
+    }
+    return out_int(out, rev ? (int64_t)zset_size(zset) - 1 - rank : rank);
+}
+
+static void do_zrank(Cmd &cmd, Buffer &out)
+{
+    return do_zrank_by(cmd, out, false);
+}
+
+static void do_zrevrank(Cmd &cmd, Buffer &out)
+{
+    return do_zrank_by(cmd, out, true);
+}
+
+// 分数范围的端点, 前面加 ( 表示不包括端点, 和 redis 一样
+static bool str2bound(std::string_view s, double &out, bool &ex)
+{
+    ex = !s.empty() && s[0] == '(';
+    if (ex)
+    {
+        s.remove_prefix(1);
+    }
+    return str2dbl(s, out);
+}
+
+// 命令: zcount zset min max
+static void do_zcount(Cmd &cmd, Buffer &out)
+{
+    double min = 0, max = 0;
+    bool min_ex = false, max_ex = false;
+    if (!str2bound(cmd[2], min, min_ex) || !str2bound(cmd[3], max, max_ex))
+    {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    EKey key;
+    ekey_init(&key, cmd[1]);
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!hnode)
+    {
+        return out_int(out, 0);
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    if (ent->type != T_ZSET)
+    {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+    return out_int(out, zset_count(entry_zset(ent), min, min_ex, max, max_ex));
+}
+
+// 按排名取一段: zrange zset start stop, 两端都包括, 负数从末尾数
+static void do_zrange(Cmd &cmd, Buffer &out)
+{
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    EKey key;
+    ekey_init(&key, cmd[1]);
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!hnode)
+    {
+        return out_arr(out, 0);
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    if (ent->type != T_ZSET)
+    {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+    ZSet *zset = entry_zset(ent);
+    int64_t size = (int64_t)zset_size(zset);
+    start = start < 0 ? start + size : start;
+    stop = stop < 0 ? stop + size : stop;
+    start = start < 0 ? 0 : start;
+    stop = stop >= size ? size - 1 : stop;
+    if (start > stop)
+    {
+        return out_arr(out, 0);
+    }
+    // 第一个成员 O(log n) 找到, 后面的沿着中序往后走
+    ZIter it;
+    zset_at(zset, start, &it);
+    size_t arr = out_begin_arr(out);
+    uint32_t n = 0;
+    for (int64_t i = start; it.valid && i <= stop; i++)
+    {
+        out_str(out, it.name, it.len);
+        out_dbl(out, it.score);
+        zset_next(&it);
+        n += 2;
+    }
+    return out_end_arr(out, arr, n);
+}
+
+// zrangebyscore zset min max [WITHSCORES] [LIMIT offset count]
+// zrevrangebyscore zset max min [WITHSCORES] [LIMIT offset count]: 从大到小
+// 端点前加 ( 表示不包括, count 是负数表示不限. 和 Redis 一样只返回名字, 有 WITHSCORES 的时候名字和分数交替
+static void do_zrange_by_score(Cmd &cmd, Buffer &out, bool rev)
+{
+    double min = 0, max = 0;
+    bool min_ex = false, max_ex = false;
+    if (!str2bound(cmd[rev ? 3 : 2], min, min_ex) || !str2bound(cmd[rev ? 2 : 3], max, max_ex))
+    {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    int64_t offset = 0, limit = -1;
+    bool withscores = false;
+    for (size_t i = 4; i < cmd.size(); i++)
+    {
+        if (cmd_is(cmd[i], "withscores"))
+        {
+            withscores = true;
+            continue;
+        }
+        if (!cmd_is(cmd[i], "limit") || i + 2 >= cmd.size())
+        {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+        if (!str2int(cmd[i + 1], offset) || !str2int(cmd[i + 2], limit))
+        {
+            return out_err(out, ERR_ARG, "expect int");
+        }
+        i += 2;
+    }
+    EKey key;
+    ekey_init(&key, cmd[1]);
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!hnode)
+    {
+        return out_arr(out, 0);
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    if (ent->type != T_ZSET)
+    {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+    ZSet *zset = entry_zset(ent);
+    if (offset < 0 || offset >= (int64_t)zset_size(zset) || limit == 0)
+    {
+        return out_arr(out, 0);
+    }
+    // 范围的一端按分数算出排名, 偏移直接加在排名上, O(log n) 定位;
+    // 之后沿着中序的后继 (前驱) 一个个走, 碰到另一端就停, 直接写进输出缓冲区
+    ZIter it;
+    if (!rev)
+    {
+        zset_at(zset, zset_count_below(zset, min, min_ex) + offset, &it);
+    }
+    else
+    {
+        zset_at(zset, zset_count_below(zset, max, !max_ex) - 1 - offset, &it);
+    }
+    size_t arr = out_begin_arr(out);
+    uint32_t n = 0;
+    for (int64_t i = 0; it.valid && (limit < 0 || i < limit); i++)
+    {
+        bool past = rev ? (min_ex ? it.score <= min : it.score < min)
+                        : (max_ex ? it.score >= max : it.score > max);
+        if (past)
+        {
+            break;
+        }
+        out_str(out, it.name, it.len);
+        n++;
+        if (withscores)
+        {
+            out_dbl(out, it.score);
+            n++;
+        }
+        if (rev)
+        {
+            zset_prev(&it);
+        }
+        else
+        {
+            zset_next(&it);
+        }
+    }
+    return out_end_arr(out, arr, n);
+}
+
+static void do_zrangebyscore(Cmd &cmd, Buffer &out)
+{
+    return do_zrange_by_score(cmd, out, false);
+}
+
+static void do_zrevrangebyscore(Cmd &cmd, Buffer &out)
+{
+    return do_zrange_by_score(cmd, out, true);
+}
+
+// psync 由 try_one_request 交给 repl_accept 处理, 走到这里说明现在不能同步
+static void do_psync(Cmd &cmd, Buffer &out)
+{
+    (void)cmd;
+    return out_err(out, ERR_UNKNOWN, "cannot sync now, save in progress or not a primary");
+}
+
+// 命令的属性, 分片和复制根据这些决定怎么处理一个请求
+enum
+{
+    // 只读, 不修改数据
+    CMD_READ = 1 << 0,
+    // 会修改数据
+    CMD_WRITE = 1 << 1,
+    // 需要在所有分片上执行, 再合并结果
+    CMD_ALL_SHARDS = 1 << 2,
+    // 由 cmd[1] 里的游标决定在哪个分片上执行
+    CMD_BY_CURSOR = 1 << 3,
+    // 复制的握手, 成功之后连接交给复制的发送线程
+    CMD_REPL = 1 << 4,
+};
+
+struct CmdDef
+{
+    const char *name;
+    // 参数个数 (包括命令名), 负数表示至少这么多个
+    int32_t arity;
+    uint32_t flags;
+    // key 的位置: 第一个, 最后一个 (负数表示从末尾数), 间隔. 没有 key 的命令都是 0
+    int32_t first_key;
+    int32_t last_key;
+    int32_t key_step;
+    void (*handler)(Cmd &cmd, Buffer &out);
+};
+
+// 所有的命令都在这里登记
+static constexpr CmdDef k_cmds[] = {
+    {"get", 2, CMD_READ, 1, 1, 1, &do_get},
+    {"set", 3, CMD_WRITE, 1, 1, 1, &do_set},
+    {"incr", 2, CMD_WRITE, 1, 1, 1, &do_incr},
+    {"decr", 2, CMD_WRITE, 1, 1, 1, &do_decr},
+    {"incrby", 3, CMD_WRITE, 1, 1, 1, &do_incrby},
+    {"decrby", 3, CMD_WRITE, 1, 1, 1, &do_decrby},
+    {"del", 2, CMD_WRITE, 1, 1, 1, &do_del},
+    {"mget", -2, CMD_READ, 1, -1, 1, &do_mget},
+    {"mset", -3, CMD_WRITE, 1, -1, 2, &do_mset},
+    {"mdel", -2, CMD_WRITE, 1, -1, 1, &do_mdel},
+    {"pexpire", 3, CMD_WRITE, 1, 1, 1, &do_expire},
+    {"pexpireat", 3, CMD_WRITE, 1, 1, 1, &do_expireat},
+    {"pttl", 2, CMD_READ, 1, 1, 1, &do_ttl},
+    {"keys", 1, CMD_READ | CMD_ALL_SHARDS, 0, 0, 0, &do_keys},
+    {"stats", 1, CMD_READ | CMD_ALL_SHARDS, 0, 0, 0, &do_stats},
+    {"scan", -2, CMD_READ | CMD_BY_CURSOR, 0, 0, 0, &do_scan},
+    {"zadd", -4, CMD_WRITE, 1, 1, 1, &do_zadd},
+    {"zrem", 3, CMD_WRITE, 1, 1, 1, &do_zrem},
+    {"zscore", 3, CMD_READ, 1, 1, 1, &do_zscore},
+    {"zquery", 6, CMD_READ, 1, 1, 1, &do_zquery},
+    {"zrank", 3, CMD_READ, 1, 1, 1, &do_zrank},
+    {"zrevrank", 3, CMD_READ, 1, 1, 1, &do_zrevrank},
+    {"zcount", 4, CMD_READ, 1, 1, 1, &do_zcount},
+    {"zrange", 4, CMD_READ, 1, 1, 1, &do_zrange},
+    {"zrangebyscore", -4, CMD_READ, 1, 1, 1, &do_zrangebyscore},
+    {"zrevrangebyscore", -4, CMD_READ, 1, 1, 1, &do_zrevrangebyscore},
+    {"save", 1, CMD_READ, 0, 0, 0, &do_save},
+    {"bgsave", 1, CMD_READ, 0, 0, 0, &do_bgsave},
+    {"bgrewriteaof", 1, CMD_READ, 0, 0, 0, &do_bgrewriteaof},
+    {"psync", 3, CMD_REPL, 0, 0, 0, &do_psync},
+};
+
+const size_t k_ncmds = sizeof(k_cmds) / sizeof(k_cmds[0]);
+
+// 命令名的哈希, 不区分大小写. 命令名只有字母, 所以 | 0x20 就是转小写
+static constexpr uint32_t cmd_hash(const char *s, size_t len, uint32_t seed)
+{
+    uint32_t h = 0x811C9DC5 ^ seed;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (uint8_t)(s[i] | 0x20)) * 0x01000193;
+    }
+    return h;
+}
+
+static constexpr size_t cmd_slots()
+{
+    // 槽的个数至少是命令个数的 4 倍, 很容易找到没有冲突的种子
+    size_t n = 1;
+    while (n < 4 * k_ncmds)
+    {
+        n <<= 1;
+    }
+    return n;
+}
+
+const size_t k_cmd_slots = cmd_slots();
+
+// 完美哈希: 换种子直到所有命令都落在不同的槽里, 编译期算好
+struct CmdIndex
+{
+    uint32_t seed = 0;
+    // 命令的下标 + 1, 0 表示空槽
+    uint8_t slot[k_cmd_slots] = {};
+};
+
+static constexpr CmdIndex cmd_build_index()
+{
+    for (uint32_t seed = 0; seed < (1u << 16); seed++)
+    {
+        CmdIndex idx;
+        idx.seed = seed;
+        bool ok = true;
+        for (size_t i = 0; ok && i < k_ncmds; i++)
+        {
+            size_t len = 0;
+            while (k_cmds[i].name[len])
+            {
+                len++;
+            }
+            size_t pos = cmd_hash(k_cmds[i].name, len, seed) & (k_cmd_slots - 1);
+            ok = idx.slot[pos] == 0;
+            idx.slot[pos] = (uint8_t)(i + 1);
+        }
+        if (ok)
+        {
+            return idx;
+        }
+    }
+    // 找不到就让编译失败
+    return CmdIndex{(uint32_t)-1, {}};
+}
+
+static constexpr CmdIndex k_cmd_index = cmd_build_index();
+static_assert(k_cmd_index.seed != (uint32_t)-1, "no perfect hash for the command table");
+static_assert(k_ncmds < 255, "too many commands");
+
+static const CmdDef *cmd_lookup(std::string_view name)
+{
+    uint32_t h = cmd_hash(name.data(), name.size(), k_cmd_index.seed);
+    uint8_t i = k_cmd_index.slot[h & (k_cmd_slots - 1)];
+    if (i == 0)
+    {
+        return NULL;
+    }
+    // 哈希只保证表里的命令不冲突, 还要比较名字
+    const CmdDef *def = &k_cmds[i - 1];
+    return cmd_is(name, def->name) ? def : NULL;
+}
+
+static bool cmd_arity_ok(const CmdDef *def, size_t argc)
+{
+    if (def->arity >= 0)
+    {
+        return argc == (size_t)def->arity;
+    }
+    return argc >= (size_t)-def->arity;
+}
+
+// 执行一个已经查好表, 检查过参数个数的命令
+static void cmd_exec(const CmdDef *def, Cmd &cmd, Buffer &out)
+{
+    if (!def)
+    {
+        // cmd is not recognized
+        return out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    }
+    if (!cmd_arity_ok(def, cmd.size()))
+    {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    def->handler(cmd, out);
+}
+
+/**
+ * 请求
+ * @param uint8_t
+ * @return
+ */
+static void do_request(Cmd &cmd, Buffer &out)
+{
+    const CmdDef *def = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    cmd_exec(def, cmd, out);
+}
+
+// 每个分片要重放的记录, 指向 mmap 进来的增量文件
+static std::vector<std::vector<std::string_view>> g_aof_replay;
+static std::vector<std::pair<void *, size_t>> g_aof_maps;
+// 还没重放完的分片数, 最后一个负责 munmap
+static size_t g_aof_replay_left = 0;
+
+// 先写临时文件, fsync 之后改名
+static bool file_copy(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+    {
+        return false;
+    }
+    std::string tmp = std::string(to) + ".tmp";
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = out >= 0;
+    char buf[64 * 1024];
+    while (ok)
+    {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            ok = n == 0;
+            break;
+        }
+        ok = write(out, buf, (size_t)n) == n;
+    }
+    close(in);
+    if (out >= 0)
+    {
+        ok = fsync(out) == 0 && ok;
+        ok = close(out) == 0 && ok;
+    }
+    ok = ok && rename(tmp.c_str(), to) == 0;
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+// 日志和复制流里的一条记录该由哪个分片执行, 不是合法的写命令返回 -1
+static int64_t record_shard(const uint8_t *rec, uint32_t len)
+{
+    Cmd cmd;
+    const CmdDef *def = NULL;
+    if (parse_req(rec, len, cmd) == 0 && !cmd.empty())
+    {
+        def = cmd_lookup(cmd[0]);
+    }
+    if (!def || !(def->flags & CMD_WRITE) || !cmd_arity_ok(def, cmd.size()) || def->first_key <= 0)
+    {
+        return -1;
+    }
+    return g_nshards == 1 ? 0 : (int64_t)key_owner(cmd[def->first_key])->id;
+}
+
+// 在主线程里调用, 分片线程启动之前: 解码基础文件, 把增量文件里的记录按 key 分给各个分片,
+// 最后一个增量文件打开用来追加
+static bool aof_load()
+{
+    AofManifest m;
+    if (!aof_manifest_read(g_aof_prefix, &m))
+    {
+        if (errno != ENOENT)
+        {
+            return false;
+        }
+        // 第一次开启 AOF: 已有的快照作为基础文件, 不然下次启动只会读到日志里的数据
+        m = AofManifest{};
+        m.incrs.push_back(1);
+        if (access(g_snap_path, F_OK) == 0)
+        {
+            if (!file_copy(g_snap_path, aof_base_path(g_aof_prefix, 1).c_str()))
+            {
+                return false;
+            }
+            m.base = 1;
+        }
+        if (!aof_manifest_write(g_aof_prefix, m))
+        {
+            return false;
+        }
+    }
+    if (m.base >= 0)
+    {
+        // snapshot_decode 把不存在的文件当作空的, 基础文件必须存在
+        std::string base = aof_base_path(g_aof_prefix, m.base);
+        struct stat st;
+        if (stat(base.c_str(), &st) != 0 || !snapshot_decode(base.c_str()))
+        {
+            return false;
+        }
+        g_aof_stats.last.bytes = (uint64_t)st.st_size;
+    }
+
+    uint64_t start_us = get_monotonic_usec();
+    g_aof_replay.assign(g_nshards, std::vector<std::string_view>());
+    size_t nrecs = 0;
+    int fd = -1;
+    for (size_t i = 0; i < m.incrs.size(); i++)
+    {
+        bool last = i + 1 == m.incrs.size();
+        std::string path = aof_incr_path(g_aof_prefix, m.incrs[i]);
+        fd = open(path.c_str(), last ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            return false;
+        }
+        size_t size = (size_t)st.st_size;
+        const uint8_t *data = NULL;
+        if (size > 0)
+        {
+            void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                close(fd);
+                return false;
+            }
+            madvise(p, size, MADV_SEQUENTIAL);
+            g_aof_maps.push_back({p, size});
+            data = (const uint8_t *)p;
+        }
+        size_t pos = 0;
+        const uint8_t *rec = NULL;
+        uint32_t len = 0;
+        while (aof_next_record(data, size, &pos, &rec, &len))
+        {
+            int64_t shard = record_shard(rec, len);
+            if (shard < 0)
+            {
+                fprintf(stderr, "aof: %s: bad record at offset %zu\n", path.c_str(), pos - len - 4);
+                close(fd);
+                return false;
+            }
+            g_aof_replay[shard].push_back(std::string_view((const char *)rec, len));
+            nrecs++;
+        }
+        if (pos != size)
+        {
+            // 写最后一批的时候掉电, 只会在最后一个文件的末尾留下半条记录
+            if (!last || ftruncate(fd, (off_t)pos) != 0)
+            {
+                close(fd);
+                return false;
+            }
+            fprintf(stderr, "aof: %s: dropped %zu bytes of truncated record\n",
+                    path.c_str(), size - pos);
+        }
+        if (!last)
+        {
+            close(fd);
+        }
+    }
+
+    g_aof_manifest = m;
+    g_aof_next_id = m.base + 1;
+    for (int64_t id : m.incrs)
+    {
+        g_aof_next_id = id + 1 > g_aof_next_id ? id + 1 : g_aof_next_id;
+    }
+    g_aof_replay_left = g_nshards;
+    g_aof.on_synced = &aof_on_synced;
+    aof_start(&g_aof, fd);
+    fprintf(stderr, "aof: %zu records in %zu files, read in %llu ms\n", nrecs, m.incrs.size(),
+            (unsigned long long)(get_monotonic_usec() - start_us) / 1000);
+    return true;
+}
+
+// 在分片自己的线程里重放分到的记录, 然后开始写 AOF
+static void aof_replay()
+{
+    if (!g_aof_prefix)
+    {
+        return;
+    }
+    std::vector<std::string_view> recs;
+    recs.swap(g_aof_replay[g_data.shard->id]);
+    uint64_t start_us = get_monotonic_usec();
+    Buffer out;
+    for (std::string_view rec : recs)
+    {
+        Cmd cmd;
+        int32_t rv = parse_req((const uint8_t *)rec.data(), rec.size(), cmd);
+        assert(rv == 0);
+        (void)rv;
+        do_request(cmd, out);
+        buf_truncate(&out, 0);
+    }
+    buf_free(&out);
+    if (__atomic_sub_fetch(&g_aof_replay_left, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        for (std::pair<void *, size_t> &p : g_aof_maps)
+        {
+            munmap(p.first, p.second);
+        }
+        g_aof_maps.clear();
+    }
+    if (!recs.empty())
+    {
+        fprintf(stderr, "shard %zu: replayed %zu aof records in %llu ms\n", g_data.shard->id,
+                recs.size(), (unsigned long long)(get_monotonic_usec() - start_us) / 1000);
+    }
+    g_data.aof_on = true;
+}
+
+// 响应直接追加到写缓冲区, 等这一轮读完之后再统一发送
+// 4 字节的长度头先占位, 响应写完之后再填
+static size_t conn_begin_res(Conn *conn)
+{
+    size_t pos = buf_size(&conn->wbuf);
+    uint32_t wlen = 0;
+    buf_append(&conn->wbuf, &wlen, 4);
+    return pos;
+}
+
+static void conn_end_res(Conn *conn, size_t pos)
+{
+    size_t len = buf_size(&conn->wbuf) - pos - 4;
+    if (4 + len > g_max_conn_buf)
+    {
+        buf_truncate(&conn->wbuf, pos + 4);
+        out_err(conn->wbuf, ERR_2BIG, "response is too big");
+        len = buf_size(&conn->wbuf) - pos - 4;
+    }
+    uint32_t wlen = (uint32_t)len;
+    memcpy(&buf_head(&conn->wbuf)[pos], &wlen, 4);
+
+    // 积压太多就不再读新的请求
+    if (buf_size(&conn->wbuf) >= g_out_hwm)
+    {
+        conn->state = STATE_RES;
+    }
+}
+
+// 分片之间传递的消息, 去的时候是请求, 回来的时候带着结果
+struct Mail
+{
+    MailNode node;
+    Conn *conn = NULL;
+    Shard *from = NULL;
+    // 原始的请求, 切片指向的读缓冲区会被复用, 所以整个请求拷贝一份带过去
+    std::string req;
+    std::string out;
+    bool done = false;
+    // keys 需要依次经过所有分片
+    bool all_shards = false;
+    uint32_t nitems = 0;
+    // always 模式下, 结果等 fsync 之后再送回去
+    AofWait aof;
+    // 从节点收到的一批复制流 (格式和 AOF 一样), 执行完不用回复
+    bool repl = false;
+    // 全量同步: 执行之前先清空本分片, 换成 g_load 里解码好的快照
+    bool repl_load = false;
+};
+
+static void shard_post(Shard *to, Mail *m)
+{
+    if (mailbox_push(&to->mailbox, &m->node))
+    {
+        uint64_t one = 1;
+        ssize_t rv = write(to->efd, &one, sizeof(one));
+        (void)rv;
+    }
+}
+
+// 找出 key 所在的分片
+static Shard *cmd_owner(const CmdDef *def, Cmd &cmd)
+{
+    // 不认识的命令, 参数不对的命令, 没有 key 的命令, 都在本地处理
+    if (g_nshards == 1 || !def || !cmd_arity_ok(def, cmd.size()))
+    {
+        return g_data.shard;
+    }
+    if (def->flags & CMD_BY_CURSOR)
+    {
+        int64_t cursor = 0;
+        size_t shard = str2int(cmd[1], cursor) ? (uint64_t)cursor >> k_scan_shard_shift : 0;
+        return shard < g_nshards ? &g_shards[shard] : g_data.shard;
+    }
+    if (def->first_key == 0 || (size_t)def->first_key >= cmd.size())
+    {
+        return g_data.shard;
+    }
+    return key_owner(cmd[def->first_key]);
+}
+
+// 多个 key 的命令只能在一个分片上执行, key 不全在同一个分片的时候拒绝
+static bool cmd_cross_shard(const CmdDef *def, Cmd &cmd)
+{
+    if (g_nshards == 1 || !def || !cmd_arity_ok(def, cmd.size()) || def->first_key <= 0
+        || def->last_key == def->first_key)
+    {
+        return false;
+    }
+    // key 一直到末尾的, 参数个数要和间隔对得上 (mset 要成对). 对不上就在本地执行,
+    // 由命令自己报参数错误, 和 key 在哪个分片无关
+    if (def->last_key < 0 && (cmd.size() - def->first_key) % def->key_step != 0)
+    {
+        return false;
+    }
+    Shard *owner = key_owner(cmd[def->first_key]);
+    int64_t last = def->last_key < 0 ? (int64_t)cmd.size() + def->last_key : def->last_key;
+    for (int64_t i = def->first_key + def->key_step; i <= last; i += def->key_step)
+    {
+        if (key_owner(cmd[i]) != owner)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 在拥有数据的分片上执行转发过来的请求
+// Buffer 的内存属于线程自己的池子, 所以结果拷贝成 std::string 再带回去
+static void shard_exec(Mail *m)
+{
+    Cmd cmd;
+    int32_t rv = parse_req((uint8_t *)m->req.data(), m->req.size(), cmd);
+    assert(rv == 0);
+    (void)rv;
+    Buffer out;
+    uint64_t fed = g_data.aof_fed;
+    do_request(cmd, out);
+    const char *data = (const char *)buf_head(&out);
+    // 所有分片的命令: 有一个分片返回的不是数组 (出错了) 就不再往下走, 前面分片的结果丢掉, 只回这个错误
+    if (!m->all_shards || data[0] != SER_ARR)
+    {
+        m->out.assign(data, buf_size(&out));
+        buf_free(&out);
+        m->done = true;
+        if (aof_must_wait(fed))
+        {
+            return aof_hold(&g_data.aof_mails, &m->aof);
+        }
+        return shard_post(m->from, m);
+    }
+
+    // 把本分片的结果拼到数组后面, 再交给下一个分片
+    uint32_t n = 0;
+    memcpy(&n, &data[1], 4);
+    m->nitems += n;
+    m->out.append(data + 5, buf_size(&out) - 5);
+    buf_free(&out);
+    size_t next = g_data.shard->id + 1;
+    if (next < g_nshards)
+    {
+        return shard_post(&g_shards[next], m);
+    }
+    out_arr(out, m->nitems);
+    m->out.insert(0, (const char *)buf_head(&out), buf_size(&out));
+    buf_free(&out);
+    m->done = true;
+    shard_post(m->from, m);
+}
+
+// 结果回到了发起请求的分片
+static void shard_reply(Mail *m)
+{
+    Conn *conn = m->conn;
+    conn->mail_out = false;
+    if (conn->state == STATE_END)
+    {
+        // 等结果的时候连接出错了, conn_done 只停掉了读写, 现在才真正释放, 结果丢掉
+        return conn_done(conn);
+    }
+    assert(conn->state == STATE_WAIT);
+    conn->state = STATE_REQ;
+    size_t pos = conn_begin_res(conn);
+    buf_append(&conn->wbuf, m->out.data(), m->out.size());
+    conn_end_res(conn, pos);
+    // 继续处理被挂起的后续请求
+    if (conn->state == STATE_REQ)
+    {
+        state_req(conn);
+    }
+    else
+    {
+        state_res(conn);
+    }
+    if (conn->state == STATE_END)
+    {
+        conn_done(conn);
+    }
+    else
+    {
+        ev_update(conn);
+    }
+}
+
+// 从节点全量同步的时候, 复制线程等所有分片都换好数据
+static pthread_mutex_t g_repl_load_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_repl_load_cv = PTHREAD_COND_INITIALIZER;
+static size_t g_repl_loading = 0;
+
+static bool cb_collect_entry(HNode *node, void *arg)
+{
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+    return true;
+}
+
+// 删掉本分片所有的 key
+static void db_clear()
+{
+    std::vector<Entry *> ents;
+    ents.reserve(hm_size(&g_data.db));
+    hm_foreach(&g_data.db, &cb_collect_entry, &ents);
+    hm_destroy(&g_data.db);
+    for (Entry *ent : ents)
+    {
+        entry_del(ent);
+    }
+}
+
+// 从节点的分片执行复制线程转发过来的记录
+static void repl_apply(Mail *m)
+{
+    if (m->repl_load)
+    {
+        db_clear();
+        snapshot_insert();
+        pthread_mutex_lock(&g_repl_load_mu);
+        if (--g_repl_loading == 0)
+        {
+            pthread_cond_signal(&g_repl_load_cv);
+        }
+        pthread_mutex_unlock(&g_repl_load_mu);
+    }
+    Buffer out;
+    size_t pos = 0;
+    const uint8_t *rec = NULL;
+    uint32_t len = 0;
+    while (aof_next_record((const uint8_t *)m->req.data(), m->req.size(), &pos, &rec, &len))
+    {
+        Cmd cmd;
+        int32_t rv = parse_req(rec, len, cmd);
+        assert(rv == 0);
+        (void)rv;
+        do_request(cmd, out);
+        buf_truncate(&out, 0);
+    }
+    buf_free(&out);
+}
+
+static void shard_recv()
+{
+    uint64_t cnt = 0;
+    ssize_t rv = read(g_data.shard->efd, &cnt, sizeof(cnt));
+    (void)rv;
+    MailNode *node = mailbox_take(&g_data.shard->mailbox);
+    while (node)
+    {
+        Mail *m = container_of(node, Mail, node);
+        node = node->next;
+        if (m->done)
+        {
+            shard_reply(m);
+            delete m;
+        }
+        else if (m->repl)
+        {
+            repl_apply(m);
+            delete m;
+        }
+        else
+        {
+            shard_exec(m);
+        }
+    }
+}
+
+static struct sockaddr_in g_replicaof_addr = {};
+// 从节点写不动 (或者断了) 这么久就放弃
+const int k_repl_timeout_s = 10;
+// 从节点断开之后过这么久再重连
+const uint64_t k_repl_retry_us = 200 * 1000;
+
+// 主节点这边每个从节点一个发送线程, 用阻塞的 socket: 先发快照 (部分同步不用), 然后一直发积压缓冲区里的命令流
+struct ReplSender
+{
+    int fd = -1;
+    // 下一个要发的字节在命令流里的偏移量
+    uint64_t offset = 0;
+    // 全量同步的时候写快照的子进程和快照文件
+    pid_t child = -1;
+    std::string path;
+};
+
+// 全量同步用的快照不算在 SAVE 的统计里
+static void repl_save_end()
+{
+    pthread_mutex_lock(&g_save_mu);
+    g_save_running = false;
+    pthread_mutex_unlock(&g_save_mu);
+}
+
+static bool repl_send_reply(int fd, Buffer &out)
+{
+    uint32_t len = (uint32_t)buf_size(&out);
+    bool ok = repl_send_all(fd, &len, 4) && repl_send_all(fd, buf_head(&out), len);
+    buf_free(&out);
+    return ok;
+}
+
+static bool repl_send_snapshot(ReplSender *s)
+{
+    int status = 0;
+    bool ok = waitpid(s->child, &status, 0) == s->child && WIFEXITED(status)
+        && WEXITSTATUS(status) == 0;
+    // 快照写完了, 别的快照和重写可以开始了
+    repl_save_end();
+    int file = ok ? open(s->path.c_str(), O_RDONLY) : -1;
+    struct stat st;
+    ok = file >= 0 && fstat(file, &st) == 0;
+    if (ok)
+    {
+        Buffer out;
+        out_arr(out, 4);
+        out_str(out, "fullresync", 10);
+        out_str(out, g_repl_id);
+        out_int(out, (int64_t)s->offset);
+        out_int(out, (int64_t)st.st_size);
+        ok = repl_send_reply(s->fd, out);
+        off_t pos = 0;
+        while (ok && pos < st.st_size)
+        {
+            ssize_t rv = sendfile(s->fd, file, &pos, (size_t)(st.st_size - pos));
+            ok = rv > 0 || (rv < 0 && errno == EINTR);
+        }
+    }
+    if (file >= 0)
+    {
+        close(file);
+    }
+    unlink(s->path.c_str());
+    return ok;
+}
+
+// 一直发到从节点断开, 或者它跟不上, 要读的部分已经被覆盖了
+static void repl_send_stream(ReplSender *s)
+{
+    uint8_t buf[64 * 1024];
+    while (true)
+    {
+        ssize_t n = backlog_read(&g_backlog, s->offset, buf, sizeof(buf), 1000);
+        if (n < 0)
+        {
+            msg("replica is too far behind the backlog");
+            return;
+        }
+        if (n == 0)
+        {
+            // 从节点不会发数据过来, 空闲的时候看一下它是不是已经断开了
+            char c = 0;
+            ssize_t rv = recv(s->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (rv == 0 || (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                return;
+            }
+            continue;
+        }
+        if (!repl_send_all(s->fd, buf, (size_t)n))
+        {
+            return;
+        }
+        s->offset += (uint64_t)n;
+    }
+}
+
+static void *repl_sender_main(void *arg)
+{
+    ReplSender *s = (ReplSender *)arg;
+    int flags = fcntl(s->fd, F_GETFL, 0);
+    fcntl(s->fd, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval tv = {k_repl_timeout_s, 0};
+    setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    __atomic_add_fetch(&g_repl_stats.replicas, 1, __ATOMIC_RELAXED);
+
+    bool ok = false;
+    if (s->child >= 0)
+    {
+        ok = repl_send_snapshot(s);
+        if (ok)
+        {
+            __atomic_add_fetch(&g_repl_stats.full_syncs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        Buffer out;
+        out_arr(out, 3);
+        out_str(out, "continue", 8);
+        out_str(out, g_repl_id);
+        out_int(out, (int64_t)s->offset);
+        ok = repl_send_reply(s->fd, out);
+        if (ok)
+        {
+            __atomic_add_fetch(&g_repl_stats.partial_syncs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (ok)
+    {
+        repl_send_stream(s);
+    }
+
+    __atomic_sub_fetch(&g_repl_stats.replicas, 1, __ATOMIC_RELAXED);
+    close(s->fd);
+    delete s;
+    return NULL;
+}
+
+// 和 BGSAVE 一样让所有分片停下来再 fork, 这时候各个分片这一轮的记录都已经进了积压缓冲区,
+// 子进程写的快照正好对应当前的偏移量
+static bool repl_fork_snapshot(ReplSender *s)
+{
+    if (!save_begin())
     {
-        out_nil(out);
         return false;
     }
-
-    *ent = container_of(hnode, Entry, node);
-    if ((*ent)->type != T_ZSET)
+    if (!shards_pause())
     {
-        out_err(out, ERR_TYPE, "expect zset");
+        repl_save_end();
         return false;
     }
-    return true;
-}
-// 删除zset 中的一个key
-static void do_zrem(std::vector<std::string> &cmd, std::string &out)
-{
-    Entry *ent = NULL;
-    // 判定是否存在zset
-    if (!expect_zset(out, cmd[1], &ent))
+    // 本分片这一轮已经执行的命令也在快照里, 命令流要从它们后面开始
+    aof_flush();
+    if (!g_repl_feed)
     {
-        return;
+        backlog_init(&g_backlog, g_backlog_size);
+        g_repl_feed = true;
     }
-    // 要删除的key
-    const std::string &name = cmd[2];
-    // 在zset中删除节点
-    ZNode *znode = zset_pop(ent->zset, name.data(), name.size());
-    if (znode)
+    uint64_t begin = 0;
+    backlog_range(&g_backlog, &begin, &s->offset);
+    s->path = std::string(g_snap_path) + ".repl";
+    pid_t pid = fork();
+    if (pid == 0)
     {
-        // 释放节点本身
-        znode_del(znode);
+        SaveInfo info;
+        snapshot_write(s->path.c_str(), &info);
+        _exit(info.ok ? 0 : 1);
     }
-    // 返回删除结果,可能zset中不存在对应key
-    return out_int(out, znode ? 1 : 0);
-}
-
-// 根据名字获取对应score
-static void do_zscore(std::vector<std::string> &cmd, std::string &out)
-{
-    Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent))
+    shards_resume();
+    if (pid < 0)
     {
-        return;
+        repl_save_end();
+        return false;
     }
-    // 获取name
-    const std::string &name = cmd[2];
-    // 根据name获取znode 期中包含 score等信息
-    ZNode *znode = zset_lookup(ent->zset, name.data(), name.size());
-    // 如果存在通过out返回结果。。。 为啥要用return....
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+    s->child = pid;
+    return true;
 }
 
-// 查询 命令: zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, std::string &out)
+// 主节点收到 psync: 从节点要的偏移量还在积压缓冲区里就部分同步, 不然全量同步.
+// 成功之后这个连接交给新的发送线程, 失败的时候由 do_psync 回复错误
+static bool repl_accept(Conn *conn, Cmd &cmd)
 {
-    // 校验参数
-    double score = 0;
-    if (!str2dbl(cmd[2], score))
+    if (g_replicaof || conn_out_pending(conn) || conn_aof_held(conn))
     {
-        return out_err(out, ERR_ARG, "expect fp number");
+        return false;
     }
-    const std::string &name = cmd[3];
-    int64_t offset = 0;
-    int64_t limit = 0;
-    // 获取偏移量
-    if (!str2int(cmd[4], offset))
+    bool partial = false;
+    int64_t off = -1;
+    if (g_repl_feed && cmd[1] == g_repl_id && str2int(cmd[2], off) && off >= 0)
     {
-        return out_err(out, ERR_ARG, "expect int");
+        uint64_t begin = 0, end = 0;
+        backlog_range(&g_backlog, &begin, &end);
+        partial = (uint64_t)off >= begin && (uint64_t)off <= end;
     }
-    // 获取需要查询的数量
-    if (!str2int(cmd[5], limit))
+    ReplSender *s = new ReplSender();
+    if (partial)
     {
-        return out_err(out, ERR_ARG, "expect int");
+        s->offset = (uint64_t)off;
     }
-
-    // 从 zset 中获取数据
-    Entry *ent = NULL;
-    // 如果zset不存在
-    if (!expect_zset(out, cmd[1], &ent))
+    else if (!repl_fork_snapshot(s))
     {
-        if (out[0] == SER_NIL)
-        {
-            out.clear();
-            out_arr(out, 0);
-        }
-        return;
+        delete s;
+        return false;
     }
-
-    // 查询
-    if (limit <= 0)
+    // 事件循环那边照常关掉自己的 fd, 发送线程用复制出来的这个
+    s->fd = dup(conn->fd);
+    pthread_t thread;
+    if (s->fd < 0 || pthread_create(&thread, NULL, &repl_sender_main, s) != 0)
     {
-        return out_arr(out, 0);
+        die("repl_accept");
     }
-    ZNode *znode = zset_query(
-        ent->zset, score, name.data(), name.size(), offset);
+    pthread_detach(thread);
+    return true;
+}
 
-    // 输出
-    out_arr(out, 0);
-    uint32_t n = 0;
-    // 遍历 znode 存在 并且在limit范围内
-    while (znode && (int64_t)n < limit)
+// 从节点这边的复制线程: 连上主节点, 同步, 然后把命令流按 key 转发给各个分片, 断了就重连
+static std::string_view repl_read_str(SnapReader *r)
+{
+    uint32_t len = 0;
+    if (snap_read_u8(r) != SER_STR)
     {
-        // 包装out
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        // 通过acl_offset优化查找
-        znode = container_of(avl_offset(&znode->tree, +1), ZNode, tree);
-        n += 2;
+        r->err = true;
+        return std::string_view();
     }
-    return out_update_arr(out, n);
+    const char *s = snap_read_str(r, &len);
+    return std::string_view(s ? s : "", len);
 }
 
-static bool cmd_is(const std::string &word, const char *cmd)
+static int64_t repl_read_int(SnapReader *r)
 {
-    return 0 == strcasecmp(word.c_str(), cmd);
+    if (snap_read_u8(r) != SER_INT)
+    {
+        r->err = true;
+        return 0;
+    }
+    return (int64_t)snap_read_u64(r);
 }
 
-/**
- * 请求
- * @param uint8_t
- * @return
- */
-static void do_request(std::vector<std::string> &cmd, std::string &out)
+static bool repl_recv_file(int fd, const char *path, uint64_t size)
 {
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
     {
-        do_keys(cmd, out);
+        return false;
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
+    char buf[64 * 1024];
+    bool ok = true;
+    while (ok && size > 0)
     {
-        do_get(cmd, out);
+        size_t n = size < sizeof(buf) ? (size_t)size : sizeof(buf);
+        ok = repl_recv_all(fd, buf, n) && write(file, buf, n) == (ssize_t)n;
+        size -= n;
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+    ok = close(file) == 0 && ok;
+    return ok;
+}
+
+// 解码快照, 每个分片清空之后换成新的数据. 等所有分片都换完, 之后的命令流才会排在它们后面执行
+static bool repl_load(const char *path)
+{
+    if (!snapshot_decode(path))
     {
-        do_set(cmd, out);
+        return false;
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+    pthread_mutex_lock(&g_repl_load_mu);
+    g_repl_loading = g_nshards;
+    pthread_mutex_unlock(&g_repl_load_mu);
+    for (size_t i = 0; i < g_nshards; i++)
     {
-        do_del(cmd, out);
+        Mail *m = new Mail();
+        m->repl = true;
+        m->repl_load = true;
+        shard_post(&g_shards[i], m);
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpire"))
+    pthread_mutex_lock(&g_repl_load_mu);
+    while (g_repl_loading)
     {
-        do_expire(cmd, out);
+        pthread_cond_wait(&g_repl_load_cv, &g_repl_load_mu);
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "pttl"))
+    pthread_mutex_unlock(&g_repl_load_mu);
+    return true;
+}
+
+// 发 psync, 需要的话接收快照并加载. id 和 offset 是上次同步到的位置
+static bool repl_handshake(int fd, std::string &id, int64_t &offset)
+{
+    std::string off = std::to_string(offset);
+    std::string_view args[3] = {"psync", id, off};
+    std::string req;
+    aof_encode(req, args, 3);
+    uint32_t len = 0;
+    if (!repl_send_all(fd, req.data(), req.size()) || !repl_recv_all(fd, &len, 4)
+        || len > g_max_conn_buf)
     {
-        do_ttl(cmd, out);
+        return false;
     }
-    else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd"))
+    std::string res(len, '\0');
+    if (!repl_recv_all(fd, &res[0], len))
     {
-        do_zadd(cmd, out);
+        return false;
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem"))
+    SnapReader r;
+    r.data = (const uint8_t *)res.data();
+    r.size = res.size();
+    if (snap_read_u8(&r) != SER_ARR)
     {
-        do_zrem(cmd, out);
+        msg("replication: psync refused by the primary");
+        return false;
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore"))
+    uint32_t n = snap_read_u32(&r);
+    std::string_view mode = repl_read_str(&r);
+    std::string new_id(repl_read_str(&r));
+    int64_t new_off = repl_read_int(&r);
+    if (!r.err && n == 4 && mode == "fullresync")
     {
-        do_zscore(cmd, out);
+        int64_t size = repl_read_int(&r);
+        std::string path = std::string(g_snap_path) + ".sync";
+        uint64_t start_us = get_monotonic_usec();
+        bool ok = !r.err && size > 0 && repl_recv_file(fd, path.c_str(), (uint64_t)size)
+            && repl_load(path.c_str());
+        unlink(path.c_str());
+        if (!ok)
+        {
+            msg("replication: full sync failed");
+            return false;
+        }
+        id = new_id;
+        offset = new_off;
+        __atomic_add_fetch(&g_repl_stats.full_syncs, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "replication: full sync, %lld bytes in %llu ms, offset %lld\n",
+                (long long)size, (unsigned long long)(get_monotonic_usec() - start_us) / 1000,
+                (long long)offset);
     }
-    else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery"))
+    else if (!r.err && n == 3 && mode == "continue" && new_id == id && new_off == offset)
     {
-        do_zquery(cmd, out);
+        __atomic_add_fetch(&g_repl_stats.partial_syncs, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "replication: partial sync from offset %lld\n", (long long)offset);
     }
     else
     {
-        // cmd is not recognized
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+        msg("replication: bad psync reply");
+        return false;
+    }
+    __atomic_store_n(&g_repl_stats.offset, (uint64_t)offset, __ATOMIC_RELAXED);
+    return true;
+}
+
+// 收命令流, 每次收到的完整记录按 key 分好, 每个分片一封信. 同一个 key 的命令总是去同一个分片, 顺序不变.
+// 返回 false 表示命令流坏了, 下次只能全量同步
+static bool repl_stream(int fd, int64_t &offset)
+{
+    std::string pending;
+    std::vector<std::string> batches(g_nshards);
+    char chunk[64 * 1024];
+    while (true)
+    {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return true;
+        }
+        pending.append(chunk, (size_t)n);
+        size_t pos = 0;
+        const uint8_t *rec = NULL;
+        uint32_t len = 0;
+        while (aof_next_record((const uint8_t *)pending.data(), pending.size(), &pos, &rec, &len))
+        {
+            int64_t shard = record_shard(rec, len);
+            if (shard < 0)
+            {
+                msg("replication: bad record in the stream");
+                return false;
+            }
+            batches[shard].append((const char *)rec - 4, 4 + (size_t)len);
+        }
+        pending.erase(0, pos);
+        if (pending.size() > g_max_conn_buf)
+        {
+            msg("replication: record is too long");
+            return false;
+        }
+        offset += (int64_t)pos;
+        __atomic_store_n(&g_repl_stats.offset, (uint64_t)offset, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < g_nshards; i++)
+        {
+            if (!batches[i].empty())
+            {
+                Mail *m = new Mail();
+                m->repl = true;
+                m->req.swap(batches[i]);
+                shard_post(&g_shards[i], m);
+            }
+        }
+    }
+}
+
+static void *repl_main(void *arg)
+{
+    (void)arg;
+    // 第一次连接, 要全量同步
+    std::string id = "?";
+    int64_t offset = -1;
+    while (true)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0
+            && connect(fd, (const struct sockaddr *)&g_replicaof_addr, sizeof(g_replicaof_addr)) == 0
+            && repl_handshake(fd, id, offset))
+        {
+            __atomic_store_n(&g_repl_stats.link_up, 1, __ATOMIC_RELAXED);
+            if (!repl_stream(fd, offset))
+            {
+                id = "?";
+                offset = -1;
+            }
+            __atomic_store_n(&g_repl_stats.link_up, 0, __ATOMIC_RELAXED);
+            msg("replication: lost the connection to the primary");
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        usleep(k_repl_retry_us);
+    }
+    return NULL;
+}
+
+// 每次读之前至少留出这么多空间, 如果知道当前请求的长度, 就一次留够
+const size_t k_min_read = 1024;
+
+static size_t conn_read_hint(Conn *conn)
+{
+    size_t want = k_min_read;
+    size_t size = buf_size(&conn->rbuf);
+    if (size >= 4)
+    {
+        uint32_t len = 0;
+        memcpy(&len, buf_head(&conn->rbuf), 4);
+        if (4 + (size_t)len > size && 4 + (size_t)len - size > want)
+        {
+            want = 4 + (size_t)len - size;
+        }
     }
+    return want;
 }
 
 static bool try_one_request(Conn *conn)
 {
     // 尝试解析来自缓冲区的请求
-    if (conn->rbuf_size < 4)
+    size_t size = buf_size(&conn->rbuf);
+    if (size < 4)
     {
         return false;
     }
     uint32_t len = 0;
     // 填充前4位为字符串长度
-    memcpy(&len, &conn->rbuf[0], 4);
-    if (len > k_max_msg)
+    memcpy(&len, buf_head(&conn->rbuf), 4);
+    if (4 + (size_t)len > g_max_conn_buf)
     {
         msg("too long");
         conn->state = STATE_END;
         return false;
     }
     // 还没有塞满
-    if (4 + len > conn->rbuf_size)
+    if (4 + len > size)
     {
         return false;
     }
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&conn->rbuf[4], len, cmd))
+    const uint8_t *req = buf_head(&conn->rbuf) + 4;
+    Cmd cmd;
+    if (0 != parse_req(req, len, cmd))
     {
         msg("bad req");
         conn->state = STATE_END;
         return false;
     }
 
-    std::string out;
-    do_request(cmd, out);
-
-    if (4 + out.size() > k_max_msg)
+    const CmdDef *def = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (def && (def->flags & CMD_REPL) && cmd_arity_ok(def, cmd.size()) && repl_accept(conn, cmd))
     {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+        // 之后的数据都由发送线程来发, 事件循环这边的连接直接关掉
+        buf_consume(&conn->rbuf, 4 + len);
+        conn->state = STATE_END;
+        return false;
     }
-
-    uint32_t wlen = (uint32_t)out.size();
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = 4 + wlen;
-
-    // memmove remove request from buffer
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain)
+    if (g_replicaof && def && (def->flags & CMD_WRITE))
     {
-        // 相当于 memcpy ,将 conn->rbuf[4+len]拷贝到 rbuf中，但是比 memcpy更加安全
-        // memmove如果出现了重叠的d
-        // remain表示要复制的字节数
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+        // 从节点只读, 数据只从主节点来
+        size_t pos = conn_begin_res(conn);
+        out_err(conn->wbuf, ERR_READONLY, "replica is read-only");
+        conn_end_res(conn, pos);
+        buf_consume(&conn->rbuf, 4 + len);
+        return (conn->state == STATE_REQ);
+    }
+    bool all_shards = g_nshards > 1 && def && (def->flags & CMD_ALL_SHARDS)
+        && cmd_arity_ok(def, cmd.size());
+    if (cmd_cross_shard(def, cmd))
+    {
+        size_t pos = conn_begin_res(conn);
+        out_err(conn->wbuf, ERR_CROSS_SHARD, "keys in request don't belong to the same shard");
+        conn_end_res(conn, pos);
+        buf_consume(&conn->rbuf, 4 + len);
+        return (conn->state == STATE_REQ);
+    }
+    Shard *owner = all_shards ? &g_shards[0] : cmd_owner(def, cmd);
+    if (owner != g_data.shard || all_shards)
+    {
+        // 不归本分片管, 转发出去, 结果回来之前这个连接不再处理别的请求
+        Mail *m = new Mail();
+        m->conn = conn;
+        m->from = g_data.shard;
+        m->req.assign((const char *)req, len);
+        m->all_shards = all_shards;
+        buf_consume(&conn->rbuf, 4 + len);
+        conn->state = STATE_WAIT;
+        conn->mail_out = true;
+        shard_post(owner, m);
+        return false;
     }
 
-    conn->rbuf_size = remain;
-
-    conn->state = STATE_RES;
-    state_res(conn);
+    size_t pos = conn_begin_res(conn);
+    uint64_t fed = g_data.aof_fed;
+    cmd_exec(def, cmd, conn->wbuf);
+    conn_end_res(conn, pos);
+    if (aof_must_wait(fed))
+    {
+        // 后面的请求照样处理, 回复一起等这一批 fsync 完成
+        aof_hold(&g_data.aof_conns, &conn->aof);
+    }
+    // 请求处理完了, 切片不再使用, 从缓冲区删除这个请求
+    // 只是移动起始位置, 不需要 memmove
+    buf_consume(&conn->rbuf, 4 + len);
+    // 不立即发送, 继续处理缓冲区里的下一个请求
     return (conn->state == STATE_REQ);
 }
 
+#if !defined(USE_IO_URING)
 static bool try_fill_buffer(Conn *conn)
 {
     // 尝试填充缓冲
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
+    buf_reserve(&conn->rbuf, conn_read_hint(conn));
     ssize_t rv = 0;
     do
     {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
+        rv = read(conn->fd, buf_tail(&conn->rbuf), buf_avail(&conn->rbuf));
     } while (rv < 0 && errno == EINTR);
     if (rv < 0 && errno == EAGAIN)
     {
+        // 没有数据可读, 空的缓冲区还给池子
+        buf_release(&conn->rbuf);
         return false;
     }
     if (rv < 0)
@@ -804,7 +4198,7 @@ static bool try_fill_buffer(Conn *conn)
     }
     if (rv == 0)
     {
-        if (conn->rbuf_size > 0)
+        if (buf_size(&conn->rbuf) > 0)
         {
             msg("unexpected EOF");
         }
@@ -815,8 +4209,7 @@ static bool try_fill_buffer(Conn *conn)
         conn->state = STATE_END;
         return false;
     }
-    conn->rbuf_size += (size_t)rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
+    buf_commit(&conn->rbuf, (size_t)rv);
     while (try_one_request(conn))
     {
     }
@@ -825,21 +4218,39 @@ static bool try_fill_buffer(Conn *conn)
 
 static void state_req(Conn *conn)
 {
-    while (try_fill_buffer(conn))
+    while (conn->state == STATE_REQ)
     {
+        // 先处理缓冲区中已经完整的请求, 边缘触发不会为它们再通知一次
+        while (try_one_request(conn))
+        {
+        }
+        while (conn->state == STATE_REQ && try_fill_buffer(conn))
+        {
+        }
+        if (conn->state == STATE_END || !conn_out_pending(conn))
+        {
+            return;
+        }
+        // 这一轮读完了 (或者积压太多), 所有响应用一次 write() 发出去
+        state_res(conn);
+        if (conn_out_pending(conn))
+        {
+            // 写不动了, 等可写事件
+            return;
+        }
     }
 }
 
 // 尝试刷新缓冲
 static bool try_flush_buffer(Conn *conn)
 {
-    size_t rv = 0;
+    ssize_t rv = 0;
     do
     {
         // 获取剩余的大小
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        // 写入数据，冲 wbuf_sent 开始，不能超过 remain
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+        size_t remain = buf_size(&conn->wbuf);
+        // 写入数据，已经发送的部分会从头部丢弃
+        rv = send(conn->fd, buf_head(&conn->wbuf), remain, MSG_NOSIGNAL);
     } while (rv < 0 && errno == EINTR);
     if (rv < 0 && errno == EAGAIN)
     {
@@ -851,15 +4262,16 @@ static bool try_flush_buffer(Conn *conn)
         conn->state = STATE_END;
         return false;
     }
-    // 更新已经发送的index
-    conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
+    // 丢弃已经发送的部分
+    buf_consume(&conn->wbuf, (size_t)rv);
     // 如果写入完成，修改状态，并接收外层循环
-    if (conn->wbuf_sent == conn->wbuf_size)
+    if (buf_size(&conn->wbuf) == 0)
     {
-        conn->state = STATE_REQ;
-        conn->wbuf_sent = 0;
-        conn->wbuf_size = 0;
+        if (conn->state == STATE_RES)
+        {
+            conn->state = STATE_REQ;
+        }
+        buf_release(&conn->wbuf);
         return false;
     }
     return true;
@@ -868,37 +4280,239 @@ static bool try_flush_buffer(Conn *conn)
 //
 static void state_res(Conn *conn)
 {
+    if (conn_aof_held(conn))
+    {
+        return;
+    }
     while (try_flush_buffer(conn))
     {
     }
 }
+#else
+// io_uring 后端: 读写由内核异步完成, 状态机不变, 只是把 read()/write() 换成投递请求
+enum
+{
+    URING_RECV = 1,
+    URING_SEND = 2,
+    URING_ACCEPT = 3,
+    URING_MAIL = 4,
+};
 
-// 根据状态来进行处理
-static void connection_io(Conn *conn)
+// 缓冲池的每个 slab 注册成一个固定缓冲区, 编号超过这个数的 slab 退回普通的 recv
+const size_t k_uring_fixed_slabs = 1024;
+
+// 操作类型放在 user_data 的低 3 位
+static uint64_t uring_tag(Conn *conn, uint32_t op)
+{
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+static io_uring_sqe *uring_sqe()
+{
+    io_uring_sqe *sqe = uring_get_sqe(&g_data.ring);
+    if (!sqe)
+    {
+        // 队列满了, 先提交一批
+        if (uring_submit_and_wait(&g_data.ring, 0, 0) < 0)
+        {
+            die("io_uring_enter");
+        }
+        sqe = uring_get_sqe(&g_data.ring);
+        assert(sqe);
+    }
+    return sqe;
+}
+
+// 缓冲池新建了 slab, 注册到固定缓冲区表里
+static void uring_register_slab(void *base, size_t len, uint32_t index)
+{
+    if (!g_data.uring_fixed || index >= k_uring_fixed_slabs)
+    {
+        return;
+    }
+    struct iovec iov = {};
+    iov.iov_base = base;
+    iov.iov_len = len;
+    io_uring_rsrc_update2 up = {};
+    up.offset = index;
+    up.data = (uint64_t)(uintptr_t)&iov;
+    up.nr = 1;
+    if (uring_register(&g_data.ring, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) < 0)
+    {
+        die("io_uring_register");
+    }
+}
+
+static void uring_post_recv(Conn *conn)
+{
+    buf_reserve(&conn->rbuf, conn_read_hint(conn));
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf_tail(&conn->rbuf);
+    sqe->len = (uint32_t)buf_avail(&conn->rbuf);
+    int slab = buf_slab_index(&conn->rbuf);
+    if (g_data.uring_fixed && slab >= 0 && (size_t)slab < k_uring_fixed_slabs)
+    {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t)slab;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->user_data = uring_tag(conn, URING_RECV);
+    conn->uring_ops |= 1u << URING_RECV;
+}
+
+static void uring_post_send(Conn *conn)
+{
+    if (buf_size(&conn->wbuf_inflight) == 0)
+    {
+        // 把攒下来的响应整体交给内核, wbuf 继续接收新的响应
+        buf_free(&conn->wbuf_inflight);
+        std::swap(conn->wbuf_inflight, conn->wbuf);
+    }
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf_head(&conn->wbuf_inflight);
+    sqe->len = (uint32_t)buf_size(&conn->wbuf_inflight);
+    sqe->user_data = uring_tag(conn, URING_SEND);
+    conn->uring_ops |= 1u << URING_SEND;
+}
+
+// 取消这个 fd 上所有进行中的操作
+static void uring_cancel(Conn *conn)
+{
+    if (conn->uring_cancel)
+    {
+        return;
+    }
+    conn->uring_cancel = true;
+    conn->state = STATE_END;
+    dlist_detach(&conn->idle_list);
+    dlist_init(&conn->idle_list);
+    aof_unhold(&conn->aof);
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = 0;
+}
+
+static void state_req(Conn *conn)
+{
+    // recv 进行中的时候 rbuf 归内核所有, 而且缓冲区里也不会剩下完整的请求
+    if (!(conn->uring_ops & (1u << URING_RECV)))
+    {
+        while (try_one_request(conn))
+        {
+        }
+        if (conn->state == STATE_REQ)
+        {
+            uring_post_recv(conn);
+        }
+    }
+    if (conn->state != STATE_END && conn_out_pending(conn))
+    {
+        state_res(conn);
+    }
+}
+
+static void state_res(Conn *conn)
+{
+    // 同一时间只有一个 send, 它完成之前新的响应都攒在 wbuf 里
+    if (!(conn->uring_ops & (1u << URING_SEND)) && !conn_aof_held(conn))
+    {
+        uring_post_send(conn);
+    }
+}
+
+static void uring_on_recv(Conn *conn, int32_t res)
 {
+    if (res < 0)
+    {
+        msg("recv() error");
+        conn->state = STATE_END;
+        return;
+    }
+    if (res == 0)
+    {
+        msg(buf_size(&conn->rbuf) > 0 ? "unexpected EOF" : "EOF");
+        conn->state = STATE_END;
+        return;
+    }
+    buf_commit(&conn->rbuf, (size_t)res);
+    state_req(conn);
+}
+
+static void uring_on_send(Conn *conn, int32_t res)
+{
+    if (res < 0)
+    {
+        msg("send() error");
+        conn->state = STATE_END;
+        return;
+    }
+    buf_consume(&conn->wbuf_inflight, (size_t)res);
+    if (buf_size(&conn->wbuf_inflight))
+    {
+        return state_res(conn);
+    }
+    buf_release(&conn->wbuf_inflight);
+    if (conn->state == STATE_RES && buf_size(&conn->wbuf) < g_out_hwm)
+    {
+        conn->state = STATE_REQ;
+    }
+    if (conn->state == STATE_REQ)
+    {
+        state_req(conn);
+    }
+    else if (buf_size(&conn->wbuf))
+    {
+        state_res(conn);
+    }
+}
+#endif
 
+// 根据状态来进行处理
+// 有活动的连接移到空闲链表的末尾
+static void conn_touch(Conn *conn)
+{
     conn->idle_start = get_monotonic_usec();
     dlist_detach(&conn->idle_list);
     dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+}
+
+#if !defined(USE_IO_URING)
+static void connection_io(Conn *conn)
+{
+    conn_touch(conn);
 
-    if (conn->state == STATE_REQ)
-    {
-        state_req(conn);
-    }
-    else if (conn->state == STATE_RES)
+    assert(conn->state != STATE_END);
+    // 先把积压的响应发出去
+    if (conn_out_pending(conn))
     {
         state_res(conn);
     }
-    else
+    // 写完之后接着读
+    if (conn->state == STATE_REQ)
     {
-        assert(0); // 非预期错误
+        state_req(conn);
     }
 }
+#endif
 
 const uint64_t k_idle_timeout_ms = 5 * 1000;
 
 static uint32_t next_timer_ms()
 {
+    // 还有没迁移完的 HMap, 或者还有没写出去的 AOF 记录, 不要阻塞
+    if ((g_rehash_budget_us && hm_rehash_pending()) || !g_data.aof_buf.empty())
+    {
+        return 0;
+    }
     uint64_t now_us = get_monotonic_usec();
     uint64_t next_us = (uint64_t)-1;
 
@@ -910,15 +4524,15 @@ static uint32_t next_timer_ms()
         next_us = next->idle_start + k_idle_timeout_ms * 1000;
     }
 
-    // TTL 定时器
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_us)
+    // TTL 定时器, 从节点不用
+    if (!g_replicaof && !g_data.heap.empty() && g_data.heap[0].val < next_us)
     {
         next_us = g_data.heap[0].val;
     }
 
     if (next_us == (uint64_t)-1)
     {
-        return 10000; // no timer, the value doesn't matter
+        next_us = now_us + 10000 * 1000; // no timer, the value doesn't matter
     }
 
     if (next_us <= now_us)
@@ -926,20 +4540,135 @@ static uint32_t next_timer_ms()
         // missed?
         return 0;
     }
-    return (uint32_t)((next_us - now_us) / 1000);
+    uint64_t ms = (next_us - now_us) / 1000;
+    // 后台快照和 AOF 重写的子进程结束的时候不会唤醒事件循环, 定期检查一下
+    const uint64_t k_bgsave_poll_ms = 100;
+    if ((g_data.save_child >= 0 || g_data.aof_child >= 0) && ms > k_bgsave_poll_ms)
+    {
+        ms = k_bgsave_poll_ms;
+    }
+    return (uint32_t)ms;
 }
 
 static void conn_done(Conn *conn)
 {
+#if defined(USE_IO_URING)
+    if (conn->uring_ops)
+    {
+        // 还有进行中的读写, 先取消, 全部完成之后会再回到这里
+        return uring_cancel(conn);
+    }
+#endif
+    if (conn->mail_out)
+    {
+        // 转发的请求还没回来, 先停掉读写, 丢掉缓冲区, 等 shard_reply 再来释放.
+        // fd 先不关, 免得编号被新连接复用, 在 fd2conn 里冲突
+        conn->state = STATE_END;
+        ev_del(conn);
+        dlist_detach(&conn->idle_list);
+        dlist_init(&conn->idle_list);
+        aof_unhold(&conn->aof);
+        buf_free(&conn->rbuf);
+        buf_free(&conn->wbuf);
+#if defined(USE_IO_URING)
+        buf_free(&conn->wbuf_inflight);
+#endif
+        return;
+    }
+    ev_del(conn);
     g_data.fd2conn[conn->fd] = NULL;
     (void)close(conn->fd);
     dlist_detach(&conn->idle_list);
-    free(conn);
+    aof_unhold(&conn->aof);
+    buf_free(&conn->rbuf);
+    buf_free(&conn->wbuf);
+#if defined(USE_IO_URING)
+    buf_free(&conn->wbuf_inflight);
+#endif
+    delete conn;
 }
 
-static bool hnode_same(HNode *lhs, HNode *rhs)
+// 后台迁移 HMap, 每轮最多花 g_rehash_budget_us
+static void process_rehash()
 {
-    return lhs == rhs;
+    if (!g_rehash_budget_us)
+    {
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    while (hm_rehash_pending() && get_monotonic_usec() - start_us < g_rehash_budget_us)
+    {
+        hm_rehash_step();
+    }
+}
+
+// 放行已经 fsync 的回复, 再把本轮的记录写出去
+static void process_aof()
+{
+    if (!g_data.aof_on)
+    {
+        // 没开 AOF 的时候记录只给复制用
+        aof_flush();
+        return;
+    }
+    uint64_t synced = __atomic_load_n(&g_aof.synced, __ATOMIC_ACQUIRE);
+    while (!dlist_empty(&g_data.aof_mails))
+    {
+        AofWait *w = container_of(g_data.aof_mails.next, AofWait, link);
+        if (!w->seq || w->seq > synced)
+        {
+            break;
+        }
+        aof_unhold(w);
+        Mail *m = container_of(w, Mail, aof);
+        shard_post(m->from, m);
+    }
+    while (!dlist_empty(&g_data.aof_conns))
+    {
+        AofWait *w = container_of(g_data.aof_conns.next, AofWait, link);
+        if (!w->seq || w->seq > synced)
+        {
+            break;
+        }
+        aof_unhold(w);
+        // 和 shard_reply 一样, 发出回复之后接着处理后面的请求
+        Conn *conn = container_of(w, Conn, aof);
+        state_res(conn);
+        if (conn->state == STATE_REQ)
+        {
+            state_req(conn);
+        }
+        if (conn->state == STATE_END)
+        {
+            conn_done(conn);
+        }
+        else
+        {
+            ev_update(conn);
+        }
+    }
+    bool flushed = aof_flush();
+    if (dlist_empty(&g_data.aof_conns) && dlist_empty(&g_data.aof_mails))
+    {
+        __atomic_store_n(&g_data.shard->aof_waiting, false, __ATOMIC_RELAXED);
+    }
+
+    process_aof_rewrite();
+    // 自动重写只由分片 0 发起
+    if (flushed && g_aof_rewrite_min && g_data.shard->id == 0 && g_data.aof_child < 0
+        && get_monotonic_usec() >= g_data.aof_retry_us)
+    {
+        pthread_mutex_lock(&g_aof.mu);
+        uint64_t incr = g_aof.incr_bytes;
+        pthread_mutex_unlock(&g_aof.mu);
+        pthread_mutex_lock(&g_save_mu);
+        uint64_t base = g_aof_stats.last.bytes;
+        pthread_mutex_unlock(&g_save_mu);
+        if (incr >= g_aof_rewrite_min && incr >= base && !aof_rewrite_start())
+        {
+            g_data.aof_retry_us = get_monotonic_usec() + k_aof_retry_us;
+        }
+    }
 }
 
 static void process_timers()
@@ -957,19 +4686,30 @@ static void process_timers()
             // not ready
             break;
         }
+        if (next->state == STATE_WAIT)
+        {
+            // 还在等其它分片的结果, 不能释放
+            next->idle_start = get_monotonic_usec();
+            dlist_detach(&next->idle_list);
+            dlist_insert_before(&g_data.idle_list, &next->idle_list);
+            continue;
+        }
 
         printf("removing idle connection: %d\n", next->fd);
         conn_done(next);
     }
 
-    // TTL timers
+    // TTL timers. 从节点不自己删过期的 key, 等主节点的 del 传过来, 两边的数据才不会不一样
     const size_t k_max_works = 2000;
     size_t nworks = 0;
-    while (!g_data.heap.empty() && g_data.heap[0].val < now_us)
+    while (!g_replicaof && !g_data.heap.empty() && g_data.heap[0].val < now_us)
     {
-        Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
+        Entry *ent = entry_from_heap_idx(g_data.heap[0].ref);
         HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
         assert(node == &ent->node);
+        // 过期删掉的 key 也写进 AOF
+        std::string_view args[2] = {"del", entry_key(ent)};
+        aof_feed(args, 2);
         entry_del(ent);
         if (nworks++ >= k_max_works)
         {
@@ -979,9 +4719,8 @@ static void process_timers()
     }
 }
 
-int main()
+static int listen_on(uint16_t port)
 {
-
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0)
     {
@@ -990,11 +4729,13 @@ int main()
 
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    // 每个分片一个监听 socket, 由内核把新连接分散到各个线程
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
 
     // bind
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
+    addr.sin_port = ntohs(port);
     addr.sin_addr.s_addr = ntohl(0);
     int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
     if (rv)
@@ -1009,18 +4750,160 @@ int main()
 
     // nio
     fd_set_nb(fd);
+    return fd;
+}
+
+#if defined(USE_IO_URING)
+static void uring_post_accept(int fd)
+{
+    // multishot accept, 一个 sqe 持续产生新连接
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uring_tag(NULL, URING_ACCEPT);
+}
+
+static void uring_post_mail(int efd)
+{
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = efd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_tag(NULL, URING_MAIL);
+}
+
+static void uring_complete(io_uring_cqe *cqe, int fd, int efd)
+{
+    uint32_t op = (uint32_t)(cqe->user_data & 7);
+    Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)7);
+    switch (op)
+    {
+    case URING_ACCEPT:
+        if (cqe->res >= 0)
+        {
+            (void)conn_new(cqe->res);
+        }
+        else
+        {
+            msg("accept() error");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            uring_post_accept(fd);
+        }
+        return;
+    case URING_MAIL:
+        shard_recv();
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            uring_post_mail(efd);
+        }
+        return;
+    case URING_RECV:
+    case URING_SEND:
+        conn->uring_ops &= ~(1u << op);
+        break;
+    default:
+        // 取消操作自己的结果, 不关心
+        return;
+    }
+
+    if (conn->uring_cancel)
+    {
+        if (!conn->uring_ops)
+        {
+            conn_done(conn);
+        }
+        return;
+    }
+    conn_touch(conn);
+    if (op == URING_RECV)
+    {
+        uring_on_recv(conn, cqe->res);
+    }
+    else
+    {
+        uring_on_send(conn, cqe->res);
+    }
+    if (conn->state == STATE_END)
+    {
+        conn_done(conn);
+    }
+}
+
+static void uring_loop(int fd, int efd)
+{
+    int rv = uring_init(&g_data.ring, 4096);
+    if (rv < 0)
+    {
+        errno = -rv;
+        die("io_uring_setup");
+    }
+    // 先注册一张稀疏的缓冲区表, 缓冲池每新建一个 slab 就填进去一个
+    io_uring_rsrc_register reg = {};
+    reg.nr = k_uring_fixed_slabs;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    rv = uring_register(&g_data.ring, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg));
+    g_data.uring_fixed = rv >= 0;
+    if (!g_data.uring_fixed)
+    {
+        msg("io_uring: fixed buffers unavailable, using recv/send");
+    }
+    buf_pool_on_new_slab(&uring_register_slab);
+
+    uring_post_accept(fd);
+    uring_post_mail(efd);
+
+    // the event loop, 每轮只有一次系统调用: 提交所有请求并等待完成
+    while (true)
+    {
+        int timeout_ms = (int)next_timer_ms();
+        rv = uring_submit_and_wait(&g_data.ring, 1, timeout_ms);
+        if (rv < 0)
+        {
+            errno = -rv;
+            die("io_uring_enter");
+        }
+        while (io_uring_cqe *cqe = uring_peek_cqe(&g_data.ring))
+        {
+            io_uring_cqe copy = *cqe;
+            uring_cqe_seen(&g_data.ring);
+            uring_complete(&copy, fd, efd);
+        }
+        // 处理 timers
+        process_timers();
+        process_rehash();
+        process_bgsave();
+        process_aof();
+        shard_park();
+    }
+}
+#endif
 
+static void *shard_main(void *arg)
+{
+    shard_attach((Shard *)arg);
     dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.tp, 4);
+    dlist_init(&g_data.aof_conns);
+    dlist_init(&g_data.aof_mails);
+    snapshot_insert();
+    aof_replay();
+    int fd = listen_on(g_port);
+    int efd = g_data.shard->efd;
 
+#if defined(USE_POLL)
     // the event loop
     std::vector<struct pollfd> poll_args;
     while (true)
     {
         poll_args.clear();
-        // 设置监听监听的fd下标为0
+        // 设置监听监听的fd下标为0, 邮箱的通知为1
         struct pollfd pfd = {fd, POLLIN, 0};
         poll_args.push_back(pfd);
+        struct pollfd mfd = {efd, POLLIN, 0};
+        poll_args.push_back(mfd);
         for (Conn *conn : g_data.fd2conn)
         {
             if (!conn)
@@ -1030,8 +4913,17 @@ int main()
             struct pollfd pfd = {};
             // 指定fd
             pfd.fd = conn->fd;
-            // 指定时间，可能是read or write
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
+            // 指定时间，可能是read or write, 也可能两个都要
+            pfd.events = (conn->state == STATE_REQ) ? POLLIN : 0;
+            if (conn_out_pending(conn) && !conn_aof_held(conn))
+            {
+                pfd.events |= POLLOUT;
+            }
+            if (!pfd.events)
+            {
+                // 等待其它分片的结果
+                continue;
+            }
             pfd.events = pfd.events | POLLERR;
             poll_args.push_back(pfd);
         }
@@ -1039,12 +4931,12 @@ int main()
         int timeout_ms = (int)next_timer_ms();
         // 活动的 fds
         int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
-        if (rv < 0)
+        if (rv < 0 && errno != EINTR)
         {
             die("poll");
         }
         // 处理active connection
-        for (size_t i = 1; i < poll_args.size(); ++i)
+        for (size_t i = 2; i < poll_args.size(); ++i)
         {
             // TODO
             if (poll_args[i].revents)
@@ -1058,10 +4950,23 @@ int main()
                 {
                     conn_done(conn);
                 }
+                else
+                {
+                    ev_update(conn);
+                }
             }
         }
+        // 其它分片发过来的消息
+        if (poll_args[1].revents)
+        {
+            shard_recv();
+        }
         // 处理 timers
         process_timers();
+        process_rehash();
+        process_bgsave();
+        process_aof();
+        shard_park();
 
         // 如果监听的fd active 就尝试创建一个新的连接
         if (poll_args[0].revents)
@@ -1069,5 +4974,287 @@ int main()
             (void)accept_new_conn(fd);
         }
     }
+#elif defined(USE_EPOLL)
+    g_data.epfd = epoll_create1(0);
+    if (g_data.epfd < 0)
+    {
+        die("epoll_create1");
+    }
+    struct epoll_event lev = {};
+    lev.events = EPOLLIN | EPOLLET;
+    lev.data.fd = fd;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, fd, &lev))
+    {
+        die("epoll_ctl(ADD)");
+    }
+    struct epoll_event mev = {};
+    mev.events = EPOLLIN;
+    mev.data.fd = efd;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, efd, &mev))
+    {
+        die("epoll_ctl(ADD)");
+    }
+
+    // the event loop, 每次只遍历就绪的连接
+    std::vector<struct epoll_event> events(1024);
+    while (true)
+    {
+        int timeout_ms = (int)next_timer_ms();
+        int rv = epoll_wait(g_data.epfd, events.data(), (int)events.size(), timeout_ms);
+        if (rv < 0 && errno != EINTR)
+        {
+            die("epoll_wait");
+        }
+        bool accept_ready = false;
+        bool mail_ready = false;
+        for (int i = 0; i < rv; ++i)
+        {
+            int cfd = events[i].data.fd;
+            if (cfd == fd)
+            {
+                accept_ready = true;
+                continue;
+            }
+            if (cfd == efd)
+            {
+                mail_ready = true;
+                continue;
+            }
+            Conn *conn = g_data.fd2conn[cfd];
+            if (conn->state == STATE_WAIT && !conn_out_pending(conn))
+            {
+                // 结果回来之后会重新关注读写
+                continue;
+            }
+            connection_io(conn);
+            if (conn->state == STATE_END)
+            {
+                conn_done(conn);
+            }
+            else
+            {
+                ev_update(conn);
+            }
+        }
+        // 其它分片发过来的消息
+        if (mail_ready)
+        {
+            shard_recv();
+        }
+        // 处理 timers
+        process_timers();
+        process_rehash();
+        process_bgsave();
+        process_aof();
+        shard_park();
+
+        // 边缘触发, 要一直 accept 到 EAGAIN
+        if (accept_ready)
+        {
+            while (accept_new_conn(fd) == 0)
+            {
+            }
+        }
+    }
+#else
+    uring_loop(fd, efd);
+#endif
+    return NULL;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: server [--port N] [--threads N] [--out-hwm BYTES] [--max-buf BYTES]\n"
+                    "              [--hm-max-load F] [--hm-min-load F] [--rehash-budget-us N]\n"
+                    "              [--zset-index avl|btree] [--zset-max-flat N] [--zset-max-flat-name BYTES]\n"
+                    "              [--snapshot PATH] [--load-threads N]\n"
+                    "              [--aof PREFIX] [--appendfsync always|everysec|no] [--aof-rewrite-min BYTES]\n"
+                    "              [--replicaof HOST:PORT] [--repl-backlog BYTES]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+        {
+            g_nshards = (size_t)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+        {
+            g_port = (uint16_t)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--out-hwm") && i + 1 < argc)
+        {
+            g_out_hwm = (size_t)atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--max-buf") && i + 1 < argc)
+        {
+            g_max_conn_buf = (size_t)atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--hm-max-load") && i + 1 < argc)
+        {
+            g_hm_config.max_load = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--hm-min-load") && i + 1 < argc)
+        {
+            g_hm_config.min_load = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--zset-index") && i + 1 < argc)
+        {
+            const char *index = argv[++i];
+            if (!strcmp(index, "avl"))
+            {
+                g_zset_config.index = ZSET_AVL;
+            }
+            else if (!strcmp(index, "btree"))
+            {
+                g_zset_config.index = ZSET_BTREE;
+            }
+            else
+            {
+                usage();
+            }
+        }
+        else if (!strcmp(argv[i], "--zset-max-flat") && i + 1 < argc)
+        {
+            g_zset_config.max_flat_n = (size_t)atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--zset-max-flat-name") && i + 1 < argc)
+        {
+            g_zset_config.max_flat_len = (size_t)atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--rehash-budget-us") && i + 1 < argc)
+        {
+            g_rehash_budget_us = (uint64_t)atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc)
+        {
+            g_snap_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--load-threads") && i + 1 < argc)
+        {
+            g_load_threads = (size_t)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--aof") && i + 1 < argc)
+        {
+            g_aof_prefix = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--appendfsync") && i + 1 < argc)
+        {
+            const char *mode = argv[++i];
+            if (!strcmp(mode, "always"))
+            {
+                g_aof.fsync_mode = AOF_FSYNC_ALWAYS;
+            }
+            else if (!strcmp(mode, "everysec"))
+            {
+                g_aof.fsync_mode = AOF_FSYNC_EVERYSEC;
+            }
+            else if (!strcmp(mode, "no"))
+            {
+                g_aof.fsync_mode = AOF_FSYNC_NO;
+            }
+            else
+            {
+                usage();
+            }
+        }
+        else if (!strcmp(argv[i], "--aof-rewrite-min") && i + 1 < argc)
+        {
+            g_aof_rewrite_min = (uint64_t)atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--replicaof") && i + 1 < argc)
+        {
+            g_replicaof = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--repl-backlog") && i + 1 < argc)
+        {
+            g_backlog_size = (size_t)atoll(argv[++i]);
+        }
+        else
+        {
+            usage();
+        }
+    }
+    // 缩容之后的装载率是 max_load / 2 左右, min_load 至少要再小一半, 不然会反复扩缩
+    if (g_nshards < 1 || g_hm_config.max_load <= 0
+        || g_hm_config.min_load < 0 || g_hm_config.min_load > g_hm_config.max_load / 4
+        || g_backlog_size == 0)
+    {
+        usage();
+    }
+    if (g_replicaof)
+    {
+        // 从节点的数据全部来自主节点, 全量同步会整个换掉, 所以不开 AOF
+        const char *colon = strrchr(g_replicaof, ':');
+        std::string host = colon ? std::string(g_replicaof, colon - g_replicaof) : "";
+        g_replicaof_addr.sin_family = AF_INET;
+        g_replicaof_addr.sin_port = htons((uint16_t)(colon ? atoi(colon + 1) : 0));
+        if (g_aof_prefix || !g_replicaof_addr.sin_port
+            || inet_pton(AF_INET, host.c_str(), &g_replicaof_addr.sin_addr) != 1)
+        {
+            usage();
+        }
+    }
+
+    // 随机的哈希种子, 必须在启动分片线程之前设置好
+    if (getrandom(&g_hash_seed, sizeof(g_hash_seed), 0) != sizeof(g_hash_seed))
+    {
+        g_hash_seed = get_monotonic_usec() ^ ((uint64_t)getpid() << 32);
+    }
+    uint64_t id[2] = {g_hash_seed, get_monotonic_usec()};
+    if (getrandom(id, sizeof(id), 0) != sizeof(id))
+    {
+        id[0] ^= (uint64_t)getpid();
+    }
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)id[0], (unsigned long long)id[1]);
+    g_repl_id = hex;
+
+    fprintf(stderr, "backend: %s, threads: %zu\n", EV_BACKEND, g_nshards);
+    thread_pool_init(&g_tp, 4);
+
+    g_shards = new Shard[g_nshards];
+    for (size_t i = 0; i < g_nshards; ++i)
+    {
+        g_shards[i].id = i;
+        g_shards[i].efd = eventfd(0, EFD_NONBLOCK);
+        if (g_shards[i].efd < 0)
+        {
+            die("eventfd()");
+        }
+    }
+    // 快照或者 AOF 坏了就不启动, 免得用空的数据覆盖掉它. 开启了 AOF 就只从 AOF 加载, 从节点什么都不加载
+    if (g_aof_prefix && !aof_load())
+    {
+        fprintf(stderr, "bad append-only file: %s\n", aof_manifest_path(g_aof_prefix).c_str());
+        exit(1);
+    }
+    if (!g_aof_prefix && !g_replicaof && !snapshot_decode(g_snap_path))
+    {
+        fprintf(stderr, "bad snapshot file: %s\n", g_snap_path);
+        exit(1);
+    }
+    // 分片 0 跑在主线程上
+    for (size_t i = 1; i < g_nshards; ++i)
+    {
+        int rv = pthread_create(&g_shards[i].thread, NULL, &shard_main, &g_shards[i]);
+        if (rv)
+        {
+            die("pthread_create()");
+        }
+    }
+    if (g_replicaof)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &repl_main, NULL) != 0)
+        {
+            die("pthread_create()");
+        }
+    }
+    g_shards[0].thread = pthread_self();
+    shard_main(&g_shards[0]);
     return 0;
 }
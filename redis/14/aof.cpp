@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "aof.h"
+
+std::string aof_base_path(const char *prefix, int64_t id)
+{
+    return std::string(prefix) + "." + std::to_string(id) + ".base";
+}
+
+std::string aof_incr_path(const char *prefix, int64_t id)
+{
+    return std::string(prefix) + "." + std::to_string(id) + ".incr";
+}
+
+std::string aof_manifest_path(const char *prefix)
+{
+    return std::string(prefix) + ".manifest";
+}
+
+bool aof_manifest_read(const char *prefix, AofManifest *m)
+{
+    FILE *fp = fopen(aof_manifest_path(prefix).c_str(), "r");
+    if (!fp)
+    {
+        return false;
+    }
+    *m = AofManifest{};
+    char line[128];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp))
+    {
+        long long id = 0;
+        if (sscanf(line, "base %lld", &id) == 1 && id >= 0 && m->base < 0 && m->incrs.empty())
+        {
+            m->base = id;
+        }
+        else if (sscanf(line, "incr %lld", &id) == 1 && id >= 0)
+        {
+            m->incrs.push_back(id);
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    fclose(fp);
+    // 至少要有一个增量文件用来追加
+    if (!ok || m->incrs.empty())
+    {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+bool aof_manifest_write(const char *prefix, const AofManifest &m)
+{
+    std::string text;
+    if (m.base >= 0)
+    {
+        text += "base " + std::to_string(m.base) + "\n";
+    }
+    for (int64_t id : m.incrs)
+    {
+        text += "incr " + std::to_string(id) + "\n";
+    }
+    std::string path = aof_manifest_path(prefix);
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = write(fd, text.data(), text.size()) == (ssize_t)text.size();
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+void aof_encode(std::string &out, const std::string_view *args, size_t n)
+{
+    uint32_t len = 4;
+    for (size_t i = 0; i < n; i++)
+    {
+        len += 4 + (uint32_t)args[i].size();
+    }
+    uint32_t nstr = (uint32_t)n;
+    out.append((char *)&len, 4);
+    out.append((char *)&nstr, 4);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t sz = (uint32_t)args[i].size();
+        out.append((char *)&sz, 4);
+        out.append(args[i].data(), sz);
+    }
+}
+
+bool aof_next_record(const uint8_t *data, size_t size, size_t *pos,
+                     const uint8_t **rec, uint32_t *len)
+{
+    if (size - *pos < 4)
+    {
+        return false;
+    }
+    memcpy(len, data + *pos, 4);
+    if (size - *pos - 4 < *len)
+    {
+        return false;
+    }
+    *rec = data + *pos + 4;
+    *pos += 4 + (size_t)*len;
+    return true;
+}
+
+static uint64_t aof_now_usec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// fsync 线程: always 的时候有新的批就 fsync, 一次 fsync 覆盖这期间所有分片写的批 (group commit);
+// everysec 每秒一次; no 只负责关掉换下来的文件
+static void *aof_sync_main(void *arg)
+{
+    AofLog *log = (AofLog *)arg;
+    pthread_mutex_lock(&log->mu);
+    while (true)
+    {
+        uint64_t synced = __atomic_load_n(&log->synced, __ATOMIC_RELAXED);
+        if (log->retired.empty() && (log->fsync_mode != AOF_FSYNC_ALWAYS || log->written == synced))
+        {
+            if (log->fsync_mode == AOF_FSYNC_EVERYSEC)
+            {
+                timespec ts = {0, 0};
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += 1;
+                pthread_cond_timedwait(&log->cv, &log->mu, &ts);
+            }
+            else
+            {
+                pthread_cond_wait(&log->cv, &log->mu);
+            }
+            if (log->retired.empty() && log->fsync_mode != AOF_FSYNC_EVERYSEC)
+            {
+                continue;
+            }
+        }
+        uint64_t target = log->written;
+        int fd = log->fd;
+        std::vector<int> retired;
+        retired.swap(log->retired);
+        pthread_mutex_unlock(&log->mu);
+
+        // 换下来的文件里可能还有没 fsync 的批
+        for (int old : retired)
+        {
+            fdatasync(old);
+            close(old);
+        }
+        uint64_t cost_us = 0;
+        bool did = log->fsync_mode != AOF_FSYNC_NO && target > synced;
+        if (did)
+        {
+            uint64_t start_us = aof_now_usec();
+            // fsync 失败之后, 页缓存里的数据可能已经丢了, 不能当作写成功继续运行
+            if (fdatasync(fd) != 0)
+            {
+                perror("fdatasync");
+                abort();
+            }
+            cost_us = aof_now_usec() - start_us;
+        }
+        __atomic_store_n(&log->synced, target, __ATOMIC_RELEASE);
+        if (log->on_synced)
+        {
+            log->on_synced();
+        }
+
+        pthread_mutex_lock(&log->mu);
+        if (did)
+        {
+            log->fsyncs++;
+            log->fsync_us += cost_us;
+            log->fsync_max_us = cost_us > log->fsync_max_us ? cost_us : log->fsync_max_us;
+        }
+    }
+    return NULL;
+}
+
+void aof_start(AofLog *log, int fd)
+{
+    log->fd = fd;
+    struct stat st;
+    log->incr_bytes = fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    if (pthread_create(&log->thread, NULL, &aof_sync_main, log) != 0)
+    {
+        perror("pthread_create");
+        abort();
+    }
+}
+
+uint64_t aof_write(AofLog *log, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t left = len;
+    while (left > 0)
+    {
+        ssize_t rv = write(log->fd, p, left);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return 0;
+        }
+        p += rv;
+        left -= (size_t)rv;
+    }
+    // 写完之后才拿序号, fsync 线程看到的序号对应的批一定已经写进文件了
+    pthread_mutex_lock(&log->mu);
+    uint64_t seq = ++log->written;
+    log->bytes += len;
+    log->incr_bytes += len;
+    if (log->fsync_mode == AOF_FSYNC_ALWAYS)
+    {
+        pthread_cond_signal(&log->cv);
+    }
+    pthread_mutex_unlock(&log->mu);
+    return seq;
+}
+
+void aof_switch(AofLog *log, int fd)
+{
+    pthread_mutex_lock(&log->mu);
+    log->retired.push_back(log->fd);
+    log->fd = fd;
+    log->incr_bytes = 0;
+    pthread_cond_signal(&log->cv);
+    pthread_mutex_unlock(&log->mu);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// 追加日志 (AOF). 每条记录和客户端发来的请求格式一样: u32 长度, u32 参数个数, 每个参数 u32 长度 + 数据
+// 日志由一个基础文件 (快照格式, 可以没有) 和若干增量文件组成, 清单文件 PREFIX.manifest 按顺序列出它们:
+//   base N    对应 PREFIX.N.base
+//   incr N    对应 PREFIX.N.incr
+// 只有最后一个增量文件会被追加. 重写的时候先换一个新的增量文件, 子进程把数据写成新的基础文件,
+// 写完之后清单换成新的基础文件和新的增量文件, 旧的文件删掉
+enum
+{
+    // 不主动 fsync, 由内核决定什么时候写到磁盘
+    AOF_FSYNC_NO = 0,
+    // 后台线程每秒 fsync 一次
+    AOF_FSYNC_EVERYSEC = 1,
+    // 每一批都 fsync, 响应等 fsync 完成之后再发
+    AOF_FSYNC_ALWAYS = 2,
+};
+
+struct AofManifest
+{
+    // -1 表示没有基础文件
+    int64_t base = -1;
+    std::vector<int64_t> incrs;
+};
+
+std::string aof_base_path(const char *prefix, int64_t id);
+std::string aof_incr_path(const char *prefix, int64_t id);
+std::string aof_manifest_path(const char *prefix);
+// 文件不存在的时候返回 false, errno 是 ENOENT
+bool aof_manifest_read(const char *prefix, AofManifest *m);
+// 先写临时文件, fsync 之后改名
+bool aof_manifest_write(const char *prefix, const AofManifest &m);
+
+// 追加一条记录
+void aof_encode(std::string &out, const std::string_view *args, size_t n);
+// 从 pos 开始取一条完整的记录 (不含长度头), 剩下的数据不够一条返回 false
+bool aof_next_record(const uint8_t *data, size_t size, size_t *pos,
+                     const uint8_t **rec, uint32_t *len);
+
+// 正在追加的文件和 fsync 线程, 所有分片共用. 各个分片每轮事件循环写一批,
+// 每批有一个全局的序号, synced 之前的批都已经在磁盘上了
+struct AofLog
+{
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+    pthread_t thread;
+    int fsync_mode = AOF_FSYNC_EVERYSEC;
+    // 当前的增量文件. 只在所有分片都暂停的时候切换, 所以分片线程读它不用加锁
+    int fd = -1;
+    // 换下来的文件, 由 fsync 线程 fsync 之后关掉
+    std::vector<int> retired;
+    // 写完的批数, 用 mu 保护
+    uint64_t written = 0;
+    // 已经 fsync 的批数, 原子地读写
+    uint64_t synced = 0;
+    // 统计, 用 mu 保护
+    uint64_t bytes = 0;
+    // 当前文件的大小, 用来决定什么时候自动重写
+    uint64_t incr_bytes = 0;
+    uint64_t fsyncs = 0;
+    uint64_t fsync_us = 0;
+    uint64_t fsync_max_us = 0;
+    // 在 fsync 线程里调用, 每次 fsync 完成之后
+    void (*on_synced)() = NULL;
+};
+
+// 开始追加 fd (已经用 O_APPEND 打开), 启动 fsync 线程
+void aof_start(AofLog *log, int fd);
+// 写一批, 返回这一批的序号, 写失败返回 0
+uint64_t aof_write(AofLog *log, const void *data, size_t len);
+// 换成新的文件, 调用的时候不能有别的线程在写
+void aof_switch(AofLog *log, int fd);
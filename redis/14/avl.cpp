@@ -5,20 +5,16 @@ static uint32_t avl_depth(AVLNode *node)
     return node ? node->depth : 0;
 }
 
-static uint32_t avl_cnt(AVLNode *node)
-{
-    return node ? node->cnt : 0;
-}
-
 static uint32_t max(uint32_t lhs, uint32_t rhs)
 {
     return lhs < rhs ? rhs : lhs;
 }
 
-static uint32_t avl_update(AVLNode *node)
+// 左右子树变了之后重新算高度和子树的节点个数
+static void avl_update(AVLNode *node)
 {
     node->depth = 1 + max(avl_depth(node->left), avl_depth(node->right));
-    return node ? node->depth : 0;
+    node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
 }
 //     a   ->     c
 //    / \        / \      
@@ -176,7 +172,7 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset)
         else if (pos > offset && pos - avl_cnt(node->left) <= offset)
         {
             node = node->left;
-            pos += avl_cnt(node->right) + 1;
+            pos -= avl_cnt(node->right) + 1;
         }
         else
         {
@@ -197,4 +193,19 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset)
         }
     }
     return node;
-}
\ No newline at end of file
+}
+
+int64_t avl_rank(AVLNode *node)
+{
+    int64_t rank = avl_cnt(node->left);
+    while (node->parent)
+    {
+        // 从右边上来, 父节点和它的左子树都排在前面
+        if (node->parent->right == node)
+        {
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+        node = node->parent;
+    }
+    return rank;
+}
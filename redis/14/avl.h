@@ -19,6 +19,15 @@ inline void avl_init(AVLNode *node)
     node->left = node->right = node->parent = NULL;
 }
 
+inline uint32_t avl_cnt(AVLNode *node)
+{
+    return node ? node->cnt : 0;
+}
+
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
-AVLNode *avl_offset(AVLNode *node, int64_t offset);
\ No newline at end of file
+// 中序的第 offset 个后继 (负数是前驱), 超出范围返回 NULL. O(log n),
+// 一步步 (+1 或者 -1) 走过一段连续的节点时平均每步 O(1)
+AVLNode *avl_offset(AVLNode *node, int64_t offset);
+// 节点在整棵树中序里的位置, 从 0 开始. O(log n)
+int64_t avl_rank(AVLNode *node);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// bench_*.cpp 和 test_server.cpp 共用的小工具
+
+// 按协议把命令编码成一个请求: 总长度, 参数个数, 每个参数的长度和内容
+inline std::string make_req(const std::vector<std::string> &cmd)
+{
+    std::string body;
+    uint32_t n = (uint32_t)cmd.size();
+    body.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t sz = (uint32_t)s.size();
+        body.append((char *)&sz, 4);
+        body.append(s);
+    }
+    uint32_t len = (uint32_t)body.size();
+    return std::string((char *)&len, 4) + body;
+}
+
+// 单调时钟, 单位秒
+inline double now_sec()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// 进程现在占用的物理内存
+inline size_t rss_bytes()
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, rss = 0;
+    if (!fp || fscanf(fp, "%lu %lu", &size, &rss) != 2)
+    {
+        abort();
+    }
+    fclose(fp);
+    return rss * (size_t)sysconf(_SC_PAGESIZE);
+}
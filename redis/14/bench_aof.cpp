@@ -0,0 +1,218 @@
+#include <chrono>
+
+// 把服务端整个包含进来, 在同一个进程里起服务端, 测完直接读 g_aof 里的统计
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 测不同 appendfsync 模式下的写吞吐: 多个客户端连接, 每个连接流水线地发 set
+// 每种模式在单独的子进程里跑, 全局状态互不影响
+// 用法: bench_aof [连接数, 默认 16] [每个连接的流水线深度, 默认 32] [秒数, 默认 3] [日志前缀, 默认 /tmp/bench_aof]
+
+static size_t g_nconns = 16;
+static size_t g_depth = 32;
+static double g_seconds = 3;
+static const char *g_prefix = "/tmp/bench_aof";
+static const uint16_t k_bench_port = 12345;
+
+static bool read_full(int fd, void *buf, size_t n)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (n > 0)
+    {
+        ssize_t rv = read(fd, p, n);
+        if (rv <= 0)
+        {
+            return false;
+        }
+        p += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, p, n);
+        if (rv <= 0)
+        {
+            return false;
+        }
+        p += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+static int connect_server()
+{
+    for (int i = 0; i < 500; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = ntohs(k_bench_port);
+        addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+        if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        close(fd);
+        // 服务端可能还在启动
+        usleep(10000);
+    }
+    die("connect");
+    return -1;
+}
+
+struct Client
+{
+    pthread_t thread;
+    size_t id = 0;
+    std::chrono::steady_clock::time_point deadline;
+    size_t ops = 0;
+    // 一批请求从发出到收齐最后一个响应的最大耗时
+    double max_ms = 0;
+};
+
+static void *client_main(void *arg)
+{
+    Client *c = (Client *)arg;
+    int fd = connect_server();
+    std::string batch;
+    std::vector<uint8_t> resp;
+    size_t seq = 0;
+    while (std::chrono::steady_clock::now() < c->deadline)
+    {
+        batch.clear();
+        for (size_t i = 0; i < g_depth; i++)
+        {
+            std::string key = "key:" + std::to_string(c->id) + ":" + std::to_string(seq++ % 100000);
+            batch += make_req({"set", key, std::string(32, 'x')});
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        if (!write_full(fd, batch.data(), batch.size()))
+        {
+            die("write");
+        }
+        for (size_t i = 0; i < g_depth; i++)
+        {
+            uint32_t len = 0;
+            if (!read_full(fd, &len, 4))
+            {
+                die("read");
+            }
+            resp.resize(len);
+            if (!read_full(fd, resp.data(), len))
+            {
+                die("read");
+            }
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        c->max_ms = ms > c->max_ms ? ms : c->max_ms;
+        c->ops += g_depth;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *server_thread(void *arg)
+{
+    std::vector<char *> *args = (std::vector<char *> *)arg;
+    server_main((int)args->size() - 1, args->data());
+    return NULL;
+}
+
+// mode 为 NULL 表示不开 AOF
+static void bench(const char *mode)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        die("fork");
+    }
+    if (pid > 0)
+    {
+        int status = 0;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            die("bench child");
+        }
+        return;
+    }
+
+    // 上一轮留下的日志文件
+    std::string rm = std::string("rm -f ") + g_prefix + ".*";
+    if (system(rm.c_str()) != 0)
+    {
+        die("rm");
+    }
+    std::string port = std::to_string(k_bench_port);
+    std::vector<std::string> strs = {"server", "--port", port, "--snapshot", std::string(g_prefix) + ".snap"};
+    if (mode)
+    {
+        strs.insert(strs.end(), {"--aof", g_prefix, "--appendfsync", mode, "--aof-rewrite-min", "0"});
+    }
+    std::vector<char *> args;
+    for (std::string &s : strs)
+    {
+        args.push_back((char *)s.c_str());
+    }
+    args.push_back(NULL);
+    pthread_t th;
+    pthread_create(&th, NULL, &server_thread, &args);
+
+    std::vector<Client> clients(g_nconns);
+    auto t0 = std::chrono::steady_clock::now();
+    auto deadline = t0 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(g_seconds));
+    for (size_t i = 0; i < g_nconns; i++)
+    {
+        clients[i].id = i;
+        clients[i].deadline = deadline;
+        pthread_create(&clients[i].thread, NULL, &client_main, &clients[i]);
+    }
+    size_t ops = 0;
+    double max_ms = 0;
+    for (Client &c : clients)
+    {
+        pthread_join(c.thread, NULL);
+        ops += c.ops;
+        max_ms = c.max_ms > max_ms ? c.max_ms : max_ms;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    pthread_mutex_lock(&g_aof.mu);
+    uint64_t batches = g_aof.written;
+    uint64_t fsyncs = g_aof.fsyncs;
+    uint64_t fsync_us = g_aof.fsync_us;
+    uint64_t bytes = g_aof.bytes;
+    pthread_mutex_unlock(&g_aof.mu);
+    printf("%-9s %9.0f ops/s  max batch %7.1f ms  aof %6.1f MB  batches %7llu  fsyncs %6llu"
+           "  fsync avg %6.0f us\n",
+           mode ? mode : "off", ops / secs, max_ms, bytes / 1048576.0,
+           (unsigned long long)batches, (unsigned long long)fsyncs,
+           fsyncs ? (double)fsync_us / fsyncs : 0.0);
+    fflush(stdout);
+    system(rm.c_str());
+    // 服务端线程不会退出, 直接结束子进程
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    g_nconns = argc > 1 ? (size_t)atoi(argv[1]) : g_nconns;
+    g_depth = argc > 2 ? (size_t)atoi(argv[2]) : g_depth;
+    g_seconds = argc > 3 ? atof(argv[3]) : g_seconds;
+    g_prefix = argc > 4 ? argv[4] : g_prefix;
+
+    bench(NULL);
+    bench("no");
+    bench("everysec");
+    bench("always");
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "hashtable.cpp"
+#include "hashtable_swiss.cpp"
+#include "slab.cpp"
+#include "avl.cpp"
+#include "btree.cpp"
+#include "zset.cpp"
+#include "bench.h"
+
+// 大 zset 的 AVL 和 B+ 树对比: 随机插入, 范围查询 (定位之后顺序取 100 个), 排行榜的前 100 名 (从最后一个往前取),
+// 按名字查排名, 按排名取,
+// 以及每个成员占的内存 (RSS). 每种在单独的子进程里跑
+// 用法: bench_btree [成员个数, 默认 1M]
+
+static void bench(size_t n, uint8_t index)
+{
+    g_zset_config.index = index;
+    const size_t k_queries = 200000;
+    std::mt19937_64 rng(1);
+    std::vector<std::string> names(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        names[i] = "player:" + std::to_string(rng() % 1000000000) + ":" + std::to_string(i);
+    }
+
+    ZSet zset;
+    size_t rss0 = rss_bytes();
+    double t0 = now_sec();
+    for (size_t i = 0; i < n; i++)
+    {
+        zset_add(&zset, names[i].data(), names[i].size(), (double)(rng() % 1000000));
+    }
+    double t1 = now_sec();
+    size_t rss = rss_bytes() - rss0;
+
+    // 范围查询: 随机的分数开始, 顺序取 100 个
+    double sum = 0;
+    for (size_t q = 0; q < k_queries; q++)
+    {
+        ZIter it;
+        zset_query(&zset, (double)(rng() % 1000000), "", 0, 0, &it);
+        for (int k = 0; k < 100 && it.valid; k++, zset_next(&it))
+        {
+            sum += it.score + it.len;
+        }
+    }
+    double t2 = now_sec();
+    for (size_t q = 0; q < k_queries; q++)
+    {
+        ZIter it;
+        zset_at(&zset, (int64_t)n - 1, &it);
+        for (int k = 0; k < 100 && it.valid; k++, zset_prev(&it))
+        {
+            sum += it.score + it.len;
+        }
+    }
+    double t3 = now_sec();
+    int64_t ranks = 0;
+    for (size_t q = 0; q < k_queries; q++)
+    {
+        const std::string &name = names[rng() % n];
+        ranks += zset_rank(&zset, name.data(), name.size());
+    }
+    double t4 = now_sec();
+    for (size_t q = 0; q < k_queries; q++)
+    {
+        ZIter it;
+        zset_at(&zset, rng() % n, &it);
+        sum += it.len;
+    }
+    double t5 = now_sec();
+
+    printf("%-5s %zu members: insert %6.0f ns, range of 100 %6.0f ns, top 100 %6.0f ns, rank %5.0f ns,"
+           " at %5.0f ns, %5.1f bytes/member (%.0f %lld)\n",
+           index == ZSET_BTREE ? "btree" : "avl", n, (t1 - t0) * 1e9 / n,
+           (t2 - t1) * 1e9 / k_queries, (t3 - t2) * 1e9 / k_queries, (t4 - t3) * 1e9 / k_queries,
+           (t5 - t4) * 1e9 / k_queries,
+           (double)rss / n, sum, (long long)ranks);
+    fflush(stdout);
+}
+
+static void run(size_t n, uint8_t index)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        bench(n, index);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 1000000;
+    run(n, ZSET_AVL);
+    run(n, ZSET_BTREE);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <new>
+#include <chrono>
+
+// 把服务端整个包含进来, 直接调用 try_one_request, 不走网络
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 统计 operator new 的次数, std::string 和 std::vector 的分配都会经过这里
+static size_t g_nalloc = 0;
+
+void *operator new(size_t size)
+{
+    g_nalloc++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// 把一个请求放进读缓冲区, 处理掉, 再丢弃响应
+static void run_one(Conn *conn, const std::string &req)
+{
+    buf_append(&conn->rbuf, req.data(), req.size());
+    bool more = try_one_request(conn);
+    assert(!more || buf_size(&conn->rbuf) == 0);
+    (void)more;
+    assert(conn->state == STATE_REQ);
+    buf_consume(&conn->wbuf, buf_size(&conn->wbuf));
+}
+
+static void bench(Conn *conn, const char *name, const std::string &req, size_t n)
+{
+    // 先跑一轮, 让缓冲池准备好内存
+    run_one(conn, req);
+
+    size_t before = g_nalloc;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i++)
+    {
+        run_one(conn, req);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    printf("%-8s %8.1f ns/req %6.2f allocs/req\n",
+           name, ns / n, (double)(g_nalloc - before) / n);
+}
+
+int main()
+{
+    Conn *conn = new Conn();
+    conn->fd = -1;
+    conn->state = STATE_REQ;
+
+    const size_t n = 1000000;
+    run_one(conn, make_req({"set", "foo", std::string(32, 'x')}));
+    bench(conn, "get", make_req({"get", "foo"}), n);
+    bench(conn, "get-nil", make_req({"get", "nosuchkey"}), n);
+    bench(conn, "set", make_req({"set", "foo", std::string(32, 'y')}), n);
+    bench(conn, "zscore", make_req({"zscore", "foo", "bar"}), n);
+    run_one(conn, make_req({"set", "cnt", "0"}));
+    bench(conn, "incr", make_req({"incr", "cnt"}), n);
+    bench(conn, "get-int", make_req({"get", "cnt"}), n);
+    return 0;
+}
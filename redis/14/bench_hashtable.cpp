@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "hashtable.cpp"
+#include "common.h"
+#include "bench.h"
+
+// 对比旧的 16 位 FNV hcode 和新的 64 位 str_hash 在大量 key 下的查找耗时
+// 用法: bench_hashtable [key 的个数, 默认 10M]
+
+struct Key
+{
+    HNode node;
+    uint8_t len = 0;
+    char data[23];
+};
+
+static bool key_eq(HNode *lhs, HNode *rhs)
+{
+    Key *l = container_of(lhs, Key, node);
+    Key *r = container_of(rhs, Key, node);
+    return lhs->hcode == rhs->hcode && l->len == r->len
+        && 0 == memcmp(l->data, r->data, l->len);
+}
+
+// 原来的哈希: 32 位 FNV, 存进 uint16_t 的 hcode 之后只剩 16 位
+static uint64_t old_hash(const uint8_t *data, size_t len)
+{
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return (uint16_t)h;
+}
+
+static void bench(const char *name, Key *keys, size_t n,
+                  uint64_t (*hash)(const uint8_t *, size_t))
+{
+    // 按最终大小直接分配, 只比较哈希本身, 不受扩容策略影响
+    size_t cap = 1;
+    while (cap < n)
+    {
+        cap <<= 1;
+    }
+    HTab tab;
+    h_init(&tab, cap);
+
+    double t0 = now_sec();
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i].node.hcode = hash((uint8_t *)keys[i].data, keys[i].len);
+        h_insert(&tab, &keys[i].node);
+    }
+    double t1 = now_sec();
+
+    // 随机查找一部分, 链太长的时候全部查一遍要很久
+    size_t nq = n < 1000000 ? n : 1000000;
+    size_t hit = 0;
+    uint64_t x = 88172645463325252ull;
+    double t2 = now_sec();
+    for (size_t i = 0; i < nq; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        Key &k = keys[x % n];
+        Key q;
+        q.len = k.len;
+        memcpy(q.data, k.data, k.len);
+        q.node.hcode = hash((uint8_t *)q.data, q.len);
+        hit += h_lookup(&tab, &q.node, &key_eq) != NULL;
+    }
+    double t3 = now_sec();
+    assert(hit == nq);
+
+    size_t used = 0;
+    for (size_t i = 0; i < cap; i++)
+    {
+        used += tab.tab[i] != NULL;
+    }
+    printf("%-8s insert %7.1f ns/key  lookup %9.1f ns/key  buckets used %zu/%zu\n",
+           name, (t1 - t0) * 1e9 / n, (t3 - t2) * 1e9 / nq, used, cap);
+    free(tab.tab);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 10000000;
+    g_hash_seed = 0x9e3779b97f4a7c15ull;
+
+    Key *keys = new Key[n];
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i].len = (uint8_t)snprintf(keys[i].data, sizeof(keys[i].data), "key:%zu", i);
+    }
+
+    bench("new", keys, n, &str_hash);
+    bench("old", keys, n, &old_hash);
+    delete[] keys;
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <utility>
+#include "hashtable.cpp"
+#include "hashtable_swiss.cpp"
+#include "common.h"
+#include "bench.h"
+
+// 通过 HMap 的公开接口测插入和查找, 分别用链表版本和 -DHMAP_SWISS 编译来对比
+// 用法: bench_hmap [key 的个数, 默认 10M]
+
+struct Key
+{
+    HNode node;
+    uint8_t len = 0;
+    char data[23];
+};
+
+static bool key_eq(HNode *lhs, HNode *rhs)
+{
+    Key *l = container_of(lhs, Key, node);
+    Key *r = container_of(rhs, Key, node);
+    return lhs->hcode == rhs->hcode && l->len == r->len
+        && 0 == memcmp(l->data, r->data, l->len);
+}
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rng()
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 10000000;
+    g_hash_seed = 0x9e3779b97f4a7c15ull;
+
+    // 节点打乱顺序分配, 模拟 Entry 分散在堆上
+    Key **keys = new Key *[n];
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i] = new Key();
+    }
+    for (size_t i = n; i > 1; i--)
+    {
+        std::swap(keys[i - 1], keys[rng() % i]);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        Key *k = keys[i];
+        k->len = (uint8_t)snprintf(k->data, sizeof(k->data), "key:%zu", i);
+        k->node.hcode = str_hash((uint8_t *)k->data, k->len);
+    }
+
+    HMap hmap;
+    double t0 = now_sec();
+    for (size_t i = 0; i < n; i++)
+    {
+        hm_insert(&hmap, &keys[i]->node);
+    }
+    double t1 = now_sec();
+
+    // 查询的 key 事先准备好, 只测查找本身. 一半命中, 一半不命中
+    const size_t nq = 2000000;
+    Key *qs = new Key[nq];
+    for (size_t i = 0; i < nq; i++)
+    {
+        size_t id = rng() % (2 * n);
+        qs[i].len = (uint8_t)snprintf(qs[i].data, sizeof(qs[i].data), "key:%zu", id);
+        qs[i].node.hcode = str_hash((uint8_t *)qs[i].data, qs[i].len);
+    }
+    size_t hit = 0;
+    double t2 = now_sec();
+    for (size_t i = 0; i < nq; i++)
+    {
+        hit += hm_lookup(&hmap, &qs[i].node, &key_eq) != NULL;
+    }
+    double t3 = now_sec();
+
+#if defined(HMAP_SWISS)
+    const char *name = "swiss";
+#else
+    const char *name = "chained";
+#endif
+    printf("%-8s n=%zu insert %.1f ns/key  lookup %.1f ns/key  hit %.2f\n",
+           name, n, (t1 - t0) * 1e9 / n, (t3 - t2) * 1e9 / nq, (double)hit / nq);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <chrono>
+
+// 把服务端整个包含进来, 直接调用快照的写入和加载
+#define main server_main
+#include "14_server.cpp"
+#undef main
+
+// 测启动时加载快照的速度: 先造 n 个 key 写成快照, 再加载回来
+// 用法: bench_load [key 的个数, 默认 5M] [解码线程数, 默认 CPU 个数] [快照文件, 默认 /tmp/bench_load.snap]
+
+static double now_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 5000000;
+    g_load_threads = argc > 2 ? (size_t)atoi(argv[2]) : 0;
+    g_snap_path = argc > 3 ? argv[3] : "/tmp/bench_load.snap";
+    g_hash_seed = 0x9e3779b97f4a7c15ull;
+
+    g_shards = new Shard[1];
+    shard_attach(&g_shards[0]);
+
+    // 在子进程里造数据和写快照, 父进程的堆保持干净, 跟重启之后一样
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // 大部分是短字符串, 每 1000 个 key 里有一个 100 个成员的 zset
+        double t0 = now_ms();
+        for (size_t i = 0; i < n; i++)
+        {
+            std::string key = "key:" + std::to_string(i);
+            uint64_t hcode = str_hash((uint8_t *)key.data(), key.size());
+            Entry *ent = NULL;
+            if (i % 1000 == 0)
+            {
+                ent = entry_new(key, hcode, T_ZSET, 0);
+                entry_zset(ent) = new ZSet();
+                for (size_t j = 0; j < 100; j++)
+                {
+                    std::string name = "m" + std::to_string(j);
+                    zset_add(entry_zset(ent), name.data(), name.size(), (double)(j * 7 % 100));
+                }
+            }
+            else
+            {
+                ent = entry_new(key, hcode, T_STR, 0, std::string(32, 'x'));
+            }
+            hm_insert(&g_data.db, &ent->node);
+        }
+        SaveInfo info;
+        double t1 = now_ms();
+        if (!snapshot_write(g_snap_path, &info))
+        {
+            die("snapshot_write");
+        }
+        double t2 = now_ms();
+        printf("populate %.0f ms, save %.0f ms, %.1f MB\n", t1 - t0, t2 - t1, info.bytes / 1048576.0);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        die("populate");
+    }
+
+    double t3 = now_ms();
+    if (!snapshot_decode(g_snap_path))
+    {
+        die("snapshot_decode");
+    }
+    double t4 = now_ms();
+    snapshot_insert();
+    double t5 = now_ms();
+    assert(hm_size(&g_data.db) == n);
+    printf("load: decode %.0f ms, insert %.0f ms, total %.0f ms, %.2f M keys/s, buckets %zu\n",
+           t4 - t3, t5 - t4, t5 - t3, n / (t5 - t3) / 1e3, hm_capacity(&g_data.db));
+    unlink(g_snap_path);
+    return 0;
+}
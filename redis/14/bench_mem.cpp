@@ -0,0 +1,51 @@
+#include <chrono>
+
+// 把服务端整个包含进来, 直接调用 try_one_request, 不走网络
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 每个 key 占多少内存: 插入 n 个 20 字节的 key, 值 50 字节, 每 ttl_every 个 key 设一个 TTL,
+// 看进程 RSS 涨了多少. 哈希表的桶单独算, 剩下的就是 key 本身 (Entry, key 和值)
+// 用法: bench_mem [key 的个数, 默认 10M] [每多少个 key 设一个 TTL, 默认 10, 0 表示不设]
+
+static void run_one(Conn *conn, const std::string &req)
+{
+    buf_append(&conn->rbuf, req.data(), req.size());
+    try_one_request(conn);
+    assert(conn->state == STATE_REQ);
+    buf_consume(&conn->wbuf, buf_size(&conn->wbuf));
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 10000000;
+    size_t ttl_every = argc > 2 ? (size_t)atoll(argv[2]) : 10;
+
+    Conn *conn = new Conn();
+    conn->fd = -1;
+    conn->state = STATE_REQ;
+    // 先跑一次, 让缓冲池准备好内存
+    run_one(conn, make_req({"get", "x"}));
+
+    std::string val(50, 'v');
+    size_t rss0 = rss_bytes();
+    auto t0 = std::chrono::steady_clock::now();
+    char key[32];
+    for (size_t i = 0; i < n; i++)
+    {
+        snprintf(key, sizeof(key), "key:%016zu", i);
+        run_one(conn, make_req({"set", key, val}));
+        if (ttl_every && i % ttl_every == 0)
+        {
+            run_one(conn, make_req({"pexpire", key, "3600000"}));
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    size_t rss = rss_bytes() - rss0;
+    size_t table = hm_capacity(&g_data.db) * sizeof(void *);
+    printf("%zu keys in %.1f s: %.1f bytes/key total, %.1f bytes/key without the table (%.1f MB table)\n",
+           hm_size(&g_data.db), secs, (double)rss / n, (double)(rss - table) / n, table / 1048576.0);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <chrono>
+#include <random>
+
+// 把服务端整个包含进来, 直接调用 try_one_request, 不走网络
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 100 个 GET 请求和一个 100 个 key 的 MGET 比较, 每个 key 平均的耗时.
+// key 很多, 哈希表和 Entry 远大于 cache, 每次查找基本都是 cache miss
+// 用法: bench_mget [key 的个数, 默认 4M] [每个 MGET 的 key 数, 默认 100]
+
+static void run_one(Conn *conn, const std::string &req)
+{
+    buf_append(&conn->rbuf, req.data(), req.size());
+    try_one_request(conn);
+    assert(conn->state == STATE_REQ);
+    buf_consume(&conn->wbuf, buf_size(&conn->wbuf));
+}
+
+static std::string key_name(size_t i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key:%016zu", i);
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    size_t nkeys = argc > 1 ? (size_t)atoll(argv[1]) : 4000000;
+    size_t batch = argc > 2 ? (size_t)atoll(argv[2]) : 100;
+    const size_t k_rounds = 10000;
+
+    Conn *conn = new Conn();
+    conn->fd = -1;
+    conn->state = STATE_REQ;
+    std::string val(50, 'v');
+    for (size_t i = 0; i < nkeys; i++)
+    {
+        run_one(conn, make_req({"set", key_name(i), val}));
+    }
+
+    // 请求事先编码好, 计时的只有服务端的处理
+    std::mt19937_64 rng(1);
+    std::vector<std::string> gets;
+    std::vector<std::string> mgets;
+    for (size_t r = 0; r < k_rounds; r++)
+    {
+        std::vector<std::string> cmd = {"mget"};
+        std::string get_batch;
+        for (size_t j = 0; j < batch; j++)
+        {
+            std::string key = key_name(rng() % nkeys);
+            get_batch += make_req({"get", key});
+            cmd.push_back(key);
+        }
+        gets.push_back(get_batch);
+        mgets.push_back(make_req(cmd));
+    }
+
+    // 轮流跑几遍, 取各自最快的一遍, 减少机器上别的负载的影响
+    double get_ns = 0;
+    double mget_ns = 0;
+    for (int pass = 0; pass < 5; pass++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < k_rounds; r++)
+        {
+            // 一个批里的 GET 和客户端流水线发过来一样, 一次放进读缓冲区
+            buf_append(&conn->rbuf, gets[r].data(), gets[r].size());
+            while (try_one_request(conn))
+            {
+            }
+            buf_consume(&conn->wbuf, buf_size(&conn->wbuf));
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < k_rounds; r++)
+        {
+            run_one(conn, mgets[r]);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        double g = std::chrono::duration<double, std::nano>(t1 - t0).count() / (k_rounds * batch);
+        double m = std::chrono::duration<double, std::nano>(t2 - t1).count() / (k_rounds * batch);
+        get_ns = pass == 0 || g < get_ns ? g : get_ns;
+        mget_ns = pass == 0 || m < mget_ns ? m : mget_ns;
+    }
+    printf("%zu keys, batch %zu: %zu x get %6.1f ns/key, mget %6.1f ns/key\n",
+           hm_size(&g_data.db), batch, batch, get_ns, mget_ns);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <chrono>
+
+// 把服务端整个包含进来, 直接调用 bgsave_start 和 try_one_request, 不走网络
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 测后台快照的耗时和写时复制的开销: 子进程写快照的同时, 父进程不停地覆盖随机的 key
+// 用法: bench_save [key 的个数, 默认 1M] [快照文件, 默认 /tmp/bench.snap]
+
+static void run_one(Conn *conn, const std::string &req)
+{
+    buf_append(&conn->rbuf, req.data(), req.size());
+    try_one_request(conn);
+    buf_consume(&conn->wbuf, buf_size(&conn->wbuf));
+}
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rng()
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+// writes 是快照期间父进程最多做多少次写, 写完了就只等子进程
+static void bench(Conn *conn, const char *name, size_t n, size_t writes)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    if (!bgsave_start())
+    {
+        die("bgsave_start");
+    }
+    size_t done = 0;
+    while (g_data.save_child >= 0)
+    {
+        if (done < writes)
+        {
+            // 值的长度不变, 覆盖的时候不会重新分配, 只会弄脏 key 所在的页
+            run_one(conn, make_req({"set", "key:" + std::to_string(rng() % n), std::string(64, 'y')}));
+            done++;
+        }
+        else
+        {
+            usleep(1000);
+        }
+        if ((done & 1023) == 0 || done >= writes)
+        {
+            process_bgsave();
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    SaveInfo last = g_save_stats.last;
+    if (g_save_stats.failures)
+    {
+        die("snapshot failed");
+    }
+    printf("%-8s fork %6.2f ms  save %8.1f ms  total %8.1f ms  file %6.1f MB"
+           "  writes %8zu  cow %7.1f MB\n",
+           name, g_save_stats.fork_us / 1e3, last.save_us / 1e3,
+           std::chrono::duration<double, std::milli>(t1 - t0).count(),
+           last.bytes / 1048576.0, done, last.cow_bytes / 1048576.0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 1000000;
+    g_snap_path = argc > 2 ? argv[2] : "/tmp/bench.snap";
+    g_hash_seed = 0x9e3779b97f4a7c15ull;
+
+    g_shards = new Shard[1];
+    shard_attach(&g_shards[0]);
+    Conn *conn = new Conn();
+    conn->fd = -1;
+    conn->state = STATE_REQ;
+
+    // 字符串为主, 再加一些 zset
+    for (size_t i = 0; i < n; i++)
+    {
+        run_one(conn, make_req({"set", "key:" + std::to_string(i), std::string(64, 'x')}));
+    }
+    for (size_t i = 0; i < n / 10; i++)
+    {
+        run_one(conn, make_req({"zadd", "zset:" + std::to_string(i % 100),
+                                std::to_string(rng() % 1000000), "m" + std::to_string(i)}));
+    }
+    while (hm_rehash_pending())
+    {
+        hm_rehash_step();
+    }
+
+    bench(conn, "idle", n, 0);
+    bench(conn, "light", n, n / 10);
+    bench(conn, "full", n, (size_t)-1);
+    unlink(g_snap_path);
+    return 0;
+}
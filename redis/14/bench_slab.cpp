@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include "slab.cpp"
+#include "bench.h"
+
+// 对比 malloc 和 slab 分配 zset 成员那样的小对象: 分配 + 释放的耗时, 每个对象实际占的内存 (RSS),
+// 以及另一个线程释放 (懒删除) 的耗时. 每种分配器在单独的子进程里跑, RSS 互不影响
+// 用法: bench_slab [对象个数, 默认 10M]
+
+static size_t g_n = 10000000;
+
+// ZNode 是 64 字节加上成员名, 名字 1 到 16 个字节
+static size_t obj_size(size_t i)
+{
+    return 64 + 1 + i % 16;
+}
+
+struct Objs
+{
+    std::vector<void *> *ptrs;
+    bool use_slab;
+};
+
+static void free_all(std::vector<void *> &ptrs, bool use_slab)
+{
+    for (size_t i = 0; i < ptrs.size(); i++)
+    {
+        if (use_slab)
+        {
+            slab_free(ptrs[i], obj_size(i));
+        }
+        else
+        {
+            free(ptrs[i]);
+        }
+    }
+}
+
+static void *free_thread(void *arg)
+{
+    Objs *o = (Objs *)arg;
+    free_all(*o->ptrs, o->use_slab);
+    return NULL;
+}
+
+static void bench(bool use_slab)
+{
+    std::vector<void *> ptrs(g_n);
+    size_t rss0 = rss_bytes();
+    double t0 = now_sec();
+    for (size_t i = 0; i < g_n; i++)
+    {
+        size_t sz = obj_size(i);
+        ptrs[i] = use_slab ? slab_alloc(sz) : malloc(sz);
+        memset(ptrs[i], 0, sz);
+    }
+    double t1 = now_sec();
+    size_t rss1 = rss_bytes();
+    free_all(ptrs, use_slab);
+    double t2 = now_sec();
+
+    // 再分配一遍, 换另一个线程释放
+    for (size_t i = 0; i < g_n; i++)
+    {
+        size_t sz = obj_size(i);
+        ptrs[i] = use_slab ? slab_alloc(sz) : malloc(sz);
+        memset(ptrs[i], 0, sz);
+    }
+    double t3 = now_sec();
+    Objs o = {&ptrs, use_slab};
+    pthread_t th;
+    pthread_create(&th, NULL, &free_thread, &o);
+    pthread_join(th, NULL);
+    double t4 = now_sec();
+
+    printf("%-6s alloc %5.1f ns  free %5.1f ns  remote free %5.1f ns  %5.1f bytes/obj\n",
+           use_slab ? "slab" : "malloc", (t1 - t0) * 1e9 / g_n, (t2 - t1) * 1e9 / g_n,
+           (t4 - t3) * 1e9 / g_n, (double)(rss1 - rss0) / g_n);
+    if (use_slab)
+    {
+        SlabStats st;
+        slab_stats(&st);
+        printf("slab   pages %.1f MB  in use %.1f MB  free %.1f MB  waste %.1f MB\n",
+               st.page_bytes / 1048576.0, st.in_use_bytes / 1048576.0, st.free_bytes / 1048576.0,
+               st.waste_bytes / 1048576.0);
+    }
+    fflush(stdout);
+}
+
+static void run(bool use_slab)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        bench(use_slab);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_n = argc > 1 ? (size_t)atoll(argv[1]) : g_n;
+    run(false);
+    run(true);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <chrono>
+#include <random>
+#include <sys/wait.h>
+
+// 把服务端整个包含进来, 直接调用 try_one_request, 不走网络
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 往一个空的 zset 里加 n 个成员: 每个 ZADD 一个成员, 每个 ZADD 1000 个成员, 一个 ZADD 带所有的成员.
+// 只有最后一种 (和第二种的头两批) 走排序后直接建树. 每种在单独的子进程里跑
+// 用法: bench_zadd [成员个数, 默认 1M] [avl|btree, 默认 avl]
+
+static void run_one(Conn *conn, const std::string &req)
+{
+    buf_append(&conn->rbuf, req.data(), req.size());
+    try_one_request(conn);
+    assert(conn->state == STATE_REQ);
+    buf_consume(&conn->wbuf, buf_size(&conn->wbuf));
+}
+
+static void bench(size_t n, size_t batch)
+{
+    g_max_conn_buf = (size_t)1 << 30;
+    Conn *conn = new Conn();
+    conn->fd = -1;
+    conn->state = STATE_REQ;
+    run_one(conn, make_req({"get", "x"}));
+
+    // 请求事先编码好
+    std::mt19937_64 rng(1);
+    std::vector<std::string> reqs;
+    std::vector<std::string> cmd;
+    char name[32], score[32];
+    for (size_t i = 0; i < n; i++)
+    {
+        if (cmd.empty())
+        {
+            cmd = {"zadd", "zset"};
+        }
+        snprintf(name, sizeof(name), "player:%zu", i);
+        snprintf(score, sizeof(score), "%zu", (size_t)(rng() % 1000000));
+        cmd.push_back(score);
+        cmd.push_back(name);
+        if (cmd.size() == 2 + 2 * batch || i + 1 == n)
+        {
+            reqs.push_back(make_req(cmd));
+            cmd.clear();
+        }
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (const std::string &req : reqs)
+    {
+        run_one(conn, req);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    printf("%-5s %zu members, %7zu per zadd: %6.1f ns/member\n",
+           g_zset_config.index == ZSET_BTREE ? "btree" : "avl", n, batch, ns / n);
+    fflush(stdout);
+}
+
+static void run(size_t n, size_t batch)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        bench(n, batch);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 1000000;
+    if (argc > 2 && 0 == strcmp(argv[2], "btree"))
+    {
+        g_zset_config.index = ZSET_BTREE;
+    }
+    run(n, 1);
+    run(n, 1000);
+    run(n, n);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <chrono>
+#include <random>
+#include <sys/wait.h>
+
+// 把服务端整个包含进来, 直接调用 try_one_request, 不走网络
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 小 zset 的两种编码对比: 建很多个小 zset, 看每个成员占多少内存 (RSS), 再随机发 ZQUERY 取 10 个成员.
+// 小编码和树各在一个子进程里跑, RSS 互不影响
+// 用法: bench_zset [zset 的个数, 默认 100K] [每个 zset 的成员数, 默认 20]
+
+static void run_one(Conn *conn, const std::string &req)
+{
+    buf_append(&conn->rbuf, req.data(), req.size());
+    try_one_request(conn);
+    assert(conn->state == STATE_REQ);
+    buf_consume(&conn->wbuf, buf_size(&conn->wbuf));
+}
+
+static void bench(size_t nkeys, size_t nmembers, bool flat)
+{
+    g_zset_config.max_flat_n = flat ? nmembers : 0;
+    Conn *conn = new Conn();
+    conn->fd = -1;
+    conn->state = STATE_REQ;
+    run_one(conn, make_req({"get", "x"}));
+
+    // 请求事先编码好
+    std::mt19937_64 rng(1);
+    std::vector<std::string> adds;
+    char key[32], name[32], score[32];
+    for (size_t i = 0; i < nkeys; i++)
+    {
+        snprintf(key, sizeof(key), "zset:%zu", i);
+        for (size_t j = 0; j < nmembers; j++)
+        {
+            snprintf(name, sizeof(name), "member:%zu", j);
+            snprintf(score, sizeof(score), "%zu", (size_t)(rng() % 1000));
+            adds.push_back(make_req({"zadd", key, score, name}));
+        }
+    }
+    std::vector<std::string> queries;
+    for (size_t i = 0; i < 1000000; i++)
+    {
+        snprintf(key, sizeof(key), "zset:%zu", (size_t)(rng() % nkeys));
+        snprintf(score, sizeof(score), "%zu", (size_t)(rng() % 1000));
+        queries.push_back(make_req({"zquery", key, score, "", "0", "10"}));
+    }
+
+    size_t rss0 = rss_bytes();
+    for (const std::string &req : adds)
+    {
+        run_one(conn, req);
+    }
+    size_t rss = rss_bytes() - rss0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (const std::string &req : queries)
+    {
+        run_one(conn, req);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    printf("%-5s %zu zsets x %zu members: %5.1f bytes/member, zquery %5.1f ns\n",
+           flat ? "flat" : "tree", nkeys, nmembers, (double)rss / (nkeys * nmembers),
+           ns / queries.size());
+    fflush(stdout);
+}
+
+static void run(size_t nkeys, size_t nmembers, bool flat)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        bench(nkeys, nmembers, flat);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nkeys = argc > 1 ? (size_t)atoll(argv[1]) : 100000;
+    size_t nmembers = argc > 2 ? (size_t)atoll(argv[2]) : 20;
+    run(nkeys, nmembers, false);
+    run(nkeys, nmembers, true);
+    return 0;
+}
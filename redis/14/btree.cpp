@@ -0,0 +1,680 @@
+#include <assert.h>
+#include <string.h>
+
+#include <vector>
+
+#include "btree.h"
+#include "zset.h"
+
+// 树的高度上限, 32 叉的树 8 层已经远远超过内存能放下的成员数
+const int k_bt_max_height = 16;
+
+// 查找用的 key
+struct BTKey
+{
+    double score = 0;
+    uint64_t prefix = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+// 名字的前 8 个字节按大端拼成整数, 不够的补 0, 整数的大小顺序和 memcmp 一样
+static uint64_t name_prefix(const char *name, size_t len)
+{
+    uint8_t buf[8] = {};
+    memcpy(buf, name, len < 8 ? len : 8);
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        v = (v << 8) | buf[i];
+    }
+    return v;
+}
+
+static BTKey bt_key(double score, const char *name, size_t len)
+{
+    BTKey k;
+    k.score = score;
+    k.prefix = name_prefix(name, len);
+    k.name = name;
+    k.len = len;
+    return k;
+}
+
+// 分数和前缀都一样才去读 ZNode 比较完整的名字
+static int key_cmp(double score, uint64_t prefix, ZNode *node, const BTKey &k)
+{
+    if (score != k.score)
+    {
+        return score < k.score ? -1 : 1;
+    }
+    if (prefix != k.prefix)
+    {
+        return prefix < k.prefix ? -1 : 1;
+    }
+    size_t n = node->len < k.len ? node->len : k.len;
+    int rv = memcmp(node->name, k.name, n);
+    if (rv != 0)
+    {
+        return rv;
+    }
+    return node->len < k.len ? -1 : (node->len > k.len ? 1 : 0);
+}
+
+// 往哪个孩子走: 最后一个 key 不大于 k 的孩子, 都比 k 大就是第 0 个
+static uint32_t inner_find(BTInner *in, const BTKey &k)
+{
+    uint32_t lo = 1;
+    uint32_t hi = in->hdr.n;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (key_cmp(in->score[mid], in->prefix[mid], in->node[mid], k) <= 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+// 叶子里第一个不小于 k 的位置
+static uint32_t leaf_lower(BTLeaf *leaf, const BTKey &k)
+{
+    uint32_t lo = 0;
+    uint32_t hi = leaf->hdr.n;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (key_cmp(leaf->score[mid], leaf->prefix[mid], leaf->node[mid], k) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static size_t node_count(BTNode *node)
+{
+    if (node->leaf)
+    {
+        return node->n;
+    }
+    BTInner *in = (BTInner *)node;
+    size_t total = 0;
+    for (uint32_t i = 0; i < in->hdr.n; i++)
+    {
+        total += in->cnt[i];
+    }
+    return total;
+}
+
+// 叶子的 [from, from+n) 搬到 dst 的 to 开始的位置
+static void leaf_move(BTLeaf *dst, uint32_t to, BTLeaf *src, uint32_t from, uint32_t n)
+{
+    memmove(&dst->score[to], &src->score[from], n * sizeof(double));
+    memmove(&dst->prefix[to], &src->prefix[from], n * sizeof(uint64_t));
+    memmove(&dst->node[to], &src->node[from], n * sizeof(ZNode *));
+}
+
+static void inner_move(BTInner *dst, uint32_t to, BTInner *src, uint32_t from, uint32_t n)
+{
+    memmove(&dst->cnt[to], &src->cnt[from], n * sizeof(uint32_t));
+    memmove(&dst->score[to], &src->score[from], n * sizeof(double));
+    memmove(&dst->prefix[to], &src->prefix[from], n * sizeof(uint64_t));
+    memmove(&dst->node[to], &src->node[from], n * sizeof(ZNode *));
+    memmove(&dst->child[to], &src->child[from], n * sizeof(BTNode *));
+}
+
+static void leaf_put(BTLeaf *leaf, uint32_t pos, ZNode *node, uint64_t prefix)
+{
+    leaf_move(leaf, pos + 1, leaf, pos, leaf->hdr.n - pos);
+    leaf->score[pos] = node->score;
+    leaf->prefix[pos] = prefix;
+    leaf->node[pos] = node;
+    leaf->hdr.n++;
+}
+
+// 在第 pos 个孩子的位置插入 child, 它前面的分隔是 sep 那一项
+static void inner_put(BTInner *in, uint32_t pos, BTNode *child, double score,
+                      uint64_t prefix, ZNode *sep)
+{
+    inner_move(in, pos + 1, in, pos, in->hdr.n - pos);
+    in->cnt[pos] = (uint32_t)node_count(child);
+    in->score[pos] = score;
+    in->prefix[pos] = prefix;
+    in->node[pos] = sep;
+    in->child[pos] = child;
+    in->hdr.n++;
+}
+
+// 满了的叶子拆成两个, 新的叶子在右边. 往最右边追加的时候 (按顺序插入) 左边留满, 右边从空的开始
+static BTLeaf *leaf_split(BTLeaf *leaf, uint32_t pos)
+{
+    uint32_t mid = (pos == leaf->hdr.n && !leaf->next) ? leaf->hdr.n : leaf->hdr.n / 2;
+    BTLeaf *right = new BTLeaf();
+    right->hdr.leaf = 1;
+    leaf_move(right, 0, leaf, mid, leaf->hdr.n - mid);
+    right->hdr.n = (uint16_t)(leaf->hdr.n - mid);
+    leaf->hdr.n = (uint16_t)mid;
+    right->next = leaf->next;
+    right->prev = leaf;
+    if (leaf->next)
+    {
+        leaf->next->prev = right;
+    }
+    leaf->next = right;
+    return right;
+}
+
+static BTInner *inner_split(BTInner *in, uint32_t pos, bool rightmost)
+{
+    uint32_t mid = (pos == in->hdr.n && rightmost) ? in->hdr.n : in->hdr.n / 2;
+    BTInner *right = new BTInner();
+    inner_move(right, 0, in, mid, in->hdr.n - mid);
+    right->hdr.n = (uint16_t)(in->hdr.n - mid);
+    in->hdr.n = (uint16_t)mid;
+    return right;
+}
+
+void bt_insert(BTree *bt, ZNode *node)
+{
+    BTKey k = bt_key(node->score, node->name, node->len);
+    bt->size++;
+    if (!bt->root)
+    {
+        BTLeaf *leaf = new BTLeaf();
+        leaf->hdr.leaf = 1;
+        leaf_put(leaf, 0, node, k.prefix);
+        bt->root = &leaf->hdr;
+        return;
+    }
+
+    // 往下走, 路上的计数先加上
+    BTInner *path[k_bt_max_height];
+    uint32_t path_idx[k_bt_max_height];
+    int h = 0;
+    bool rightmost = true;
+    BTNode *cur = bt->root;
+    while (!cur->leaf)
+    {
+        BTInner *in = (BTInner *)cur;
+        uint32_t i = inner_find(in, k);
+        in->cnt[i]++;
+        rightmost = rightmost && i + 1 == in->hdr.n;
+        assert(h < k_bt_max_height);
+        path[h] = in;
+        path_idx[h] = i;
+        h++;
+        cur = in->child[i];
+    }
+
+    BTLeaf *leaf = (BTLeaf *)cur;
+    uint32_t pos = leaf_lower(leaf, k);
+    if (leaf->hdr.n < k_bt_leaf)
+    {
+        leaf_put(leaf, pos, node, k.prefix);
+        return;
+    }
+    BTLeaf *right_leaf = leaf_split(leaf, pos);
+    if (pos <= leaf->hdr.n && leaf->hdr.n < k_bt_leaf)
+    {
+        leaf_put(leaf, pos, node, k.prefix);
+    }
+    else
+    {
+        leaf_put(right_leaf, pos - leaf->hdr.n, node, k.prefix);
+    }
+
+    // 拆出来的节点插到父节点里, 父节点满了就接着往上拆
+    BTNode *left = &leaf->hdr;
+    BTNode *right = &right_leaf->hdr;
+    double sep_score = right_leaf->score[0];
+    uint64_t sep_prefix = right_leaf->prefix[0];
+    ZNode *sep_node = right_leaf->node[0];
+    for (int d = h - 1; d >= 0 && right; d--)
+    {
+        BTInner *in = path[d];
+        uint32_t i = path_idx[d];
+        in->cnt[i] = (uint32_t)node_count(left);
+        uint32_t pos = i + 1;
+        if (in->hdr.n < k_bt_fan)
+        {
+            inner_put(in, pos, right, sep_score, sep_prefix, sep_node);
+            right = NULL;
+            break;
+        }
+        BTInner *new_in = inner_split(in, pos, rightmost);
+        if (pos < in->hdr.n || (pos == in->hdr.n && in->hdr.n < k_bt_fan))
+        {
+            inner_put(in, pos, right, sep_score, sep_prefix, sep_node);
+        }
+        else
+        {
+            inner_put(new_in, pos - in->hdr.n, right, sep_score, sep_prefix, sep_node);
+        }
+        left = &in->hdr;
+        right = &new_in->hdr;
+        sep_score = new_in->score[0];
+        sep_prefix = new_in->prefix[0];
+        sep_node = new_in->node[0];
+    }
+    // 根也拆了, 长高一层
+    if (right)
+    {
+        BTInner *root = new BTInner();
+        root->hdr.n = 2;
+        root->child[0] = left;
+        root->cnt[0] = (uint32_t)node_count(left);
+        root->child[1] = right;
+        root->cnt[1] = (uint32_t)node_count(right);
+        root->score[1] = sep_score;
+        root->prefix[1] = sep_prefix;
+        root->node[1] = sep_node;
+        bt->root = &root->hdr;
+    }
+}
+
+// total 项按 cap 个一组从左往右分, 第 i 组有几项: 前面的组都是满的,
+// 最后一组不到 cap/4 的话和前一组平分, 免得删除的时候马上就要合并
+static uint32_t run_size(size_t total, uint32_t cap, size_t i)
+{
+    size_t groups = (total + cap - 1) / cap;
+    size_t rest = total - (groups - 1) * cap;
+    if (groups >= 2 && rest < cap / 4 && i + 2 >= groups)
+    {
+        size_t half = (cap + rest) / 2;
+        return (uint32_t)(i + 2 == groups ? half : cap + rest - half);
+    }
+    return (uint32_t)(i + 1 < groups ? cap : rest);
+}
+
+// 第 i 个孩子的分隔是它里面的第一项, 内部节点的 key[0] 就是它的第一项
+static void inner_set_child(BTInner *in, uint32_t i, BTNode *child)
+{
+    in->child[i] = child;
+    in->cnt[i] = (uint32_t)node_count(child);
+    if (child->leaf)
+    {
+        BTLeaf *leaf = (BTLeaf *)child;
+        in->score[i] = leaf->score[0];
+        in->prefix[i] = leaf->prefix[0];
+        in->node[i] = leaf->node[0];
+    }
+    else
+    {
+        BTInner *c = (BTInner *)child;
+        in->score[i] = c->score[0];
+        in->prefix[i] = c->prefix[0];
+        in->node[i] = c->node[0];
+    }
+}
+
+void bt_build(BTree *bt, size_t n, ZNode *(*next)(void *arg), void *arg)
+{
+    assert(!bt->root);
+    if (n == 0)
+    {
+        return;
+    }
+    // 先从左往右填满叶子, 连成链表
+    std::vector<BTNode *> level;
+    level.reserve((n + k_bt_leaf - 1) / k_bt_leaf);
+    BTLeaf *prev = NULL;
+    for (size_t done = 0; done < n;)
+    {
+        BTLeaf *leaf = new BTLeaf();
+        leaf->hdr.leaf = 1;
+        leaf->hdr.n = (uint16_t)run_size(n, k_bt_leaf, level.size());
+        for (uint32_t i = 0; i < leaf->hdr.n; i++)
+        {
+            ZNode *node = next(arg);
+            leaf->score[i] = node->score;
+            leaf->prefix[i] = name_prefix(node->name, node->len);
+            leaf->node[i] = node;
+        }
+        done += leaf->hdr.n;
+        leaf->prev = prev;
+        if (prev)
+        {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level.push_back(&leaf->hdr);
+    }
+    // 再一层层往上建, 每 k_bt_fan 个节点一个父节点, 直到只剩一个根.
+    // 每组至少两个孩子, 新的一层可以原地写在数组的前面
+    while (level.size() > 1)
+    {
+        size_t total = level.size();
+        size_t from = 0;
+        size_t g = 0;
+        for (; from < total; g++)
+        {
+            BTInner *in = new BTInner();
+            in->hdr.n = (uint16_t)run_size(total, k_bt_fan, g);
+            for (uint32_t i = 0; i < in->hdr.n; i++)
+            {
+                inner_set_child(in, i, level[from + i]);
+            }
+            from += in->hdr.n;
+            level[g] = &in->hdr;
+        }
+        level.resize(g);
+    }
+    bt->root = level[0];
+    bt->size = n;
+}
+
+static void leaf_free(BTLeaf *leaf)
+{
+    if (leaf->prev)
+    {
+        leaf->prev->next = leaf->next;
+    }
+    if (leaf->next)
+    {
+        leaf->next->prev = leaf->prev;
+    }
+    delete leaf;
+}
+
+// 去掉父节点的第 i 个孩子 (已经释放了)
+static void inner_erase(BTInner *in, uint32_t i)
+{
+    inner_move(in, i, in, i + 1, in->hdr.n - i - 1);
+    in->hdr.n--;
+}
+
+// 第 i 个孩子和第 i+1 个孩子合并到左边, 放得下才合并
+static bool try_merge(BTInner *in, uint32_t i)
+{
+    BTNode *left = in->child[i];
+    BTNode *right = in->child[i + 1];
+    uint32_t cap = left->leaf ? k_bt_leaf : k_bt_fan;
+    if (left->n + right->n > cap)
+    {
+        return false;
+    }
+    if (left->leaf)
+    {
+        BTLeaf *l = (BTLeaf *)left;
+        BTLeaf *r = (BTLeaf *)right;
+        leaf_move(l, l->hdr.n, r, 0, r->hdr.n);
+        l->hdr.n += r->hdr.n;
+        leaf_free(r);
+    }
+    else
+    {
+        BTInner *l = (BTInner *)left;
+        BTInner *r = (BTInner *)right;
+        uint32_t n = l->hdr.n;
+        inner_move(l, n, r, 0, r->hdr.n);
+        // 右边第一个孩子的分隔用父节点里的
+        l->score[n] = in->score[i + 1];
+        l->prefix[n] = in->prefix[i + 1];
+        l->node[n] = in->node[i + 1];
+        l->hdr.n += r->hdr.n;
+        delete r;
+    }
+    in->cnt[i] += in->cnt[i + 1];
+    inner_erase(in, i + 1);
+    return true;
+}
+
+void bt_remove(BTree *bt, ZNode *node)
+{
+    BTKey k = bt_key(node->score, node->name, node->len);
+    BTInner *path[k_bt_max_height];
+    uint32_t path_idx[k_bt_max_height];
+    int h = 0;
+    BTNode *cur = bt->root;
+    assert(cur);
+    while (!cur->leaf)
+    {
+        BTInner *in = (BTInner *)cur;
+        uint32_t i = inner_find(in, k);
+        in->cnt[i]--;
+        path[h] = in;
+        path_idx[h] = i;
+        h++;
+        cur = in->child[i];
+    }
+    BTLeaf *leaf = (BTLeaf *)cur;
+    uint32_t pos = leaf_lower(leaf, k);
+    assert(pos < leaf->hdr.n && leaf->node[pos] == node);
+
+    // 路上用 node 做分隔的换成它的下一项: 还是比左边的都大, 不比右边的大, 而且 node 释放之后不会再去读它.
+    // 没有下一项的话, 这个孩子里只有 node, 下面会整个去掉
+    BTPos succ;
+    succ.leaf = leaf;
+    succ.idx = pos;
+    succ = bt_next(succ);
+    for (int d = 0; d < h; d++)
+    {
+        BTInner *in = path[d];
+        uint32_t i = path_idx[d];
+        if (i > 0 && in->node[i] == node && succ.leaf)
+        {
+            in->score[i] = succ.leaf->score[succ.idx];
+            in->prefix[i] = succ.leaf->prefix[succ.idx];
+            in->node[i] = succ.leaf->node[succ.idx];
+        }
+    }
+
+    leaf_move(leaf, pos, leaf, pos + 1, leaf->hdr.n - pos - 1);
+    leaf->hdr.n--;
+    bt->size--;
+
+    // 往上检查: 空了就去掉, 不到 1/4 就试着和旁边的合并, 都没有就不用再往上了
+    for (int d = h - 1; d >= 0; d--)
+    {
+        BTInner *in = path[d];
+        uint32_t i = path_idx[d];
+        BTNode *child = in->child[i];
+        uint32_t cap = child->leaf ? k_bt_leaf : k_bt_fan;
+        if (child->n == 0)
+        {
+            if (child->leaf)
+            {
+                leaf_free((BTLeaf *)child);
+            }
+            else
+            {
+                delete (BTInner *)child;
+            }
+            inner_erase(in, i);
+        }
+        else if (child->n < cap / 4)
+        {
+            bool merged = (i + 1 < in->hdr.n && try_merge(in, i)) || (i > 0 && try_merge(in, i - 1));
+            if (!merged)
+            {
+                break;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // 根只剩一个孩子就降低一层
+    while (bt->root && !bt->root->leaf && bt->root->n <= 1)
+    {
+        BTInner *root = (BTInner *)bt->root;
+        bt->root = root->hdr.n ? root->child[0] : NULL;
+        delete root;
+    }
+    if (bt->root && bt->root->leaf && bt->root->n == 0)
+    {
+        delete (BTLeaf *)bt->root;
+        bt->root = NULL;
+    }
+}
+
+BTPos bt_seek(BTree *bt, double score, const char *name, size_t len)
+{
+    BTPos pos;
+    BTNode *cur = bt->root;
+    if (!cur)
+    {
+        return pos;
+    }
+    BTKey k = bt_key(score, name, len);
+    while (!cur->leaf)
+    {
+        BTInner *in = (BTInner *)cur;
+        cur = in->child[inner_find(in, k)];
+    }
+    pos.leaf = (BTLeaf *)cur;
+    pos.idx = leaf_lower(pos.leaf, k);
+    // 这个叶子里都比 k 小, 就是下一个叶子的第一项
+    if (pos.idx == pos.leaf->hdr.n)
+    {
+        pos.leaf = pos.leaf->next;
+        pos.idx = 0;
+    }
+    return pos;
+}
+
+BTPos bt_at(BTree *bt, int64_t rank)
+{
+    BTPos pos;
+    if (rank < 0 || rank >= (int64_t)bt->size)
+    {
+        return pos;
+    }
+    BTNode *cur = bt->root;
+    while (!cur->leaf)
+    {
+        BTInner *in = (BTInner *)cur;
+        uint32_t i = 0;
+        while (rank >= in->cnt[i])
+        {
+            rank -= in->cnt[i];
+            i++;
+        }
+        cur = in->child[i];
+    }
+    pos.leaf = (BTLeaf *)cur;
+    pos.idx = (uint32_t)rank;
+    return pos;
+}
+
+int64_t bt_rank(BTree *bt, ZNode *node)
+{
+    BTKey k = bt_key(node->score, node->name, node->len);
+    int64_t rank = 0;
+    BTNode *cur = bt->root;
+    while (!cur->leaf)
+    {
+        BTInner *in = (BTInner *)cur;
+        uint32_t i = inner_find(in, k);
+        for (uint32_t j = 0; j < i; j++)
+        {
+            rank += in->cnt[j];
+        }
+        cur = in->child[i];
+    }
+    BTLeaf *leaf = (BTLeaf *)cur;
+    uint32_t pos = leaf_lower(leaf, k);
+    assert(pos < leaf->hdr.n && leaf->node[pos] == node);
+    return rank + pos;
+}
+
+// 只看分数: 有多少个小于 score (inclusive 时包括等于)
+static uint32_t count_below(const double *scores, uint32_t from, uint32_t n, double score, bool inclusive)
+{
+    uint32_t lo = from;
+    uint32_t hi = n;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (scores[mid] < score || (inclusive && scores[mid] == score))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int64_t bt_count_below(BTree *bt, double score, bool inclusive)
+{
+    int64_t total = 0;
+    BTNode *cur = bt->root;
+    if (!cur)
+    {
+        return 0;
+    }
+    while (!cur->leaf)
+    {
+        // 分隔满足条件的孩子前面的孩子都满足, 从最后一个这样的孩子往下走
+        BTInner *in = (BTInner *)cur;
+        uint32_t i = count_below(in->score, 1, in->hdr.n, score, inclusive) - 1;
+        for (uint32_t j = 0; j < i; j++)
+        {
+            total += in->cnt[j];
+        }
+        cur = in->child[i];
+    }
+    BTLeaf *leaf = (BTLeaf *)cur;
+    return total + count_below(leaf->score, 0, leaf->hdr.n, score, inclusive);
+}
+
+BTPos bt_next(BTPos pos)
+{
+    if (pos.leaf && ++pos.idx == pos.leaf->hdr.n)
+    {
+        pos.leaf = pos.leaf->next;
+        pos.idx = 0;
+    }
+    return pos;
+}
+
+BTPos bt_prev(BTPos pos)
+{
+    if (pos.leaf && pos.idx-- == 0)
+    {
+        // 叶子不会是空的
+        pos.leaf = pos.leaf->prev;
+        pos.idx = pos.leaf ? pos.leaf->hdr.n - 1 : 0;
+    }
+    return pos;
+}
+
+static void node_dispose(BTNode *node)
+{
+    if (node->leaf)
+    {
+        delete (BTLeaf *)node;
+        return;
+    }
+    BTInner *in = (BTInner *)node;
+    for (uint32_t i = 0; i < in->hdr.n; i++)
+    {
+        node_dispose(in->child[i]);
+    }
+    delete in;
+}
+
+void bt_dispose(BTree *bt)
+{
+    if (bt->root)
+    {
+        node_dispose(bt->root);
+    }
+    bt->root = NULL;
+    bt->size = 0;
+}
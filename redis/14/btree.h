@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// zset 的 B+ 树索引, 和 AVL 树二选一. 树里存的是 ZNode 的指针, 按 (score, name) 排序,
+// 每一层的 key (分数和名字的前 8 个字节) 挨着放, 比较的时候基本不用去读 ZNode.
+// 内部节点记着每个孩子里有多少项, 按排名找是 O(log n); 叶子连成双向链表, 顺序遍历不用回到上层
+
+struct ZNode;
+
+const uint32_t k_bt_leaf = 32;
+const uint32_t k_bt_fan = 32;
+
+struct BTNode
+{
+    uint16_t leaf = 0;
+    // 叶子里的项数, 或者内部节点的孩子数
+    uint16_t n = 0;
+};
+
+struct BTLeaf
+{
+    BTNode hdr;
+    BTLeaf *prev = NULL;
+    BTLeaf *next = NULL;
+    double score[k_bt_leaf];
+    uint64_t prefix[k_bt_leaf];
+    ZNode *node[k_bt_leaf];
+};
+
+// key[i] 不大于第 i 个孩子里所有的项, 并且大于第 i-1 个孩子里所有的项. key[0] 不用
+struct BTInner
+{
+    BTNode hdr;
+    uint32_t cnt[k_bt_fan];
+    double score[k_bt_fan];
+    uint64_t prefix[k_bt_fan];
+    ZNode *node[k_bt_fan];
+    BTNode *child[k_bt_fan];
+};
+
+struct BTree
+{
+    BTNode *root = NULL;
+    size_t size = 0;
+};
+
+// 指向叶子里的一项, leaf 是 NULL 表示没有
+struct BTPos
+{
+    BTLeaf *leaf = NULL;
+    uint32_t idx = 0;
+};
+
+// 插入, node 不能已经在树里. 按顺序追加的时候叶子是满的
+void bt_insert(BTree *bt, ZNode *node);
+// 从按 (score, name) 排好序, 没有重复的 n 项自底向上建树, O(n). 树必须是空的.
+// 叶子从左往右填满, 再一层层建上面的内部节点. next 每调用一次给出下一项
+void bt_build(BTree *bt, size_t n, ZNode *(*next)(void *arg), void *arg);
+// 删除, node 必须在树里, 分数和名字不能改过
+void bt_remove(BTree *bt, ZNode *node);
+// 第一个大于或等于 (score, name) 的项
+BTPos bt_seek(BTree *bt, double score, const char *name, size_t len);
+// 排在第 rank 位的项
+BTPos bt_at(BTree *bt, int64_t rank);
+// node 的排名, 从 0 开始
+int64_t bt_rank(BTree *bt, ZNode *node);
+// 分数小于 score 的项数 (inclusive 时包括等于的)
+int64_t bt_count_below(BTree *bt, double score, bool inclusive);
+// 下一项和上一项, 没有了 leaf 是 NULL
+BTPos bt_next(BTPos pos);
+BTPos bt_prev(BTPos pos);
+
+inline ZNode *bt_node(BTPos pos)
+{
+    return pos.leaf ? pos.leaf->node[pos.idx] : NULL;
+}
+
+// 释放所有的树节点, ZNode 本身由调用方释放
+void bt_dispose(BTree *bt);
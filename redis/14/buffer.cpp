@@ -0,0 +1,211 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "buffer.h"
+
+// 最小的块 4KB, 第 i 类是 4KB << i
+const size_t k_buf_min_shift = 12;
+const size_t k_buf_nclass = 40;
+// 最小的块从 1MB 的 slab 里切, 第一块用来放 slab 自己的信息
+const size_t k_slab_size = (size_t)1 << 20;
+// 大块在池子里最多缓存这么多字节, 多出来的直接 free
+const size_t k_max_cached_bytes = (size_t)8 << 20;
+
+struct FreeChunk
+{
+    FreeChunk *next = NULL;
+};
+
+struct BufPool;
+
+struct BufSlab
+{
+    BufPool *owner = NULL;
+    uint32_t index = 0;
+};
+
+// 每个线程一个, 只被自己的连接使用, 不需要加锁
+struct BufPool
+{
+    FreeChunk *free[k_buf_nclass] = {};
+    size_t nfree[k_buf_nclass] = {};
+    uint32_t nslabs = 0;
+    // slab 不会释放, 记下来给后注册的回调补上
+    std::vector<uint8_t *> slab_bases;
+    size_t in_use = 0;
+    size_t cached = 0;
+    void (*on_new_slab)(void *base, size_t len, uint32_t index) = NULL;
+};
+
+static thread_local BufPool g_pool;
+
+static size_t class_size(size_t cls)
+{
+    return (size_t)1 << (k_buf_min_shift + cls);
+}
+
+static size_t size_class(size_t n)
+{
+    size_t cls = 0;
+    while (class_size(cls) < n)
+    {
+        cls++;
+    }
+    assert(cls < k_buf_nclass);
+    return cls;
+}
+
+static void slab_new(BufPool *pool)
+{
+    uint8_t *base = (uint8_t *)aligned_alloc(k_slab_size, k_slab_size);
+    assert(base);
+    BufSlab *slab = (BufSlab *)base;
+    slab->owner = pool;
+    slab->index = pool->nslabs++;
+    pool->slab_bases.push_back(base);
+    size_t sz = class_size(0);
+    for (size_t off = sz; off < k_slab_size; off += sz)
+    {
+        FreeChunk *chunk = (FreeChunk *)(base + off);
+        chunk->next = pool->free[0];
+        pool->free[0] = chunk;
+        pool->nfree[0]++;
+        pool->cached += sz;
+    }
+    if (pool->on_new_slab)
+    {
+        pool->on_new_slab(base, k_slab_size, slab->index);
+    }
+}
+
+static uint8_t *chunk_get(BufPool *pool, size_t cls)
+{
+    if (!pool->free[cls] && cls == 0)
+    {
+        slab_new(pool);
+    }
+    size_t sz = class_size(cls);
+    FreeChunk *chunk = pool->free[cls];
+    if (chunk)
+    {
+        pool->free[cls] = chunk->next;
+        pool->nfree[cls]--;
+        pool->cached -= sz;
+    }
+    else
+    {
+        chunk = (FreeChunk *)malloc(sz);
+        assert(chunk);
+    }
+    pool->in_use += sz;
+    return (uint8_t *)chunk;
+}
+
+static void chunk_put(BufPool *pool, uint8_t *ptr, size_t cls)
+{
+    size_t sz = class_size(cls);
+    pool->in_use -= sz;
+    // slab 里的小块一直留着, 大块只缓存一部分
+    if (cls > 0 && (pool->nfree[cls] + 1) * sz > k_max_cached_bytes)
+    {
+        free(ptr);
+        return;
+    }
+    FreeChunk *chunk = (FreeChunk *)ptr;
+    chunk->next = pool->free[cls];
+    pool->free[cls] = chunk;
+    pool->nfree[cls]++;
+    pool->cached += sz;
+}
+
+void buf_reserve(Buffer *buf, size_t n)
+{
+    if (buf_avail(buf) >= n)
+    {
+        return;
+    }
+    size_t size = buf_size(buf);
+    if (buf->data && buf->cap - size >= n)
+    {
+        // 空间够, 只是被已经消费掉的数据占着
+        memmove(buf->data, buf_head(buf), size);
+        buf->begin = 0;
+        buf->end = size;
+        return;
+    }
+    // 换一块更大的内存
+    size_t cls = size_class(size + n);
+    uint8_t *data = chunk_get(&g_pool, cls);
+    if (buf->data)
+    {
+        memcpy(data, buf_head(buf), size);
+        chunk_put(&g_pool, buf->data, size_class(buf->cap));
+    }
+    buf->data = data;
+    buf->cap = class_size(cls);
+    buf->begin = 0;
+    buf->end = size;
+}
+
+void buf_append(Buffer *buf, const void *data, size_t len)
+{
+    buf_reserve(buf, len);
+    memcpy(buf_tail(buf), data, len);
+    buf->end += len;
+}
+
+void buf_consume(Buffer *buf, size_t n)
+{
+    assert(n <= buf_size(buf));
+    buf->begin += n;
+    if (buf->begin == buf->end)
+    {
+        buf->begin = buf->end = 0;
+    }
+}
+
+void buf_release(Buffer *buf)
+{
+    if (buf->data && buf_size(buf) == 0)
+    {
+        buf_free(buf);
+    }
+}
+
+void buf_free(Buffer *buf)
+{
+    if (buf->data)
+    {
+        chunk_put(&g_pool, buf->data, size_class(buf->cap));
+    }
+    *buf = Buffer{};
+}
+
+int buf_slab_index(const Buffer *buf)
+{
+    if (!buf->data || buf->cap != class_size(0))
+    {
+        return -1;
+    }
+    BufSlab *slab = (BufSlab *)((uintptr_t)buf->data & ~(uintptr_t)(k_slab_size - 1));
+    // 别的线程的 slab 没有注册到本线程的 io_uring
+    return slab->owner == &g_pool ? (int)slab->index : -1;
+}
+
+void buf_pool_on_new_slab(void (*f)(void *base, size_t len, uint32_t index))
+{
+    g_pool.on_new_slab = f;
+    // 事件循环启动之前 (比如重放 AOF 的时候) 就已经建好的 slab
+    for (uint32_t i = 0; f && i < g_pool.nslabs; i++)
+    {
+        f(g_pool.slab_bases[i], k_slab_size, i);
+    }
+}
+
+void buf_pool_stats(BufPoolStats *stats)
+{
+    stats->in_use = g_pool.in_use;
+    stats->cached = g_pool.cached;
+    stats->slabs = g_pool.nslabs;
+}
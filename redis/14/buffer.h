@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 连接用的缓冲区, 内存按 2 的幂次大小的块从线程自己的池子里借, 空了就还回去
+struct Buffer
+{
+    uint8_t *data = NULL;
+    size_t cap = 0;
+    // 有效数据在 [begin, end)
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+inline size_t buf_size(const Buffer *buf)
+{
+    return buf->end - buf->begin;
+}
+
+inline uint8_t *buf_head(Buffer *buf)
+{
+    return buf->data + buf->begin;
+}
+
+inline uint8_t *buf_tail(Buffer *buf)
+{
+    return buf->data + buf->end;
+}
+
+// 尾部还能直接写入的空间
+inline size_t buf_avail(const Buffer *buf)
+{
+    return buf->cap - buf->end;
+}
+
+// 直接写到尾部之后, 确认写入的长度
+inline void buf_commit(Buffer *buf, size_t n)
+{
+    buf->end += n;
+}
+
+// 只保留前 size 字节
+inline void buf_truncate(Buffer *buf, size_t size)
+{
+    buf->end = buf->begin + size;
+}
+
+// 保证尾部至少有 n 字节的空间, 可能会把数据挪到开头或者换一块更大的内存
+void buf_reserve(Buffer *buf, size_t n);
+void buf_append(Buffer *buf, const void *data, size_t len);
+// 丢弃头部的 n 字节
+void buf_consume(Buffer *buf, size_t n);
+// 缓冲区空了就把内存还给池子
+void buf_release(Buffer *buf);
+// 丢弃数据, 并归还内存
+void buf_free(Buffer *buf);
+
+// 最小的块是从 slab 里切出来的, 返回它在本线程的 slab 编号, 其它情况返回 -1
+// io_uring 把整个 slab 注册成固定缓冲区
+int buf_slab_index(const Buffer *buf);
+// 本线程每新建一个 slab 都会回调一次, 设置的时候已经有的 slab 也会各回调一次
+void buf_pool_on_new_slab(void (*f)(void *base, size_t len, uint32_t index));
+
+struct BufPoolStats
+{
+    size_t in_use = 0;  // 借出去的字节数
+    size_t cached = 0;  // 池子里空闲的字节数
+    size_t slabs = 0;   // slab 的个数
+};
+
+void buf_pool_stats(BufPoolStats *stats);
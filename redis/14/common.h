@@ -2,19 +2,93 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #define container_of(ptr, type, member) ({                  \
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type, member) ); })
 
+// 每个进程随机的哈希种子, 启动的时候设置, 让别人没法事先构造一批冲突的 key
+inline uint64_t g_hash_seed = 0;
+
+// wyhash 风格的字符串哈希: 每次处理 8 字节, 用 64x64->128 位乘法混合
+inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+inline uint64_t hash_r8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t hash_r4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
 inline uint64_t str_hash(const uint8_t *data, size_t len)
 {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++)
+    const uint64_t k0 = 0x2d358dccaa6c78a5ull;
+    const uint64_t k1 = 0x8bb84b93962eacc9ull;
+    const uint64_t k2 = 0x4b33a62ed433d4a3ull;
+    const uint64_t k3 = 0x4d5a2da51de1aa47ull;
+    const uint8_t *p = data;
+    uint64_t seed = g_hash_seed ^ hash_mix(g_hash_seed ^ k0, k1);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (len <= 16)
+    {
+        // 短 key 是最常见的, 不用循环, 前后各读一次, 可以重叠
+        if (len >= 4)
+        {
+            size_t off = (len >> 3) << 2;
+            a = (hash_r4(p) << 32) | hash_r4(p + off);
+            b = (hash_r4(p + len - 4) << 32) | hash_r4(p + len - 4 - off);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+        }
+    }
+    else
     {
-        h = (h + data[i]) * 0x01000193;
+        size_t i = len;
+        if (i > 48)
+        {
+            // 三条互不依赖的链, CPU 可以并行地做乘法
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do
+            {
+                seed = hash_mix(hash_r8(p) ^ k1, hash_r8(p + 8) ^ seed);
+                seed1 = hash_mix(hash_r8(p + 16) ^ k2, hash_r8(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_r8(p + 32) ^ k3, hash_r8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16)
+        {
+            seed = hash_mix(hash_r8(p) ^ k1, hash_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_r8(p + i - 16);
+        b = hash_r8(p + i - 8);
     }
-    return h;
+    a ^= k1;
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return hash_mix(a ^ k0 ^ len, b ^ k1);
 }
 
 enum
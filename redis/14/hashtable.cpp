@@ -1,6 +1,10 @@
 #include <assert.h>
 #include <stdlib.h>
-#include "hashtable.h"
+#include "hashtable_impl.h"
+#include "common.h"
+
+// -DHMAP_SWISS 的时候用 hashtable_swiss.cpp 里的开放寻址实现
+#if !defined(HMAP_SWISS)
 
 // 初始化
 static void h_init(HTab *htab, size_t n)
@@ -59,41 +63,89 @@ static HNode *h_detach(HTab *htab, HNode **from)
 }
 
 const size_t k_resizing_work = 128;
+// 每次迁移最多跳过这么多个空桶, 大表缩容的时候旧表大部分是空的, 不能一次扫完
+const size_t k_resizing_empty_visits = k_resizing_work * 8;
+const size_t k_min_buckets = 4;
 
-// 相当于扩容?
-static void hm_help_resizing(HMap *hmap)
+// 把旧表 ht2 里的节点逐步搬到 ht1, 扩容和缩容都是这样
+size_t hm_help_resizing(HMap *hmap)
 {
     if (hmap->ht2.tab == NULL)
     {
-        return;
+        return 0;
     }
     size_t nwork = 0;
+    size_t nempty = 0;
     while (nwork < k_resizing_work && hmap->ht2.size > 0)
     {
         HNode **from = &hmap->ht2.tab[hmap->resizing_pos];
         if (!*from)
         {
             hmap->resizing_pos++;
+            if (++nempty >= k_resizing_empty_visits)
+            {
+                break;
+            }
             continue;
         }
         h_insert(&hmap->ht1, h_detach(&hmap->ht2, from));
         nwork++;
     }
+    g_hm_stats.migrated += nwork;
     if (hmap->ht2.size == 0)
     {
         free(hmap->ht2.tab);
         hmap->ht2 = HTab{};
+        hm_untrack(hmap);
     }
+    return nwork;
 }
 
-static void hm_start_resizing(HMap *hmap)
+static void hm_start_resizing(HMap *hmap, size_t n)
 {
     assert(hmap->ht2.tab == NULL);
-    // ht2 指向 ht1
+    if (n > hmap->ht1.mask + 1)
+    {
+        g_hm_stats.grows++;
+    }
+    else
+    {
+        g_hm_stats.shrinks++;
+    }
+    // ht2 指向 ht1, 新的 ht1 大小是 n
     hmap->ht2 = hmap->ht1;
-    // 初始化 ht1，并扩容，扩容的大小是 (ht1.mask + 1) * 2
-    h_init(&hmap->ht1, (hmap->ht1.mask + 1) * 2);
+    h_init(&hmap->ht1, n);
     hmap->resizing_pos = 0;
+    hm_track_resizing(hmap);
+}
+
+// 能放下 size 个节点, 并且装载率不超过 max_load 一半的最小的桶数
+static size_t h_fit(size_t size)
+{
+    size_t n = k_min_buckets;
+    while (size > n * g_hm_config.max_load / 2)
+    {
+        n *= 2;
+    }
+    return n;
+}
+
+// 删除了很多节点之后, 换一张小一点的表
+static void hm_maybe_shrink(HMap *hmap)
+{
+    if (hmap->ht2.tab || !hmap->ht1.tab)
+    {
+        return;
+    }
+    size_t cap = hmap->ht1.mask + 1;
+    if (cap > k_min_buckets && hmap->ht1.size < cap * g_hm_config.min_load)
+    {
+        size_t n = h_fit(hmap->ht1.size);
+        if (n < cap)
+        {
+            hm_start_resizing(hmap, n);
+        }
+    }
 }
 
 HNode *hm_lookup(
@@ -108,25 +160,55 @@ HNode *hm_lookup(
     return from ? *from : NULL;
 }
 
-const size_t k_max_load_factor = 0;
+static void h_prefetch(HTab *htab, uint64_t hcode)
+{
+    if (htab->tab)
+    {
+        __builtin_prefetch(&htab->tab[hcode & htab->mask]);
+    }
+}
+
+void hm_prefetch(HMap *hmap, uint64_t hcode)
+{
+    h_prefetch(&hmap->ht1, hcode);
+    h_prefetch(&hmap->ht2, hcode);
+}
+
+// 链表的第一个节点
+static void h_prefetch_node(HTab *htab, uint64_t hcode, size_t len)
+{
+    if (htab->tab)
+    {
+        HNode *node = htab->tab[hcode & htab->mask];
+        if (node)
+        {
+            h_prefetch_bytes(node, len);
+        }
+    }
+}
+
+void hm_prefetch_node(HMap *hmap, uint64_t hcode, size_t len)
+{
+    h_prefetch_node(&hmap->ht1, hcode, len);
+    h_prefetch_node(&hmap->ht2, hcode, len);
+}
 
 void hm_insert(HMap *hmap, HNode *node)
 {
-    // 如果未初始化，分配4位的内存
-    // 指针的大小是4byte? 32位？
+    // 如果未初始化，先分配最小的表
     if (!hmap->ht1.tab)
     {
-        h_init(&hmap->ht1, 4);
+        h_init(&hmap->ht1, k_min_buckets);
     }
     // 插入
     h_insert(&hmap->ht1, node);
-    // TODO
+    // 装载率超过 max_load 就扩容一倍
     if (!hmap->ht2.tab)
     {
-        size_t load_factor = hmap->ht1.size / (hmap->ht1.mask + 1);
-        if (load_factor >= k_max_load_factor)
+        size_t cap = hmap->ht1.mask + 1;
+        if (hmap->ht1.size > cap * g_hm_config.max_load)
         {
-            hm_start_resizing(hmap);
+            hm_start_resizing(hmap, cap * 2);
         }
     }
     hm_help_resizing(hmap);
@@ -141,7 +223,9 @@ HNode *hm_pop(
     HNode **from = h_lookup(&hmap->ht1, key, cmp);
     if (from)
     {
-        return h_detach(&hmap->ht1, from);
+        HNode *node = h_detach(&hmap->ht1, from);
+        hm_maybe_shrink(hmap);
+        return node;
     }
     from = h_lookup(&hmap->ht2, key, cmp);
     if (from)
@@ -156,10 +240,185 @@ size_t hm_size(HMap *hmap)
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+void hm_reserve(HMap *hmap, size_t n)
+{
+    if (hmap->ht1.tab || hmap->ht2.tab)
+    {
+        return;
+    }
+    size_t cap = k_min_buckets;
+    while (n > cap * g_hm_config.max_load)
+    {
+        cap *= 2;
+    }
+    h_init(&hmap->ht1, cap);
+}
+
+size_t hm_capacity(HMap *hmap)
+{
+    size_t n = hmap->ht1.tab ? hmap->ht1.mask + 1 : 0;
+    return n + (hmap->ht2.tab ? hmap->ht2.mask + 1 : 0);
+}
+
 void hm_destroy(HMap *hmap)
 {
-    assert(hmap->ht1.size + hmap->ht2.size == 0);
+    hm_untrack(hmap);
     free(hmap->ht1.tab);
     free(hmap->ht2.tab);
     *hmap = HMap{};
-}
\ No newline at end of file
+}
+
+static bool h_foreach(HTab *tab, bool (*f)(HNode *, void *), void *arg)
+{
+    for (size_t i = 0; tab->size && i < tab->mask + 1; i++)
+    {
+        for (HNode *node = tab->tab[i]; node; node = node->next)
+        {
+            if (!f(node, arg))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg)
+{
+    if (h_foreach(&hmap->ht1, f, arg))
+    {
+        h_foreach(&hmap->ht2, f, arg);
+    }
+}
+
+// 扫描用的 "桶" 就是链表的一个桶
+bool h_allocated(HTab *tab)
+{
+    return tab->tab != NULL;
+}
+
+size_t h_buckets(HTab *tab)
+{
+    return tab->mask + 1;
+}
+
+void h_scan_bucket(HTab *tab, size_t i, void (*f)(HNode *, void *), void *arg)
+{
+    for (HNode *node = tab->tab[i]; node; node = node->next)
+    {
+        f(node, arg);
+    }
+}
+
+#endif
+
+// 下面是两种实现共用的部分
+
+HMConfig g_hm_config;
+
+thread_local HMStats g_hm_stats;
+
+// 这个线程上正在迁移的 HMap, 用 HMap::resizing_link 串起来
+static thread_local DList g_resizing;
+
+void hm_track_resizing(HMap *hmap)
+{
+    if (!g_resizing.next)
+    {
+        dlist_init(&g_resizing);
+    }
+    if (!hmap->resizing_link.next)
+    {
+        dlist_insert_before(&g_resizing, &hmap->resizing_link);
+    }
+}
+
+void hm_untrack(HMap *hmap)
+{
+    if (hmap->resizing_link.next)
+    {
+        dlist_detach(&hmap->resizing_link);
+        hmap->resizing_link = DList{};
+    }
+}
+
+bool hm_rehash_pending()
+{
+    return g_resizing.next && !dlist_empty(&g_resizing);
+}
+
+size_t hm_rehash_step()
+{
+    if (!hm_rehash_pending())
+    {
+        return 0;
+    }
+    // 先把一张表迁移完, 尽早释放旧表
+    HMap *hmap = container_of(g_resizing.next, HMap, resizing_link);
+    size_t n = hm_help_resizing(hmap);
+    g_hm_stats.bg_migrated += n;
+    return n;
+}
+
+HMStats *hm_stats()
+{
+    g_hm_stats.resizing = 0;
+    g_hm_stats.pending = 0;
+    for (DList *it = g_resizing.next; it && it != &g_resizing; it = it->next)
+    {
+        g_hm_stats.resizing++;
+        g_hm_stats.pending += container_of(it, HMap, resizing_link)->ht2.size;
+    }
+    return &g_hm_stats;
+}
+
+// 把 v 的二进制位倒过来
+static uint64_t h_rev_bits(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// 游标在 mask 范围内按逆序加一: 高位先变, 表变大变小之后已经扫过的桶还是扫过的
+static uint64_t h_cursor_next(uint64_t v, uint64_t mask)
+{
+    v |= ~mask;
+    v = h_rev_bits(v);
+    v++;
+    return h_rev_bits(v);
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    HTab *t0 = &hmap->ht1;
+    HTab *t1 = &hmap->ht2;
+    if (!h_allocated(t0))
+    {
+        return 0;
+    }
+    if (!h_allocated(t1))
+    {
+        uint64_t m0 = h_buckets(t0) - 1;
+        h_scan_bucket(t0, cursor & m0, f, arg);
+        return h_cursor_next(cursor, m0);
+    }
+
+    // 正在迁移: 先扫小表的桶, 再扫大表里由它分裂出来的所有桶
+    if (h_buckets(t0) > h_buckets(t1))
+    {
+        HTab *t = t0;
+        t0 = t1;
+        t1 = t;
+    }
+    uint64_t m0 = h_buckets(t0) - 1;
+    uint64_t m1 = h_buckets(t1) - 1;
+    h_scan_bucket(t0, cursor & m0, f, arg);
+    do
+    {
+        h_scan_bucket(t1, cursor & m1, f, arg);
+        cursor = h_cursor_next(cursor, m1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
@@ -2,14 +2,29 @@
 
 #include<stddef.h>
 #include<stdint.h>
+#include "list.h"
 
 // hashtable node ,能嵌入到负载中
 struct HNode
 {
+    // 开放寻址的实现不用 next, 保留是为了两种实现的调用方完全一样
     HNode *next = NULL;
-    uint16_t hcode = 0;    
+    uint64_t hcode = 0;
 };
 
+#if defined(HMAP_SWISS)
+// 开放寻址的hash表 (Swiss table): 控制字节连续存放, 每 16 个槽一组, 一次比较一组
+struct HTab
+{
+    // 每个槽一个字节: 空, 已删除, 或者哈希的低 7 位
+    int8_t *ctrl = NULL;
+    HNode **slots = NULL;
+    size_t mask = 0;
+    size_t size = 0;
+    // 已删除的槽, 查找时不能当成空槽
+    size_t tombs = 0;
+};
+#else
 // 简单的可变大小的hash表
 struct HTab
 {
@@ -17,6 +32,7 @@ struct HTab
     size_t mask = 0;
     size_t size =0;
 };
+#endif
 
 // 实际的接口，用两个hashtable来渐进式调整尺寸
 struct HMap
@@ -24,13 +40,64 @@ struct HMap
     HTab ht1;
     HTab ht2;
     size_t resizing_pos = 0;
+    // 正在迁移的时候挂在所属线程的列表上, 见 hm_rehash_step
+    DList resizing_link;
+};
+
+// 扩容和缩容的阈值 (节点数 / 桶数), 启动时设置一次, 所有 HMap 共用
+// 缩容之后的装载率大约是 max_load / 2, 所以 min_load 要比它小很多, 否则会反复扩缩
+struct HMConfig
+{
+    double max_load = 1.0;
+    double min_load = 0.125;
 };
 
+extern HMConfig g_hm_config;
+
+// 调整大小的统计, 每个线程一份, 只统计这个线程上的 HMap
+struct HMStats
+{
+    uint64_t grows = 0;
+    uint64_t shrinks = 0;
+    // 只清理删除标记, 大小不变的换表 (只有开放寻址的实现会有)
+    uint64_t rehashes = 0;
+    // 迁移过的节点数, 其中 bg_migrated 是事件循环在后台迁移的
+    uint64_t migrated = 0;
+    uint64_t bg_migrated = 0;
+    // 调用 hm_stats() 的时候现算: 正在迁移的 HMap 个数, 它们的旧表里还剩多少节点
+    uint64_t resizing = 0;
+    uint64_t pending = 0;
+};
+
+HMStats *hm_stats();
+// 桶 (或者槽) 的总数, 包括正在迁移的旧表
+size_t hm_capacity(HMap *hmap);
+
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
+// 批量查找之前先预取, 让多个 key 的 cache miss 重叠起来, 只是提示, 不改表.
+// 先对所有 key 调用 hm_prefetch 预取桶 (开放寻址是控制字节和槽所在的组),
+// 再调用 hm_prefetch_node, 这时候桶大多已经在 cache 里了, 预取桶里第一个可能匹配的节点开头的 len 字节
+// (节点嵌在更大的结构里, 查找要比较的 key 和之后要读的值可能在后面的 cache line 里)
+void hm_prefetch(HMap *hmap, uint64_t hcode);
+void hm_prefetch_node(HMap *hmap, uint64_t hcode, size_t len);
+// 预先分配能放下 n 个节点而不用扩容的表, 只对还没分配过的 HMap 有效
+void hm_reserve(HMap *hmap, size_t n);
+// 只释放表本身, 表里的节点由调用方负责 (比如 zset_dispose 通过 AVL 树释放)
 void hm_destroy(HMap *hmap);
+// 遍历所有节点, f 返回 false 时停止. 遍历期间不能修改 hmap
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// 用游标分批遍历, 每次处理一个桶 (扩容中还有它在大表里对应的几个桶), 返回下一个游标, 0 表示结束
+// 游标按二进制逆序递增, 所以中途扩容缩容也不会漏掉一直存在的节点, 但是可能重复返回
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
 
-
-
+// 后台迁移: 平时只有访问到一个 HMap 的时候才会迁移它, 很久没人访问的表会一直停在迁移中途,
+// 两张表都占着内存, 查找也要查两次. 正在迁移的 HMap 会登记在所属线程的列表里,
+// 事件循环每一轮调用 hm_rehash_step 接着迁移
+bool hm_rehash_pending();
+// 迁移列表里第一个 HMap 的一小步, 返回搬了多少个节点
+size_t hm_rehash_step();
+// 从这个线程的列表里去掉. 要把 HMap 交给别的线程 (比如后台释放) 之前必须调用
+void hm_untrack(HMap *hmap);
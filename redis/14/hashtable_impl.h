@@ -0,0 +1,28 @@
+#pragma once
+
+#include "hashtable.h"
+
+// hashtable.cpp 里的链表实现和 hashtable_swiss.cpp 里的开放寻址实现各自提供这些函数,
+// 两种实现共用的部分 (统计, 游标扫描, 后台迁移) 只通过它们访问表
+
+extern thread_local HMStats g_hm_stats;
+
+bool h_allocated(HTab *tab);
+// 扫描用的桶的个数, 是 2 的幂
+size_t h_buckets(HTab *tab);
+void h_scan_bucket(HTab *tab, size_t i, void (*f)(HNode *, void *), void *arg);
+// 迁移一小步, 返回搬了多少个节点. 迁移完的时候会调用 hm_untrack
+size_t hm_help_resizing(HMap *hmap);
+// 开始迁移的时候调用, 登记到这个线程的列表里, 让事件循环在后台接着迁移
+void hm_track_resizing(HMap *hmap);
+
+// 预取 [p, p + len) 涉及的每个 cache line
+static inline void h_prefetch_bytes(const void *p, size_t len)
+{
+    const size_t k_line = 64;
+    uintptr_t end = (uintptr_t)p + len;
+    for (uintptr_t a = (uintptr_t)p & ~(uintptr_t)(k_line - 1); a < end; a += k_line)
+    {
+        __builtin_prefetch((const void *)a);
+    }
+}
@@ -0,0 +1,431 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "hashtable_impl.h"
+
+// 开放寻址的 HMap, 编译时加上 -DHMAP_SWISS 才会替换掉 hashtable.cpp 里的链表实现
+// 接口和链表版本完全一样, 调用方不需要改
+#if defined(HMAP_SWISS)
+
+// 控制字节: 最高位为 1 表示槽是空的或者已删除, 否则低 7 位是哈希的一部分
+const int8_t k_ctrl_empty = -128;
+const int8_t k_ctrl_deleted = -2;
+// 一组 16 个槽, 正好一次 SSE2 比较
+const size_t k_group = 16;
+
+static int8_t h_tag(uint64_t hcode)
+{
+    return (int8_t)(hcode & 0x7f);
+}
+
+// 组的下标用 tag 之外的位
+static size_t h_group(HTab *htab, uint64_t hcode)
+{
+    return (size_t)(hcode >> 7) & (htab->mask / k_group);
+}
+
+// 组里控制字节等于 tag 的槽, 每个槽一位
+static uint32_t g_match(const int8_t *ctrl, int8_t tag)
+{
+#if defined(__SSE2__)
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(tag)));
+#else
+    uint32_t m = 0;
+    for (size_t i = 0; i < k_group; i++)
+    {
+        m |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return m;
+#endif
+}
+
+// 空的或者已删除的槽, 也就是最高位是 1 的
+static uint32_t g_match_free(const int8_t *ctrl)
+{
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    uint32_t m = 0;
+    for (size_t i = 0; i < k_group; i++)
+    {
+        m |= (uint32_t)(ctrl[i] < 0) << i;
+    }
+    return m;
+#endif
+}
+
+// 初始化
+static void h_init(HTab *htab, size_t n)
+{
+    // n 必须是2的次方, 至少一组
+    assert(n >= k_group && ((n - 1) & n) == 0);
+    htab->ctrl = (int8_t *)aligned_alloc(k_group, n);
+    memset(htab->ctrl, k_ctrl_empty, n);
+    htab->slots = (HNode **)calloc(sizeof(HNode *), n);
+    htab->mask = n - 1;
+    htab->size = 0;
+    htab->tombs = 0;
+}
+
+static void h_free(HTab *htab)
+{
+    free(htab->ctrl);
+    free(htab->slots);
+    *htab = HTab{};
+}
+
+// 插入, 调用方保证表里还有空位
+static void h_insert(HTab *htab, HNode *node)
+{
+    size_t g = h_group(htab, node->hcode);
+    for (size_t n = 0; n <= htab->mask / k_group; n++)
+    {
+        uint32_t m = g_match_free(&htab->ctrl[g * k_group]);
+        if (m)
+        {
+            size_t pos = g * k_group + __builtin_ctz(m);
+            if (htab->ctrl[pos] == k_ctrl_deleted)
+            {
+                htab->tombs--;
+            }
+            htab->ctrl[pos] = h_tag(node->hcode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+        // 这一组满了, 试下一组. 步长每次加一 (三角数), 线性探测会让满的组连成一大片
+        g = (g + n + 1) & (htab->mask / k_group);
+    }
+    assert(!"hash table is full");
+}
+
+// 返回节点所在的槽, 找不到返回 -1
+static size_t h_lookup(HTab *htab, HNode *key, bool (*cmp)(HNode *, HNode *))
+{
+    if (!htab->ctrl)
+    {
+        return (size_t)-1;
+    }
+    int8_t tag = h_tag(key->hcode);
+    size_t g = h_group(htab, key->hcode);
+    for (size_t n = 0; n <= htab->mask / k_group; n++)
+    {
+        const int8_t *ctrl = &htab->ctrl[g * k_group];
+        // 只有 tag 相同的槽才需要去比较节点本身
+        for (uint32_t m = g_match(ctrl, tag); m; m &= m - 1)
+        {
+            size_t pos = g * k_group + __builtin_ctz(m);
+            if (cmp(htab->slots[pos], key))
+            {
+                return pos;
+            }
+        }
+        // 组里有空槽, 说明插入的时候不会越过这一组
+        if (g_match(ctrl, k_ctrl_empty))
+        {
+            break;
+        }
+        g = (g + n + 1) & (htab->mask / k_group);
+    }
+    return (size_t)-1;
+}
+
+static HNode *h_detach(HTab *htab, size_t pos)
+{
+    HNode *node = htab->slots[pos];
+    // 组里本来就有空槽的话, 这一组从来没满过, 查找不会越过它, 可以直接置空
+    // 否则要留下删除标记. 所以满过的组在换表之前不会再出现空槽
+    if (g_match(&htab->ctrl[pos & ~(k_group - 1)], k_ctrl_empty))
+    {
+        htab->ctrl[pos] = k_ctrl_empty;
+    }
+    else
+    {
+        htab->ctrl[pos] = k_ctrl_deleted;
+        htab->tombs++;
+    }
+    htab->slots[pos] = NULL;
+    htab->size--;
+    return node;
+}
+
+const size_t k_resizing_work = 128;
+// 每次迁移最多跳过这么多个空槽, 大表缩容的时候旧表大部分是空的, 不能一次扫完
+const size_t k_resizing_empty_visits = k_resizing_work * 8;
+
+// 开放寻址的表不能装满, 配置的装载率再高也只用到 7/8
+static double h_max_load()
+{
+    return g_hm_config.max_load < 0.875 ? g_hm_config.max_load : 0.875;
+}
+
+// 把旧表 ht2 里的节点逐步搬到 ht1, 扩容和缩容都是这样
+size_t hm_help_resizing(HMap *hmap)
+{
+    if (hmap->ht2.ctrl == NULL)
+    {
+        return 0;
+    }
+    size_t nwork = 0;
+    size_t nempty = 0;
+    while (nwork < k_resizing_work && hmap->ht2.size > 0)
+    {
+        size_t pos = hmap->resizing_pos;
+        if (hmap->ht2.ctrl[pos] < 0)
+        {
+            hmap->resizing_pos++;
+            if (++nempty >= k_resizing_empty_visits)
+            {
+                break;
+            }
+            continue;
+        }
+        h_insert(&hmap->ht1, h_detach(&hmap->ht2, pos));
+        nwork++;
+    }
+    g_hm_stats.migrated += nwork;
+    if (hmap->ht2.size == 0)
+    {
+        h_free(&hmap->ht2);
+        hm_untrack(hmap);
+    }
+    return nwork;
+}
+
+static void hm_start_resizing(HMap *hmap, size_t n)
+{
+    assert(hmap->ht2.ctrl == NULL);
+    size_t cap = hmap->ht1.mask + 1;
+    if (n > cap)
+    {
+        g_hm_stats.grows++;
+    }
+    else if (n < cap)
+    {
+        g_hm_stats.shrinks++;
+    }
+    else
+    {
+        g_hm_stats.rehashes++;
+    }
+    hmap->ht2 = hmap->ht1;
+    h_init(&hmap->ht1, n);
+    hmap->resizing_pos = 0;
+    hm_track_resizing(hmap);
+}
+
+// 能放下 size 个节点, 并且装载率不超过上限一半的最小的表
+static size_t h_fit(size_t size)
+{
+    size_t n = k_group;
+    while (size > n * h_max_load() / 2)
+    {
+        n *= 2;
+    }
+    return n;
+}
+
+// 删除了很多节点之后, 换一张小一点的表
+static void hm_maybe_shrink(HMap *hmap)
+{
+    if (hmap->ht2.ctrl || !hmap->ht1.ctrl)
+    {
+        return;
+    }
+    size_t cap = hmap->ht1.mask + 1;
+    if (cap > k_group && hmap->ht1.size < cap * g_hm_config.min_load)
+    {
+        size_t n = h_fit(hmap->ht1.size);
+        if (n < cap)
+        {
+            hm_start_resizing(hmap, n);
+        }
+    }
+}
+
+HNode *hm_lookup(
+    HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
+{
+    hm_help_resizing(hmap);
+    size_t pos = h_lookup(&hmap->ht1, key, cmp);
+    if (pos != (size_t)-1)
+    {
+        return hmap->ht1.slots[pos];
+    }
+    pos = h_lookup(&hmap->ht2, key, cmp);
+    return pos != (size_t)-1 ? hmap->ht2.slots[pos] : NULL;
+}
+
+// 第一组的控制字节和槽. 一组的槽是 128 字节, 占两个 cache line
+static void h_prefetch(HTab *htab, uint64_t hcode)
+{
+    if (htab->ctrl)
+    {
+        size_t g = h_group(htab, hcode);
+        __builtin_prefetch(&htab->ctrl[g * k_group]);
+        __builtin_prefetch(&htab->slots[g * k_group]);
+        __builtin_prefetch(&htab->slots[g * k_group + k_group / 2]);
+    }
+}
+
+void hm_prefetch(HMap *hmap, uint64_t hcode)
+{
+    h_prefetch(&hmap->ht1, hcode);
+    h_prefetch(&hmap->ht2, hcode);
+}
+
+// 第一组里 tag 相同的第一个槽指向的节点
+static void h_prefetch_node(HTab *htab, uint64_t hcode, size_t len)
+{
+    if (htab->ctrl)
+    {
+        size_t g = h_group(htab, hcode);
+        uint32_t m = g_match(&htab->ctrl[g * k_group], h_tag(hcode));
+        if (m)
+        {
+            h_prefetch_bytes(htab->slots[g * k_group + __builtin_ctz(m)], len);
+        }
+    }
+}
+
+void hm_prefetch_node(HMap *hmap, uint64_t hcode, size_t len)
+{
+    h_prefetch_node(&hmap->ht1, hcode, len);
+    h_prefetch_node(&hmap->ht2, hcode, len);
+}
+
+void hm_insert(HMap *hmap, HNode *node)
+{
+    if (!hmap->ht1.ctrl)
+    {
+        h_init(&hmap->ht1, k_group);
+    }
+    h_insert(&hmap->ht1, node);
+    if (!hmap->ht2.ctrl)
+    {
+        // 删除标记也会拉长查找, 和有效的节点一起算装载率, 超过上限就换表
+        // 主要是删除标记占的位置的话, 大小不变, 搬一遍就清理掉了
+        size_t cap = hmap->ht1.mask + 1;
+        if (hmap->ht1.size + hmap->ht1.tombs > cap * h_max_load())
+        {
+            bool grow = hmap->ht1.size > cap * h_max_load() / 2;
+            hm_start_resizing(hmap, grow ? cap * 2 : cap);
+        }
+    }
+    hm_help_resizing(hmap);
+}
+
+HNode *hm_pop(
+    HMap *hmap,
+    HNode *key,
+    bool (*cmp)(HNode *, HNode *))
+{
+    hm_help_resizing(hmap);
+    size_t pos = h_lookup(&hmap->ht1, key, cmp);
+    if (pos != (size_t)-1)
+    {
+        HNode *node = h_detach(&hmap->ht1, pos);
+        hm_maybe_shrink(hmap);
+        return node;
+    }
+    pos = h_lookup(&hmap->ht2, key, cmp);
+    if (pos != (size_t)-1)
+    {
+        return h_detach(&hmap->ht2, pos);
+    }
+    return NULL;
+}
+
+size_t hm_size(HMap *hmap)
+{
+    return hmap->ht1.size + hmap->ht2.size;
+}
+
+void hm_reserve(HMap *hmap, size_t n)
+{
+    if (hmap->ht1.ctrl || hmap->ht2.ctrl)
+    {
+        return;
+    }
+    size_t cap = k_group;
+    while (n > cap * h_max_load())
+    {
+        cap *= 2;
+    }
+    h_init(&hmap->ht1, cap);
+}
+
+size_t hm_capacity(HMap *hmap)
+{
+    size_t n = hmap->ht1.ctrl ? hmap->ht1.mask + 1 : 0;
+    return n + (hmap->ht2.ctrl ? hmap->ht2.mask + 1 : 0);
+}
+
+void hm_destroy(HMap *hmap)
+{
+    hm_untrack(hmap);
+    h_free(&hmap->ht1);
+    h_free(&hmap->ht2);
+    *hmap = HMap{};
+}
+
+static bool h_foreach(HTab *tab, bool (*f)(HNode *, void *), void *arg)
+{
+    for (size_t i = 0; tab->size && i < tab->mask + 1; i++)
+    {
+        if (tab->ctrl[i] >= 0 && !f(tab->slots[i], arg))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg)
+{
+    if (h_foreach(&hmap->ht1, f, arg))
+    {
+        h_foreach(&hmap->ht2, f, arg);
+    }
+}
+
+// 扫描用的 "桶" 是节点的起始组, 也就是 h_group() 的值. 节点本身可能被挤到后面的组里,
+// 所以沿着探测序列找到第一个有空槽的组为止, 只挑起始组是这一组的节点
+// 这样桶只由哈希值决定, 和链表的实现一样可以用逆序游标
+bool h_allocated(HTab *tab)
+{
+    return tab->ctrl != NULL;
+}
+
+size_t h_buckets(HTab *tab)
+{
+    return (tab->mask + 1) / k_group;
+}
+
+void h_scan_bucket(HTab *tab, size_t home, void (*f)(HNode *, void *), void *arg)
+{
+    size_t g = home;
+    for (size_t n = 0; n <= tab->mask / k_group; n++)
+    {
+        const int8_t *ctrl = &tab->ctrl[g * k_group];
+        for (size_t i = 0; i < k_group; i++)
+        {
+            HNode *node = tab->slots[g * k_group + i];
+            if (ctrl[i] >= 0 && h_group(tab, node->hcode) == home)
+            {
+                f(node, arg);
+            }
+        }
+        if (g_match(ctrl, k_ctrl_empty))
+        {
+            break;
+        }
+        g = (g + n + 1) & (tab->mask / k_group);
+    }
+}
+
+#endif
@@ -23,7 +23,7 @@ inline void dlist_detach(DList *node)
     DList *prev = node->prev;
     DList *next = node->next;
     prev->next = next;
-    prev->prev = prev;
+    next->prev = prev;
 }
 
 inline void dlist_insert_before(DList *target, DList *rookie)
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+
+// 无锁的多生产者单消费者邮箱, 节点嵌入到负载中
+struct MailNode
+{
+    MailNode *next = NULL;
+};
+
+struct Mailbox
+{
+    std::atomic<MailNode *> head{NULL};
+};
+
+// 任意线程都可以投递. 返回 true 表示邮箱原来是空的, 需要唤醒消费者
+inline bool mailbox_push(Mailbox *mb, MailNode *node)
+{
+    MailNode *old = mb->head.load(std::memory_order_relaxed);
+    do
+    {
+        node->next = old;
+    } while (!mb->head.compare_exchange_weak(
+        old, node, std::memory_order_release, std::memory_order_relaxed));
+    return old == NULL;
+}
+
+// 只能由消费者调用, 一次取走全部节点, 按投递的先后顺序返回
+inline MailNode *mailbox_take(Mailbox *mb)
+{
+    MailNode *node = mb->head.exchange(NULL, std::memory_order_acquire);
+    // 栈是后进先出的, 反转一下
+    MailNode *list = NULL;
+    while (node)
+    {
+        MailNode *next = node->next;
+        node->next = list;
+        list = node;
+        node = next;
+    }
+    return list;
+}
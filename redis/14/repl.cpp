@@ -0,0 +1,126 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "repl.h"
+
+void backlog_init(ReplBacklog *b, size_t cap)
+{
+    b->buf = (uint8_t *)malloc(cap);
+    if (!b->buf)
+    {
+        abort();
+    }
+    b->cap = cap;
+}
+
+static uint64_t backlog_begin(ReplBacklog *b)
+{
+    return b->end > b->cap ? b->end - b->cap : 0;
+}
+
+void backlog_append(ReplBacklog *b, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    pthread_mutex_lock(&b->mu);
+    // 比整个缓冲区还大, 前面的部分反正会被覆盖
+    if (len > b->cap)
+    {
+        b->end += len - b->cap;
+        p += len - b->cap;
+        len = b->cap;
+    }
+    size_t pos = (size_t)(b->end % b->cap);
+    size_t first = len < b->cap - pos ? len : b->cap - pos;
+    memcpy(b->buf + pos, p, first);
+    memcpy(b->buf, p + first, len - first);
+    b->end += len;
+    pthread_cond_broadcast(&b->cv);
+    pthread_mutex_unlock(&b->mu);
+}
+
+void backlog_range(ReplBacklog *b, uint64_t *begin, uint64_t *end)
+{
+    pthread_mutex_lock(&b->mu);
+    *begin = backlog_begin(b);
+    *end = b->end;
+    pthread_mutex_unlock(&b->mu);
+}
+
+ssize_t backlog_read(ReplBacklog *b, uint64_t off, void *out, size_t max, int timeout_ms)
+{
+    pthread_mutex_lock(&b->mu);
+    if (b->end == off && timeout_ms > 0)
+    {
+        timespec ts = {0, 0};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (b->end == off)
+        {
+            if (pthread_cond_timedwait(&b->cv, &b->mu, &ts) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+    }
+    if (off < backlog_begin(b) || off > b->end)
+    {
+        pthread_mutex_unlock(&b->mu);
+        return -1;
+    }
+    size_t len = (size_t)(b->end - off);
+    len = len < max ? len : max;
+    size_t pos = (size_t)(off % b->cap);
+    size_t first = len < b->cap - pos ? len : b->cap - pos;
+    memcpy(out, b->buf + pos, first);
+    memcpy((uint8_t *)out + first, b->buf, len - first);
+    pthread_mutex_unlock(&b->mu);
+    return (ssize_t)len;
+}
+
+bool repl_send_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0)
+    {
+        ssize_t rv = send(fd, p, len, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        p += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+bool repl_recv_all(int fd, void *data, size_t len)
+{
+    uint8_t *p = (uint8_t *)data;
+    while (len > 0)
+    {
+        ssize_t rv = recv(fd, p, len, 0);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        p += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
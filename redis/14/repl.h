@@ -0,0 +1,35 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// 主从复制. 从节点连上主节点之后发 psync <复制 id> <偏移量> (第一次是 psync ? -1), 主节点回一个响应:
+//   [fullresync, 复制 id, 偏移量, 快照的字节数]  后面紧跟着快照文件, 然后是偏移量之后的命令流
+//   [continue, 复制 id, 偏移量]                  后面直接是偏移量之后的命令流
+// 命令流和 AOF 的增量文件格式一样, 偏移量是命令流里的字节数.
+// 主节点把命令流追加到积压缓冲区里, 从节点断开之后只要它的偏移量还在缓冲区里, 重连的时候就不用重新全量同步
+
+// 环形缓冲区, 只保留命令流最近的 cap 个字节. 分片线程追加, 每个从节点的发送线程各自读
+struct ReplBacklog
+{
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    // 命令流的总字节数, 也就是下一个字节的偏移量
+    uint64_t end = 0;
+};
+
+void backlog_init(ReplBacklog *b, size_t cap);
+void backlog_append(ReplBacklog *b, const void *data, size_t len);
+// 缓冲区里还有的偏移量范围 [begin, end]
+void backlog_range(ReplBacklog *b, uint64_t *begin, uint64_t *end);
+// 从 off 开始读最多 max 字节. 没有新数据的时候最多等 timeout_ms, 超时返回 0;
+// off 已经被覆盖 (从节点跟不上) 返回 -1
+ssize_t backlog_read(ReplBacklog *b, uint64_t off, void *out, size_t max, int timeout_ms);
+
+// 阻塞的 socket 上收发固定长度的数据
+bool repl_send_all(int fd, const void *data, size_t len);
+bool repl_recv_all(int fd, void *data, size_t len);
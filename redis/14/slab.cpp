@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <sys/types.h>
+#include <atomic>
+#include <mutex>
+#include "slab.h"
+
+// 每次向系统要一页, 切成同样大小的块. 页不会还回去, 空出来的块留着给同一类用
+const size_t k_slab_page = 64 * 1024;
+// 线程手里的块和全局链表之间一次搬多少个
+const size_t k_slab_batch = 64;
+
+// 空闲的块里存下一个空闲块的地址
+struct SlabFree
+{
+    SlabFree *next;
+};
+
+// 一类的全局链表
+struct SlabClass
+{
+    std::mutex mu;
+    SlabFree *head = NULL;
+    size_t nfree = 0;
+    size_t pages = 0;
+};
+
+static SlabClass g_classes[k_slab_nclass];
+static std::atomic<size_t> g_large_allocs{0};
+
+// 每个线程手里的空闲块. 个数用 relaxed 的原子变量, 只是为了统计的时候别的线程能读
+struct SlabCache
+{
+    SlabFree *head[k_slab_nclass] = {};
+    std::atomic<size_t> nfree[k_slab_nclass] = {};
+    SlabCache *prev = NULL;
+    SlabCache *next = NULL;
+
+    SlabCache();
+    ~SlabCache();
+};
+
+// 只有自己的线程会改个数, 不用加锁的读改写
+static void cache_add(SlabCache *cache, size_t idx, ssize_t n)
+{
+    size_t v = cache->nfree[idx].load(std::memory_order_relaxed);
+    cache->nfree[idx].store(v + (size_t)n, std::memory_order_relaxed);
+}
+
+// 所有线程的 SlabCache, 统计用
+static std::mutex g_caches_mu;
+static SlabCache *g_caches = NULL;
+
+static size_t class_idx(size_t size)
+{
+    return (size + 7) / 8 - 1;
+}
+
+static size_t class_size(size_t idx)
+{
+    return (idx + 1) * 8;
+}
+
+// 从全局链表拿最多 n 个块串成链表, 没有了就切一页新的
+static SlabFree *central_take(size_t idx, size_t n, size_t *got)
+{
+    SlabClass *c = &g_classes[idx];
+    std::lock_guard<std::mutex> lock(c->mu);
+    if (!c->head)
+    {
+        size_t size = class_size(idx);
+        uint8_t *page = (uint8_t *)malloc(k_slab_page);
+        if (!page)
+        {
+            abort();
+        }
+        size_t cnt = k_slab_page / size;
+        for (size_t i = cnt; i-- > 0;)
+        {
+            SlabFree *f = (SlabFree *)(page + i * size);
+            f->next = c->head;
+            c->head = f;
+        }
+        c->nfree += cnt;
+        c->pages++;
+    }
+    SlabFree *head = c->head;
+    SlabFree *tail = head;
+    size_t k = 1;
+    while (k < n && tail->next)
+    {
+        tail = tail->next;
+        k++;
+    }
+    c->head = tail->next;
+    c->nfree -= k;
+    tail->next = NULL;
+    *got = k;
+    return head;
+}
+
+// 把 n 个块的链表还给全局链表
+static void central_put(size_t idx, SlabFree *head, SlabFree *tail, size_t n)
+{
+    SlabClass *c = &g_classes[idx];
+    std::lock_guard<std::mutex> lock(c->mu);
+    tail->next = c->head;
+    c->head = head;
+    c->nfree += n;
+}
+
+// 把线程手里的前 n 个块还回去
+static void cache_flush(SlabCache *cache, size_t idx, size_t n)
+{
+    SlabFree *head = cache->head[idx];
+    if (!head || n == 0)
+    {
+        return;
+    }
+    SlabFree *tail = head;
+    for (size_t k = 1; k < n && tail->next; k++)
+    {
+        tail = tail->next;
+    }
+    cache->head[idx] = tail->next;
+    cache_add(cache, idx, -(ssize_t)n);
+    central_put(idx, head, tail, n);
+}
+
+SlabCache::SlabCache()
+{
+    std::lock_guard<std::mutex> lock(g_caches_mu);
+    next = g_caches;
+    if (g_caches)
+    {
+        g_caches->prev = this;
+    }
+    g_caches = this;
+}
+
+// 线程退出, 手里的块全部还回去
+SlabCache::~SlabCache()
+{
+    for (size_t i = 0; i < k_slab_nclass; i++)
+    {
+        cache_flush(this, i, nfree[i].load(std::memory_order_relaxed));
+    }
+    std::lock_guard<std::mutex> lock(g_caches_mu);
+    if (prev)
+    {
+        prev->next = next;
+    }
+    else
+    {
+        g_caches = next;
+    }
+    if (next)
+    {
+        next->prev = prev;
+    }
+}
+
+static thread_local SlabCache g_cache;
+
+void *slab_alloc(size_t size)
+{
+    if (size > k_slab_max)
+    {
+        g_large_allocs.fetch_add(1, std::memory_order_relaxed);
+        void *ptr = malloc(size);
+        if (!ptr)
+        {
+            abort();
+        }
+        return ptr;
+    }
+    size_t idx = class_idx(size ? size : 1);
+    SlabCache *cache = &g_cache;
+    SlabFree *f = cache->head[idx];
+    if (!f)
+    {
+        size_t got = 0;
+        f = central_take(idx, k_slab_batch, &got);
+        cache_add(cache, idx, (ssize_t)got);
+    }
+    cache->head[idx] = f->next;
+    cache_add(cache, idx, -1);
+    return f;
+}
+
+void slab_free(void *ptr, size_t size)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    if (size > k_slab_max)
+    {
+        free(ptr);
+        return;
+    }
+    size_t idx = class_idx(size ? size : 1);
+    SlabCache *cache = &g_cache;
+    SlabFree *f = (SlabFree *)ptr;
+    f->next = cache->head[idx];
+    cache->head[idx] = f;
+    // 手里攒太多了 (比如懒删除的线程只释放不分配), 还一批回去给别的线程用
+    cache_add(cache, idx, 1);
+    if (cache->nfree[idx].load(std::memory_order_relaxed) >= 2 * k_slab_batch)
+    {
+        cache_flush(cache, idx, k_slab_batch);
+    }
+}
+
+size_t slab_size(size_t size)
+{
+    return size > k_slab_max ? size : class_size(class_idx(size ? size : 1));
+}
+
+void slab_stats(SlabStats *stats)
+{
+    *stats = SlabStats();
+    size_t cached[k_slab_nclass] = {};
+    {
+        std::lock_guard<std::mutex> lock(g_caches_mu);
+        for (SlabCache *c = g_caches; c; c = c->next)
+        {
+            for (size_t i = 0; i < k_slab_nclass; i++)
+            {
+                cached[i] += c->nfree[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    for (size_t i = 0; i < k_slab_nclass; i++)
+    {
+        SlabClass *c = &g_classes[i];
+        SlabClassStats *s = &stats->cls[i];
+        s->size = class_size(i);
+        {
+            std::lock_guard<std::mutex> lock(c->mu);
+            s->pages = c->pages;
+            s->free = c->nfree;
+        }
+        s->free += cached[i];
+        size_t total = s->pages * (k_slab_page / s->size);
+        // 读各个线程的个数和读全局链表不是同时的, 可能短暂地多算
+        s->free = s->free < total ? s->free : total;
+        s->in_use = total - s->free;
+        stats->page_bytes += s->pages * k_slab_page;
+        stats->in_use_bytes += s->in_use * s->size;
+        stats->free_bytes += s->free * s->size;
+    }
+    stats->waste_bytes = stats->page_bytes - stats->in_use_bytes - stats->free_bytes;
+    stats->large_allocs = g_large_allocs.load(std::memory_order_relaxed);
+}
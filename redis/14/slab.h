@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 小对象 (Entry, ZNode) 的分配器. 按 8 字节一档分成若干类, 每类从 64KB 的页里切出同样大小的块,
+// 没有 malloc 的头部, 同一类的对象挨在一起.
+// 每个线程有自己的空闲链表, 分配和释放都不加锁; 链表空了从全局的链表批量拿, 太长了批量还回去.
+// 所以哪个线程释放都可以 (比如线程池里的懒删除), 线程退出的时候剩下的块也会还回去.
+// 释放的时候要给出分配时的大小, 超过 k_slab_max 的直接用 malloc
+const size_t k_slab_max = 512;
+const size_t k_slab_nclass = k_slab_max / 8;
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+// 分配 size 字节实际拿到的块的大小. 两个大小的 slab_size 相同, 一块内存就可以当成另一个大小来释放
+size_t slab_size(size_t size);
+
+struct SlabClassStats
+{
+    size_t size = 0;    // 块的大小
+    size_t pages = 0;   // 页数
+    size_t in_use = 0;  // 借出去的块数
+    size_t free = 0;    // 空闲的块数, 包括各个线程手里的
+};
+
+struct SlabStats
+{
+    SlabClassStats cls[k_slab_nclass];
+    size_t page_bytes = 0;    // 所有页的字节数
+    size_t in_use_bytes = 0;  // 借出去的块的字节数
+    size_t free_bytes = 0;    // 空闲的块的字节数
+    // 页里切不出一整块的尾巴, page_bytes - in_use_bytes - free_bytes
+    size_t waste_bytes = 0;
+    // 超过 k_slab_max 的, 走 malloc 的次数
+    size_t large_allocs = 0;
+};
+
+// 所有线程加起来的统计, 各个线程手里的空闲块数是不加锁读的, 只是个近似值
+void slab_stats(SlabStats *stats);
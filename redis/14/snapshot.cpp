@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#include "snapshot.h"
+
+#if !defined(__SSE4_2__)
+// 没有 crc32 指令的时候用查表, 一次处理 8 个字节 (slicing-by-8)
+static uint32_t g_crc_table[8][256];
+
+static bool crc_init_table()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+        }
+        g_crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            uint32_t c = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = (c >> 8) ^ g_crc_table[0][c & 0xFF];
+        }
+    }
+    return true;
+}
+
+// 程序启动的时候算好, 多个线程同时调用 crc32c 也没问题
+static const bool g_crc_table_ready = crc_init_table();
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t c = ~crc;
+#if defined(__SSE4_2__)
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len; p++, len--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p);
+    }
+#else
+    (void)g_crc_table_ready;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= c;
+        c = g_crc_table[7][v & 0xFF] ^ g_crc_table[6][(v >> 8) & 0xFF]
+          ^ g_crc_table[5][(v >> 16) & 0xFF] ^ g_crc_table[4][(v >> 24) & 0xFF]
+          ^ g_crc_table[3][(v >> 32) & 0xFF] ^ g_crc_table[2][(v >> 40) & 0xFF]
+          ^ g_crc_table[1][(v >> 48) & 0xFF] ^ g_crc_table[0][v >> 56];
+    }
+    for (; len; p++, len--)
+    {
+        c = (c >> 8) ^ g_crc_table[0][(c ^ *p) & 0xFF];
+    }
+#endif
+    return ~(uint32_t)c;
+}
+
+// 段的大小, 加载的时候一段是一个任务
+const size_t k_snap_section_bytes = 4 << 20;
+
+// 不经过缓冲区直接写, 用于头部和段
+static void snap_write_fd(SnapWriter *w, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (!w->err && len > 0)
+    {
+        ssize_t rv = write(w->fd, p, len);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            w->err = true;
+            break;
+        }
+        p += rv;
+        len -= (size_t)rv;
+    }
+}
+
+static void snap_write_meta(SnapWriter *w, const void *data, size_t len)
+{
+    w->meta_crc = crc32c(w->meta_crc, data, len);
+    snap_write_fd(w, data, len);
+    w->bytes += len;
+}
+
+void snap_writer_init(SnapWriter *w, int fd, uint64_t nkeys)
+{
+    *w = SnapWriter{};
+    w->fd = fd;
+    w->cap = k_snap_section_bytes + (k_snap_section_bytes >> 2);
+    w->buf = (uint8_t *)malloc(w->cap);
+    w->err = w->buf == NULL;
+    snap_write_meta(w, k_snap_magic, sizeof(k_snap_magic));
+    snap_write_meta(w, &k_snap_version, 4);
+    snap_write_meta(w, &nkeys, 8);
+}
+
+static void snap_flush_section(SnapWriter *w)
+{
+    uint8_t head[21];
+    uint64_t size = w->len;
+    uint32_t crc = crc32c(0, w->buf, w->len);
+    head[0] = k_snap_section;
+    memcpy(head + 1, &w->keys, 8);
+    memcpy(head + 9, &size, 8);
+    memcpy(head + 17, &crc, 4);
+    snap_write_meta(w, head, sizeof(head));
+    snap_write_fd(w, w->buf, w->len);
+    w->bytes += w->len;
+    w->nsections++;
+    w->len = 0;
+    w->keys = 0;
+}
+
+void snap_write(SnapWriter *w, const void *data, size_t len)
+{
+    if (w->err)
+    {
+        return;
+    }
+    // 一个 key 不会被拆到两段里, 特别大的 key 就让这一段变大
+    if (w->len + len > w->cap)
+    {
+        size_t cap = w->cap * 2 > w->len + len ? w->cap * 2 : w->len + len;
+        uint8_t *buf = (uint8_t *)realloc(w->buf, cap);
+        if (!buf)
+        {
+            w->err = true;
+            return;
+        }
+        w->buf = buf;
+        w->cap = cap;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+void snap_write_u8(SnapWriter *w, uint8_t v)
+{
+    snap_write(w, &v, 1);
+}
+
+void snap_write_u32(SnapWriter *w, uint32_t v)
+{
+    snap_write(w, &v, 4);
+}
+
+void snap_write_u64(SnapWriter *w, uint64_t v)
+{
+    snap_write(w, &v, 8);
+}
+
+void snap_write_f64(SnapWriter *w, double v)
+{
+    snap_write(w, &v, 8);
+}
+
+void snap_write_str(SnapWriter *w, const char *data, size_t len)
+{
+    snap_write_u32(w, (uint32_t)len);
+    snap_write(w, data, len);
+}
+
+void snap_end_key(SnapWriter *w)
+{
+    w->keys++;
+    if (w->len >= k_snap_section_bytes)
+    {
+        snap_flush_section(w);
+    }
+}
+
+bool snap_writer_finish(SnapWriter *w)
+{
+    if (w->keys > 0)
+    {
+        snap_flush_section(w);
+    }
+    uint8_t tail[13];
+    tail[0] = k_snap_eof;
+    memcpy(tail + 1, &w->nsections, 8);
+    // 校验和不算在自己里面
+    uint32_t crc = crc32c(w->meta_crc, tail, 9);
+    memcpy(tail + 9, &crc, 4);
+    snap_write_fd(w, tail, sizeof(tail));
+    w->bytes += sizeof(tail);
+    if (!w->err && fsync(w->fd) != 0)
+    {
+        w->err = true;
+    }
+    free(w->buf);
+    w->buf = NULL;
+    return !w->err;
+}
+
+static const uint8_t *snap_take(SnapReader *r, size_t n)
+{
+    if (r->err || r->size - r->pos < n)
+    {
+        r->err = true;
+        return NULL;
+    }
+    const uint8_t *p = r->data + r->pos;
+    r->pos += n;
+    return p;
+}
+
+uint8_t snap_read_u8(SnapReader *r)
+{
+    const uint8_t *p = snap_take(r, 1);
+    return p ? *p : 0;
+}
+
+uint32_t snap_read_u32(SnapReader *r)
+{
+    uint32_t v = 0;
+    const uint8_t *p = snap_take(r, 4);
+    if (p)
+    {
+        memcpy(&v, p, 4);
+    }
+    return v;
+}
+
+uint64_t snap_read_u64(SnapReader *r)
+{
+    uint64_t v = 0;
+    const uint8_t *p = snap_take(r, 8);
+    if (p)
+    {
+        memcpy(&v, p, 8);
+    }
+    return v;
+}
+
+double snap_read_f64(SnapReader *r)
+{
+    double v = 0;
+    const uint8_t *p = snap_take(r, 8);
+    if (p)
+    {
+        memcpy(&v, p, 8);
+    }
+    return v;
+}
+
+const char *snap_read_str(SnapReader *r, uint32_t *len)
+{
+    *len = snap_read_u32(r);
+    const char *p = (const char *)snap_take(r, *len);
+    if (!p)
+    {
+        *len = 0;
+    }
+    return p;
+}
+
+bool snap_open(const uint8_t *data, size_t size, uint64_t *nkeys,
+               std::vector<SnapSection> *sections)
+{
+    // 头部 8 + 4 + 8, 结尾 1 + 8 + 4
+    const size_t k_head = 20;
+    const size_t k_tail = 13;
+    if (size < k_head + k_tail || memcmp(data, k_snap_magic, 8) != 0)
+    {
+        return false;
+    }
+    uint32_t version = 0;
+    memcpy(&version, data + 8, 4);
+    memcpy(nkeys, data + 12, 8);
+    if (version != k_snap_version)
+    {
+        return false;
+    }
+
+    // 顺着段头跳过每一段, 这里只读段头, 很快
+    uint32_t crc = crc32c(0, data, k_head);
+    size_t pos = k_head;
+    size_t end = size - k_tail;
+    sections->clear();
+    while (pos < end)
+    {
+        if (data[pos] != k_snap_section || end - pos < 21)
+        {
+            return false;
+        }
+        SnapSection sec;
+        uint64_t len = 0;
+        memcpy(&sec.keys, data + pos + 1, 8);
+        memcpy(&len, data + pos + 9, 8);
+        memcpy(&sec.crc, data + pos + 17, 4);
+        crc = crc32c(crc, data + pos, 21);
+        pos += 21;
+        if (len > end - pos)
+        {
+            return false;
+        }
+        sec.data = data + pos;
+        sec.size = (size_t)len;
+        sections->push_back(sec);
+        pos += len;
+    }
+
+    uint64_t nsections = 0;
+    uint32_t expect = 0;
+    memcpy(&nsections, data + end + 1, 8);
+    memcpy(&expect, data + end + 9, 4);
+    crc = crc32c(crc, data + end, 9);
+    return data[end] == k_snap_eof && nsections == sections->size() && crc == expect;
+}
+
+bool snap_section_ok(const SnapSection &sec)
+{
+    return crc32c(0, sec.data, sec.size) == sec.crc;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// 快照文件的格式, 所有整数都是小端:
+//   头部: "BMXSNAP\0", u32 版本, u64 key 的个数
+//   若干段: u8 0xFE, u64 这一段的 key 数, u64 这一段的字节数, u32 这一段的 CRC32C, 然后是 key
+//     每个 key: u8 类型, i64 过期的绝对时间 (unix 毫秒, -1 表示没有), u32 长度 + key
+//       字符串: u32 长度 + 值
+//       zset: u64 成员个数, 然后按 (score, name) 从小到大: f64 score, u32 长度 + name
+//   结尾: u8 0xFF, u64 段数, u32 CRC32C (覆盖头部, 所有段头和结尾前面的部分)
+// 分段是为了加载的时候可以多个线程同时校验和解码, 段头里有每一段的校验和, 所以结尾的校验和不用再算一遍数据
+const char k_snap_magic[8] = {'B', 'M', 'X', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t k_snap_version = 2;
+const uint8_t k_snap_section = 0xFE;
+const uint8_t k_snap_eof = 0xFF;
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// 一段先攒在内存里, 攒够了连同段头一起写出去. 出错之后的写都会被忽略, 最后看 err
+struct SnapWriter
+{
+    int fd = -1;
+    uint8_t *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    // 当前这一段的 key 数
+    uint64_t keys = 0;
+    uint64_t nsections = 0;
+    // 头部和段头的校验和
+    uint32_t meta_crc = 0;
+    // 已经写出的字节数, 包括缓冲区里的
+    uint64_t bytes = 0;
+    bool err = false;
+};
+
+// 写头部, nkeys 是所有 key 的个数
+void snap_writer_init(SnapWriter *w, int fd, uint64_t nkeys);
+void snap_write(SnapWriter *w, const void *data, size_t len);
+void snap_write_u8(SnapWriter *w, uint8_t v);
+void snap_write_u32(SnapWriter *w, uint32_t v);
+void snap_write_u64(SnapWriter *w, uint64_t v);
+void snap_write_f64(SnapWriter *w, double v);
+void snap_write_str(SnapWriter *w, const char *data, size_t len);
+// 每写完一个 key 调用一次, 段够大了就写出去
+void snap_end_key(SnapWriter *w);
+// 写出最后一段和结尾, 然后 fsync. 不关闭 fd
+bool snap_writer_finish(SnapWriter *w);
+
+// 从内存里读, 越界的时候 err 置位, 之后读到的都是 0
+struct SnapReader
+{
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    size_t pos = 0;
+    bool err = false;
+};
+
+uint8_t snap_read_u8(SnapReader *r);
+uint32_t snap_read_u32(SnapReader *r);
+uint64_t snap_read_u64(SnapReader *r);
+double snap_read_f64(SnapReader *r);
+// 返回指向 data 内部的指针, 不拷贝
+const char *snap_read_str(SnapReader *r, uint32_t *len);
+
+struct SnapSection
+{
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    uint64_t keys = 0;
+    uint32_t crc = 0;
+};
+
+// 检查头部, 段头和结尾, 列出所有的段. 段里面的数据用 snap_section_ok 单独校验
+bool snap_open(const uint8_t *data, size_t size, uint64_t *nkeys,
+               std::vector<SnapSection> *sections);
+bool snap_section_ok(const SnapSection &sec);
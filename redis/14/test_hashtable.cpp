@@ -0,0 +1,279 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "hashtable.cpp"
+#include "hashtable_swiss.cpp"
+#include "common.h"
+
+// 加不加 -DHMAP_SWISS 都跑一遍, 两种实现的行为应该一样
+
+struct Data
+{
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool data_eq(HNode *lhs, HNode *rhs)
+{
+    return container_of(lhs, Data, node)->key == container_of(rhs, Data, node)->key;
+}
+
+// 故意只用几位的哈希, 制造大量冲突
+static uint64_t g_hash_bits = 64;
+
+static uint64_t key_hash(uint64_t key)
+{
+    uint64_t h = str_hash((uint8_t *)&key, sizeof(key));
+    return g_hash_bits < 64 ? h & ((1ull << g_hash_bits) - 1) : h;
+}
+
+static Data *lookup(HMap *hmap, uint64_t key)
+{
+    Data q;
+    q.key = key;
+    q.node.hcode = key_hash(key);
+    // 预取只是提示, 空表和迁移中的表也要能调用
+    hm_prefetch(hmap, q.node.hcode);
+    hm_prefetch_node(hmap, q.node.hcode, sizeof(Data));
+    HNode *node = hm_lookup(hmap, &q.node, &data_eq);
+    return node ? container_of(node, Data, node) : NULL;
+}
+
+static bool cb_count(HNode *node, void *arg)
+{
+    (void)node;
+    (*(size_t *)arg)++;
+    return true;
+}
+
+static void verify(HMap *hmap, std::unordered_map<uint64_t, Data *> &ref)
+{
+    assert(hm_size(hmap) == ref.size());
+    for (auto &p : ref)
+    {
+        assert(lookup(hmap, p.first) == p.second);
+    }
+    size_t n = 0;
+    hm_foreach(hmap, &cb_count, &n);
+    assert(n == ref.size());
+}
+
+static void test_case(size_t n, uint64_t bits)
+{
+    g_hash_bits = bits;
+    HMap hmap;
+    std::unordered_map<uint64_t, Data *> ref;
+    uint64_t x = 88172645463325252ull + n;
+    for (size_t i = 0; i < n * 4; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t key = x % (n * 2);
+        Data *d = lookup(&hmap, key);
+        assert(d == (ref.count(key) ? ref[key] : NULL));
+        if (d)
+        {
+            // 删除
+            Data q;
+            q.key = key;
+            q.node.hcode = key_hash(key);
+            HNode *node = hm_pop(&hmap, &q.node, &data_eq);
+            assert(node == &d->node);
+            ref.erase(key);
+            delete d;
+        }
+        else
+        {
+            d = new Data();
+            d->key = key;
+            d->node.hcode = key_hash(key);
+            hm_insert(&hmap, &d->node);
+            ref[key] = d;
+        }
+        if ((i & (i - 1)) == 0)
+        {
+            verify(&hmap, ref);
+        }
+    }
+    verify(&hmap, ref);
+
+    for (auto &p : ref)
+    {
+        Data q;
+        q.key = p.first;
+        q.node.hcode = key_hash(p.first);
+        assert(hm_pop(&hmap, &q.node, &data_eq) == &p.second->node);
+        delete p.second;
+    }
+    assert(hm_size(&hmap) == 0);
+    // 删空之后表要缩回去, 迁移靠后续的操作推进
+    for (size_t i = 0; i < 1000 && hm_capacity(&hmap) > 64; i++)
+    {
+        lookup(&hmap, i);
+    }
+    assert(hm_capacity(&hmap) <= 64);
+    hm_destroy(&hmap);
+}
+
+static void cb_collect(HNode *node, void *arg)
+{
+    ((std::unordered_set<uint64_t> *)arg)->insert(container_of(node, Data, node)->key);
+}
+
+static void del_key(HMap *hmap, std::unordered_map<uint64_t, Data *> &ref, uint64_t key)
+{
+    Data q;
+    q.key = key;
+    q.node.hcode = key_hash(key);
+    HNode *node = hm_pop(hmap, &q.node, &data_eq);
+    assert(node == &ref[key]->node);
+    delete ref[key];
+    ref.erase(key);
+}
+
+static void add_key(HMap *hmap, std::unordered_map<uint64_t, Data *> &ref, uint64_t key)
+{
+    Data *d = new Data();
+    d->key = key;
+    d->node.hcode = key_hash(key);
+    hm_insert(hmap, &d->node);
+    ref[key] = d;
+}
+
+static void del_all(HMap *hmap, std::unordered_map<uint64_t, Data *> &ref)
+{
+    std::vector<uint64_t> keys;
+    for (auto &p : ref)
+    {
+        keys.push_back(p.first);
+    }
+    for (uint64_t k : keys)
+    {
+        del_key(hmap, ref, k);
+    }
+}
+
+// 扫描的过程中插入删除, 让表扩容再缩容, 一直存在的 key 必须都扫到
+static void test_scan(size_t n, uint64_t bits)
+{
+    g_hash_bits = bits;
+    HMap hmap;
+    std::unordered_map<uint64_t, Data *> ref;
+    for (uint64_t k = 0; k < n; k++)
+    {
+        add_key(&hmap, ref, k);
+    }
+
+    std::unordered_set<uint64_t> seen;
+    uint64_t cursor = 0;
+    size_t step = 0;
+    uint64_t extra = 1000000;
+    do
+    {
+        cursor = hm_scan(&hmap, cursor, &cb_collect, &seen);
+        // 前半段插入很多 key 让表扩容, 后半段删掉让表缩容
+        for (size_t j = 0; j < 4; j++)
+        {
+            if (step < n)
+            {
+                add_key(&hmap, ref, extra++);
+            }
+            else if (extra > 1000000 && ref.count(extra - 1))
+            {
+                del_key(&hmap, ref, --extra);
+            }
+        }
+        step++;
+    } while (cursor != 0);
+
+    // 0 .. n-1 从头到尾都在表里
+    for (uint64_t k = 0; k < n; k++)
+    {
+        assert(seen.count(k));
+    }
+
+    del_all(&hmap, ref);
+    hm_destroy(&hmap);
+}
+
+// 插入 n 个以上的 key, 直到开始扩容为止
+static void fill_until_resizing(HMap *hmap, std::unordered_map<uint64_t, Data *> &ref, size_t n)
+{
+    uint64_t k = 0;
+    while (k < n || !h_allocated(&hmap->ht2))
+    {
+        add_key(hmap, ref, k++);
+    }
+}
+
+// 不访问 HMap, 只靠 hm_rehash_step 也能把迁移做完
+static void test_background(size_t n)
+{
+    g_hash_bits = 64;
+    HMap maps[3];
+    std::unordered_map<uint64_t, Data *> refs[3];
+    for (size_t m = 0; m < 3; m++)
+    {
+        fill_until_resizing(&maps[m], refs[m], n);
+    }
+    // maps[2] 去掉之后就不归后台迁移管了
+    hm_untrack(&maps[2]);
+
+    HMStats *st = hm_stats();
+    assert(st->resizing == 2 && st->pending > 0);
+    uint64_t bg = st->bg_migrated;
+    while (hm_rehash_pending())
+    {
+        hm_rehash_step();
+    }
+    st = hm_stats();
+    assert(st->resizing == 0 && st->pending == 0 && st->bg_migrated > bg);
+    assert(!h_allocated(&maps[0].ht2) && !h_allocated(&maps[1].ht2));
+    assert(h_allocated(&maps[2].ht2));
+    for (size_t m = 0; m < 3; m++)
+    {
+        verify(&maps[m], refs[m]);
+        del_all(&maps[m], refs[m]);
+        hm_destroy(&maps[m]);
+    }
+    assert(!hm_rehash_pending());
+}
+
+int main()
+{
+    // 装载率上限高于 7/8 的时候, 开放寻址的实现会自己限制
+    for (double max_load : {0.5, 1.0, 4.0})
+    {
+        g_hm_config.max_load = max_load;
+        g_hm_config.min_load = max_load / 8;
+        test_case(10000, 64);
+        test_case(100, 10);
+    }
+    g_hm_config = HMConfig{};
+
+    for (size_t n : {1, 10, 100, 1000, 10000, 100000})
+    {
+        test_case(n, 64);
+    }
+    for (size_t n : {1, 10, 100, 1000})
+    {
+        test_case(n, 10);
+    }
+    for (size_t n : {0, 1, 100, 1000, 20000})
+    {
+        test_scan(n, 64);
+        test_scan(n, 10);
+    }
+    for (size_t n : {1000, 100000})
+    {
+        test_background(n);
+    }
+    HMStats *st = hm_stats();
+    assert(st->grows > 0 && st->shrinks > 0 && st->migrated > 0);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <signal.h>
+
+// 把服务端整个包含进来, 在子进程里跑, 父进程当客户端
+#define main server_main
+#include "14_server.cpp"
+#undef main
+#include "bench.h"
+
+// 转发出去的请求还没回来的时候客户端把连接重置了: 连接只能停掉读写, 等结果回来才释放.
+// 用 -fsanitize=address 编译, 提前释放的话子进程在 shard_reply 里报 use-after-free 退出.
+// 之后再通过网络检查几个命令的回复格式
+// 用法: test_server [端口, 默认 12345]
+
+static int connect_to(uint16_t port)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = ntohs(port);
+        addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+        if (0 == connect(fd, (const sockaddr *)&addr, sizeof(addr)))
+        {
+            return fd;
+        }
+        close(fd);
+        usleep(50 * 1000);
+    }
+    die("connect()");
+    return -1;
+}
+
+static void send_all(int fd, const std::string &data)
+{
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        ssize_t rv = send(fd, data.data() + pos, data.size() - pos, MSG_NOSIGNAL);
+        assert(rv > 0);
+        pos += (size_t)rv;
+    }
+}
+
+static std::string recv_reply(int fd)
+{
+    std::string data;
+    char buf[64 * 1024];
+    while (data.size() < 4 || data.size() < 4 + *(uint32_t *)data.data())
+    {
+        ssize_t rv = recv(fd, buf, sizeof(buf), 0);
+        assert(rv > 0);
+        data.append(buf, (size_t)rv);
+    }
+    return data.substr(4);
+}
+
+static std::string call(int fd, const std::vector<std::string> &cmd)
+{
+    send_all(fd, make_req(cmd));
+    return recv_reply(fd);
+}
+
+// 数组回复里的每一项: 字符串原样, 浮点数用 %g 转成字符串
+static std::vector<std::string> call_arr(int fd, const std::vector<std::string> &cmd)
+{
+    std::string reply = call(fd, cmd);
+    assert(reply[0] == SER_ARR);
+    uint32_t n = 0;
+    memcpy(&n, &reply[1], 4);
+    size_t pos = 5;
+    std::vector<std::string> items;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint8_t type = (uint8_t)reply[pos++];
+        if (type == SER_STR)
+        {
+            uint32_t len = 0;
+            memcpy(&len, &reply[pos], 4);
+            items.push_back(reply.substr(pos + 4, len));
+            pos += 4 + len;
+        }
+        else
+        {
+            assert(type == SER_DBL);
+            double val = 0;
+            memcpy(&val, &reply[pos], 8);
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%g", val);
+            items.push_back(buf);
+            pos += 8;
+        }
+    }
+    assert(pos == reply.size());
+    return items;
+}
+
+int main(int argc, char **argv)
+{
+    std::string port = argc > 1 ? argv[1] : "12345";
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // 回复全部留在写缓冲区里, 不要因为积压太多暂停读取
+        const char *args[] = {"server", "--port", port.c_str(), "--threads", "2", "--out-hwm", "1000000000"};
+        server_main(7, (char **)args);
+        _exit(0);
+    }
+    int fd = connect_to((uint16_t)atoi(port.c_str()));
+
+    // SCAN 的 COUNT 很大也不会溢出, 每个分片一次就扫完
+    for (int i = 0; i < 3000; i++)
+    {
+        std::string reply = call(fd, {"set", "s" + std::to_string(i), "v"});
+        assert(reply[0] == SER_NIL);
+    }
+    int64_t cursor = 0;
+    size_t nscan = 0;
+    int calls = 0;
+    do
+    {
+        std::string reply = call(fd, {"scan", std::to_string(cursor), "count", "1000000000000000000"});
+        assert(reply[0] == SER_ARR && reply[5] == SER_INT && reply[14] == SER_ARR);
+        memcpy(&cursor, &reply[6], 8);
+        uint32_t n = 0;
+        memcpy(&n, &reply[15], 4);
+        nscan += n;
+        calls++;
+    } while (cursor != 0);
+    assert(nscan == 3000 && calls == 2);
+
+    // 一个分片上放很多 key, KEYS 要花一点时间; 再放一个大的值
+    const size_t k_nkeys = 2000000;
+    for (size_t base = 0; base < k_nkeys; base += 1000)
+    {
+        std::vector<std::string> cmd = {"mset"};
+        for (size_t i = base; i < base + 1000; i++)
+        {
+            cmd.push_back("{t}k" + std::to_string(i));
+            cmd.push_back("v");
+        }
+        std::string reply = call(fd, cmd);
+        assert(reply[0] == SER_NIL);
+    }
+    std::string reply = call(fd, {"set", "big", std::string(8 << 20, 'x')});
+    assert(reply[0] == SER_NIL);
+    close(fd);
+
+    for (int round = 0; round < 3; round++)
+    {
+        // 不读回复: 大的 GET 把 socket 和写缓冲区塞满, KEYS 总是要转发给所有分片
+        int c = connect_to((uint16_t)atoi(port.c_str()));
+        send_all(c, make_req({"get", "big"}) + make_req({"get", "big"}) + make_req({"keys"}));
+        usleep(50 * 1000);
+        // 结果回来之前发 RST, 服务端写的时候出错
+        struct linger lg = {1, 0};
+        setsockopt(c, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(c);
+        sleep(2);
+        int status = 0;
+        pid_t rv = waitpid(pid, &status, WNOHANG);
+        assert(rv == 0);
+    }
+
+    // 服务端还在正常工作
+    fd = connect_to((uint16_t)atoi(port.c_str()));
+    reply = call(fd, {"set", "x", "1"});
+    assert(reply[0] == SER_NIL);
+    reply = call(fd, {"get", "x"});
+    assert(reply[0] == SER_STR && reply.substr(5) == "1");
+
+    // 参数不成对的 MSET 不管 key 在哪些分片上都是参数错误, 什么都不改
+    reply = call(fd, {"mset", "a0", "1", "a1", "1", "a2", "1", "a3", "1", "a4", "1", "a5"});
+    assert(reply[0] == SER_ERR && reply.substr(9) == "expect key value pairs");
+    reply = call(fd, {"get", "a0"});
+    assert(reply[0] == SER_NIL);
+
+    // 空串和超出 int64 的增量都不是整数, 值不变
+    std::string not_int = "value is not an integer";
+    reply = call(fd, {"incrby", "x", ""});
+    assert(reply[0] == SER_ERR && reply.substr(9) == not_int);
+    reply = call(fd, {"decrby", "x", "9223372036854775808"});
+    assert(reply[0] == SER_ERR && reply.substr(9) == not_int);
+    reply = call(fd, {"incrby", "x", "-9223372036854775809"});
+    assert(reply[0] == SER_ERR && reply.substr(9) == not_int);
+    reply = call(fd, {"zrange", "x", "", "1"});
+    assert(reply[0] == SER_ERR && reply.substr(9) == "expect int");
+    reply = call(fd, {"get", "x"});
+    assert(reply[0] == SER_STR && reply.substr(5) == "1");
+
+    // ZRANGEBYSCORE 默认只返回名字, WITHSCORES 的时候名字和分数交替
+    typedef std::vector<std::string> Strs;
+    reply = call(fd, {"zadd", "z", "1", "a", "2", "b", "3", "c"});
+    assert(reply[0] == SER_INT);
+    Strs items = call_arr(fd, {"zrangebyscore", "z", "(1", "3"});
+    assert(items == Strs({"b", "c"}));
+    items = call_arr(fd, {"zrangebyscore", "z", "(1", "3", "WITHSCORES"});
+    assert(items == Strs({"b", "2", "c", "3"}));
+    items = call_arr(fd, {"zrevrangebyscore", "z", "3", "-inf", "limit", "0", "2"});
+    assert(items == Strs({"c", "b"}));
+    items = call_arr(fd, {"zrevrangebyscore", "z", "3", "-inf", "withscores", "limit", "1", "5"});
+    assert(items == Strs({"b", "2", "a", "1"}));
+    close(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,410 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <random>
+#include <algorithm>
+#include "hashtable.cpp"
+#include "hashtable_swiss.cpp"
+#include "slab.cpp"
+#include "avl.cpp"
+#include "btree.cpp"
+#include "zset.cpp"
+
+// 随机地加, 改, 删成员, 和 std::multiset 对比排名, 按排名取和分数范围计数.
+// 小的 zset 换几种小编码的上限跑, 大的 zset AVL 和 B+ 树各跑一遍, 每种编码和中间的转换都能测到
+// 全部检查是 O(n) 的 (每个成员都查排名), 只在检查点做.
+// 用法: test_zset [最后的成员个数, 默认 50K, 要测大的 zset 可以给 10000000]
+
+typedef std::multiset<std::pair<double, std::string>> Ref;
+
+struct Container
+{
+    ZSet zset;
+    Ref ref;
+    // 现有成员的编号, 随机挑一个来改或者删
+    std::vector<uint32_t> ids;
+    uint32_t next_id = 0;
+};
+
+static std::string member_name(uint32_t id)
+{
+    return "m" + std::to_string(id);
+}
+
+static void add(Container &c, uint32_t id, double score)
+{
+    std::string name = member_name(id);
+    double old = 0;
+    bool found = zset_score(&c.zset, name.data(), name.size(), &old);
+    if (found)
+    {
+        c.ref.erase(c.ref.find({old, name}));
+    }
+    else
+    {
+        c.ids.push_back(id);
+    }
+    bool added = zset_add(&c.zset, name.data(), name.size(), score);
+    assert(added == !found);
+    c.ref.insert({score, name});
+}
+
+static void del(Container &c, size_t idx)
+{
+    std::string name = member_name(c.ids[idx]);
+    double score = 0;
+    bool found = zset_score(&c.zset, name.data(), name.size(), &score);
+    assert(found);
+    bool removed = zset_rem(&c.zset, name.data(), name.size());
+    assert(removed);
+    removed = zset_rem(&c.zset, name.data(), name.size());
+    assert(!removed);
+    c.ref.erase(c.ref.find({score, name}));
+    c.ids[idx] = c.ids.back();
+    c.ids.pop_back();
+}
+
+// 检查结构: 父指针, 高度, 子树个数, 平衡
+static uint32_t verify_tree(AVLNode *parent, AVLNode *node)
+{
+    if (!node)
+    {
+        return 0;
+    }
+    assert(node->parent == parent);
+    uint32_t l = verify_tree(node, node->left);
+    uint32_t r = verify_tree(node, node->right);
+    assert(node->cnt == 1 + l + r);
+    uint32_t ld = node->left ? node->left->depth : 0;
+    uint32_t rd = node->right ? node->right->depth : 0;
+    assert(node->depth == 1 + (ld > rd ? ld : rd));
+    assert(ld == rd || ld + 1 == rd || ld == rd + 1);
+    return node->cnt;
+}
+
+static std::pair<double, std::string> bt_item(BTNode *node, bool last)
+{
+    while (!node->leaf)
+    {
+        BTInner *in = (BTInner *)node;
+        node = in->child[last ? in->hdr.n - 1 : 0];
+    }
+    ZNode *z = ((BTLeaf *)node)->node[last ? node->n - 1 : 0];
+    return {z->score, std::string(z->name, z->len)};
+}
+
+// 检查 B+ 树: 叶子都在同一层, 计数对, 分隔在左右两个孩子之间, 叶子内部有序. 返回项数
+static size_t verify_bt(BTNode *node, int depth, int *leaf_depth)
+{
+    assert(node->n > 0);
+    if (node->leaf)
+    {
+        assert(*leaf_depth < 0 || *leaf_depth == depth);
+        *leaf_depth = depth;
+        BTLeaf *leaf = (BTLeaf *)node;
+        for (uint32_t i = 0; i < leaf->hdr.n; i++)
+        {
+            ZNode *z = leaf->node[i];
+            assert(leaf->score[i] == z->score);
+            assert(leaf->prefix[i] == name_prefix(z->name, z->len));
+        }
+        return node->n;
+    }
+    BTInner *in = (BTInner *)node;
+    size_t total = 0;
+    for (uint32_t i = 0; i < in->hdr.n; i++)
+    {
+        size_t cnt = verify_bt(in->child[i], depth + 1, leaf_depth);
+        assert(cnt == in->cnt[i]);
+        total += cnt;
+        if (i > 0)
+        {
+            ZNode *z = in->node[i];
+            std::pair<double, std::string> sep = {z->score, std::string(z->name, z->len)};
+            assert(in->score[i] == z->score);
+            assert(sep <= bt_item(in->child[i], false));
+            assert(bt_item(in->child[i - 1], true) < sep);
+        }
+    }
+    return total;
+}
+
+static void verify(Container &c, std::mt19937_64 &rng)
+{
+    assert(zset_size(&c.zset) == c.ref.size());
+    switch (c.zset.enc)
+    {
+    case ZSET_AVL:
+        assert(!c.zset.flat && !c.zset.btree.root);
+        assert(verify_tree(NULL, c.zset.tree) == c.ref.size());
+        assert(hm_size(&c.zset.hmap) == c.ref.size());
+        break;
+    case ZSET_BTREE:
+    {
+        assert(!c.zset.flat && !c.zset.tree);
+        int leaf_depth = -1;
+        assert(!c.zset.btree.root || verify_bt(c.zset.btree.root, 0, &leaf_depth) == c.ref.size());
+        assert(hm_size(&c.zset.hmap) == c.ref.size());
+        // 叶子的链表两个方向都对
+        size_t n = 0;
+        BTLeaf *prev = NULL;
+        for (BTPos pos = bt_at(&c.zset.btree, 0); pos.leaf; pos.leaf = pos.leaf->next)
+        {
+            assert(pos.leaf->prev == prev);
+            prev = pos.leaf;
+            n += pos.leaf->hdr.n;
+        }
+        assert(n == c.ref.size());
+        break;
+    }
+    default:
+        assert(!c.zset.tree && !c.zset.btree.root);
+        assert(c.ref.size() <= g_zset_config.max_flat_n || c.ref.empty());
+        break;
+    }
+
+    // 顺序和 multiset 一致, 每个成员的排名和按排名取回来的都对得上
+    std::vector<double> scores;
+    scores.reserve(c.ref.size());
+    int64_t i = 0;
+    ZIter it;
+    zset_at(&c.zset, 0, &it);
+    for (const auto &p : c.ref)
+    {
+        assert(it.valid);
+        assert(it.score == p.first);
+        assert(std::string(it.name, it.len) == p.second);
+        assert(zset_rank(&c.zset, it.name, it.len) == i);
+        ZIter at;
+        assert(zset_at(&c.zset, i, &at) && at.name == it.name);
+        // 从自己开始的查询就是自己
+        ZIter q;
+        assert(zset_query(&c.zset, p.first, it.name, it.len, 0, &q) && q.name == it.name);
+        scores.push_back(p.first);
+        zset_next(&it);
+        i++;
+    }
+    assert(!it.valid);
+    ZIter out;
+    assert(!zset_at(&c.zset, -1, &out));
+    assert(!zset_at(&c.zset, i, &out));
+
+    // 从最后一个往前走, 和 multiset 反过来一致
+    zset_at(&c.zset, i - 1, &it);
+    for (auto p = c.ref.rbegin(); p != c.ref.rend(); ++p)
+    {
+        assert(it.valid && it.score == p->first);
+        assert(std::string(it.name, it.len) == p->second);
+        zset_prev(&it);
+    }
+    assert(!it.valid);
+
+    // 带偏移的查询, 随便挑一个起点
+    for (int k = 0; k < 100 && !c.ref.empty(); k++)
+    {
+        int64_t from = rng() % c.ref.size();
+        int64_t offset = (int64_t)(rng() % 21) - 10;
+        ZIter base;
+        zset_at(&c.zset, from, &base);
+        ZIter q;
+        bool ok = zset_query(&c.zset, base.score, base.name, base.len, offset, &q);
+        int64_t to = from + offset;
+        assert(ok == (to >= 0 && to < (int64_t)c.ref.size()));
+        if (ok)
+        {
+            assert(zset_rank(&c.zset, q.name, q.len) == to);
+        }
+    }
+
+    // 分数范围计数, 端点取现有的分数和随机值, 包括和不包括都试
+    for (int k = 0; k < 1000; k++)
+    {
+        double lo = scores.empty() || rng() % 2 ? (double)(rng() % 1000) - 10
+                                                : scores[rng() % scores.size()];
+        double hi = scores.empty() || rng() % 2 ? (double)(rng() % 1000) - 10
+                                                : scores[rng() % scores.size()];
+        bool lo_ex = rng() % 2;
+        bool hi_ex = rng() % 2;
+        auto b = lo_ex ? std::upper_bound(scores.begin(), scores.end(), lo)
+                       : std::lower_bound(scores.begin(), scores.end(), lo);
+        auto e = hi_ex ? std::lower_bound(scores.begin(), scores.end(), hi)
+                       : std::upper_bound(scores.begin(), scores.end(), hi);
+        int64_t expect = e > b ? e - b : 0;
+        assert(zset_count(&c.zset, lo, lo_ex, hi, hi_ex) == expect);
+        assert(zset_count_below(&c.zset, lo, lo_ex) == b - scores.begin());
+    }
+}
+
+struct BuildArg
+{
+    std::vector<std::string> names;
+    size_t pos = 0;
+};
+
+static void cb_build_next(void *arg, double *score, const char **name, size_t *len)
+{
+    BuildArg *b = (BuildArg *)arg;
+    *score = (double)b->pos;
+    *name = b->names[b->pos].data();
+    *len = b->names[b->pos].size();
+    b->pos++;
+}
+
+// 一步随机操作: 大多是加新成员, 也改分数和删除
+static void random_op(Container &c, std::mt19937_64 &rng, uint32_t max_score)
+{
+    uint32_t op = rng() % 10;
+    double score = (double)(rng() % max_score);
+    if (op < 6 || c.ids.empty())
+    {
+        add(c, c.next_id++, score);
+    }
+    else if (op < 8)
+    {
+        add(c, c.ids[rng() % c.ids.size()], score);
+    }
+    else
+    {
+        del(c, rng() % c.ids.size());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 50000;
+    std::mt19937_64 rng(1);
+
+    // 小的 zset 每 50 步, 以及编码变了的时候全部检查, 分数范围小, 有很多相同的分数.
+    // 上限是 0 的时候只用树, 很大的时候只用小编码
+    size_t flat_limits[] = {0, 8, 128, 100000};
+    uint8_t indexes[] = {ZSET_AVL, ZSET_BTREE};
+    for (uint8_t index : indexes)
+    {
+        for (size_t limit : flat_limits)
+        {
+            g_zset_config.index = index;
+            g_zset_config.max_flat_n = limit;
+            Container c;
+            uint8_t enc = c.zset.enc;
+            for (int k = 0; k < 5000; k++)
+            {
+                random_op(c, rng, 50);
+                if (k % 50 == 0 || c.zset.enc != enc)
+                {
+                    verify(c, rng);
+                    enc = c.zset.enc;
+                }
+            }
+            for (int k = 0; !c.ids.empty(); k++)
+            {
+                del(c, rng() % c.ids.size());
+                if (k % 50 == 0 || c.zset.enc != enc || c.ids.size() < 3)
+                {
+                    verify(c, rng);
+                    enc = c.zset.enc;
+                }
+            }
+            zset_dispose(&c.zset);
+        }
+    }
+    g_zset_config = ZSetConfig();
+
+    // 名字太长的换成树, zset_build 也一样
+    {
+        ZSet z;
+        zset_add(&z, "a", 1, 1);
+        assert(z.enc == ZSET_FLAT && z.flat);
+        std::string long_name(g_zset_config.max_flat_len + 1, 'x');
+        zset_add(&z, long_name.data(), long_name.size(), 0);
+        assert(z.enc == ZSET_AVL && !z.flat && zset_size(&z) == 2);
+        ZIter it;
+        assert(zset_at(&z, 0, &it) && it.len == long_name.size());
+        zset_dispose(&z);
+
+        // 第 4 个名字太长
+        BuildArg b;
+        b.names = {"a", "b", "c", long_name, "d"};
+        zset_build(&z, b.names.size(), &cb_build_next, &b);
+        assert(z.enc == ZSET_AVL && !z.flat && zset_size(&z) == 5);
+        for (size_t i = 0; i < b.names.size(); i++)
+        {
+            assert(zset_rank(&z, b.names[i].data(), b.names[i].size()) == (int64_t)i);
+        }
+        zset_dispose(&z);
+        b.names = {"a", "b", "c"};
+        b.pos = 0;
+        zset_build(&z, b.names.size(), &cb_build_next, &b);
+        assert(z.enc == ZSET_FLAT && z.flat && zset_size(&z) == 3);
+        zset_dispose(&z);
+    }
+
+    // zset_build 直接建树, 大小取在叶子和内部节点刚满, 多出一点的地方. 建好检查, 再随机改一阵检查
+    size_t build_sizes[] = {129, 1024, 1025, 1031, 1056, 32 * 32 * 32 + 5, 100000};
+    for (uint8_t index : indexes)
+    {
+        g_zset_config.index = index;
+        for (size_t size : build_sizes)
+        {
+            Container c;
+            BuildArg b;
+            for (uint32_t id = 0; id < size; id++)
+            {
+                b.names.push_back(member_name(id));
+                c.ref.insert({(double)id, b.names.back()});
+                c.ids.push_back(id);
+            }
+            c.next_id = (uint32_t)size;
+            zset_build(&c.zset, size, &cb_build_next, &b);
+            assert(c.zset.enc == index);
+            if (index == ZSET_BTREE)
+            {
+                // 叶子是满的, 只有最后两个可能不满
+                size_t leaves = 0;
+                for (BTPos pos = bt_at(&c.zset.btree, 0); pos.leaf; pos.leaf = pos.leaf->next)
+                {
+                    leaves++;
+                }
+                assert(leaves == (size + k_bt_leaf - 1) / k_bt_leaf);
+            }
+            verify(c, rng);
+            for (size_t k = 0; k < 2000; k++)
+            {
+                random_op(c, rng, 1000);
+            }
+            verify(c, rng);
+            zset_dispose(&c.zset);
+        }
+    }
+
+    // 大的树长到 n 个成员, 每长 10 倍全部检查一次
+    for (uint8_t index : indexes)
+    {
+        g_zset_config.index = index;
+        Container c;
+        size_t check = 1000;
+        while (c.ids.size() < n)
+        {
+            random_op(c, rng, 1000);
+            if (c.ids.size() == check)
+            {
+                verify(c, rng);
+                printf("%s: %zu members ok\n", index == ZSET_BTREE ? "btree" : "avl", check);
+                fflush(stdout);
+                check *= 10;
+            }
+        }
+        verify(c, rng);
+        // 删掉一半再检查
+        while (c.ids.size() > n / 2)
+        {
+            del(c, rng() % c.ids.size());
+        }
+        verify(c, rng);
+        zset_dispose(&c.zset);
+    }
+    printf("ok\n");
+    return 0;
+}
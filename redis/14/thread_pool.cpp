@@ -21,7 +21,7 @@ static void *worker(void *arg)
     return NULL;
 }
 
-void trhead_pool_init(ThreadPool *tp, size_t num_threads)
+void thread_pool_init(ThreadPool *tp, size_t num_threads)
 {
     // 线程数量要大于0
     assert(num_threads > 0);
@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_setup(unsigned entries, io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(
+    int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+    const void *arg, size_t argsz)
+{
+    return (int)syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int uring_init(URing *ring, unsigned entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_setup(entries, &p);
+    if (fd < 0)
+    {
+        return -errno;
+    }
+    // 等待的超时依赖 IORING_ENTER_EXT_ARG, 单次 mmap 依赖 IORING_FEAT_SINGLE_MMAP
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(fd);
+        return -ENOSYS;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    size_t len = sq_len > cq_len ? sq_len : cq_len;
+    // sq 和 cq 共用一次映射
+    char *ptr = (char *)mmap(
+        NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+    {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    io_uring_sqe *sqes = (io_uring_sqe *)mmap(
+        NULL, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        int err = errno;
+        munmap(ptr, len);
+        close(fd);
+        return -err;
+    }
+
+    ring->fd = fd;
+    ring->entries = p.sq_entries;
+    ring->sq_head = (unsigned *)(ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ptr + p.sq_off.ring_mask);
+    ring->sqes = sqes;
+    ring->cq_head = (unsigned *)(ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ptr + p.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(ptr + p.cq_off.cqes);
+    // sqe 按顺序使用, 所以 array 固定为恒等映射
+    unsigned *array = (unsigned *)(ptr + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i)
+    {
+        array[i] = i;
+    }
+    ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+    return 0;
+}
+
+io_uring_sqe *uring_get_sqe(URing *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->entries)
+    {
+        return NULL;
+    }
+    io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(URing *ring, unsigned wait_nr, int timeout_ms)
+{
+    unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (wait_nr)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    int rv = sys_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof(arg));
+    if (rv >= 0)
+    {
+        ring->sqe_submitted += (unsigned)rv;
+        return rv;
+    }
+    // 超时或者被信号打断都不算错误, 提交的数量以内核读走的为准
+    ring->sqe_submitted = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (errno == ETIME || errno == EINTR || errno == EBUSY)
+    {
+        return 0;
+    }
+    return -errno;
+}
+
+io_uring_cqe *uring_peek_cqe(URing *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register(URing *ring, unsigned opcode, const void *arg, unsigned nr)
+{
+    int rv = (int)syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr);
+    return rv < 0 ? -errno : rv;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// 最小的 io_uring 封装, 直接用系统调用, 不依赖 liburing
+struct URing
+{
+    int fd = -1;
+    unsigned entries = 0;
+    // submission queue, 与内核共享
+    unsigned *sq_head = NULL;
+    unsigned *sq_tail = NULL;
+    unsigned *sq_mask = NULL;
+    io_uring_sqe *sqes = NULL;
+    // 本地已经填好但还没提交的位置
+    unsigned sqe_tail = 0;
+    unsigned sqe_submitted = 0;
+    // completion queue, 与内核共享
+    unsigned *cq_head = NULL;
+    unsigned *cq_tail = NULL;
+    unsigned *cq_mask = NULL;
+    io_uring_cqe *cqes = NULL;
+};
+
+// 成功返回 0, 失败返回 -errno
+int uring_init(URing *ring, unsigned entries);
+// 队列满的时候返回 NULL, 需要先提交
+io_uring_sqe *uring_get_sqe(URing *ring);
+// 一次系统调用提交所有的 sqe, 并等待至少 wait_nr 个完成事件或者超时
+int uring_submit_and_wait(URing *ring, unsigned wait_nr, int timeout_ms);
+// 取出一个完成事件, 处理完之后调用 uring_cqe_seen
+io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+int uring_register(URing *ring, unsigned opcode, const void *arg, unsigned nr);
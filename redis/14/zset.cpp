@@ -3,14 +3,39 @@
 #include <stdlib.h>
 
 #include "zset.h"
+#include "slab.h"
 #include "common.h"
 
-// 初始化节点
-static ZNode *znode_new(const char *name, size_t len, double score)
+ZSetConfig g_zset_config;
+
+// 节点的大小, AVL 编码的多一个树节点
+static size_t znode_size(uint8_t enc, size_t len)
+{
+    return (enc == ZSET_AVL ? sizeof(ZAVLNode) : sizeof(ZNode)) + len;
+}
+
+static ZAVLNode *avl_of(ZNode *node)
+{
+    return container_of(node, ZAVLNode, z);
+}
+
+static ZNode *znode_of(AVLNode *tree)
+{
+    return &container_of(tree, ZAVLNode, tree)->z;
+}
+
+// 初始化节点, 按编码决定要不要树节点
+static ZNode *znode_new(uint8_t enc, const char *name, size_t len, double score)
 {
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
-    assert(node);
-    avl_init(&node->tree);
+    void *mem = slab_alloc(znode_size(enc, len));
+    assert(mem);
+    ZNode *node = (ZNode *)mem;
+    if (enc == ZSET_AVL)
+    {
+        ZAVLNode *an = (ZAVLNode *)mem;
+        avl_init(&an->tree);
+        node = &an->z;
+    }
     node->hmap.next = NULL;
     node->hmap.hcode = str_hash((uint8_t *)name, len);
     node->score = score;
@@ -29,7 +54,7 @@ static bool zless(
     AVLNode *lhs, double score, const char *name, size_t len)
 {
     // 左子树数据
-    ZNode *zl = container_of(lhs, ZNode, tree);
+    ZNode *zl = znode_of(lhs);
     // 如果左子树score 不等于右子树
     if (zl->score != score)
     {
@@ -51,7 +76,7 @@ static bool zless(
 static bool zless(AVLNode *lhs, AVLNode *rhs)
 {
     // 右子树数据 zr
-    ZNode *zr = container_of(rhs, ZNode, tree);
+    ZNode *zr = znode_of(rhs);
     // 将左子树和右子树 socre name len 传入
     return zless(lhs, zr->score, zr->name, zr->len);
 }
@@ -59,21 +84,22 @@ static bool zless(AVLNode *lhs, AVLNode *rhs)
 // 将node添加到zset中
 static void tree_add(ZSet *zset, ZNode *node)
 {
+    AVLNode *tree = &avl_of(node)->tree;
     if (!zset->tree)
     {
-        zset->tree = &node->tree;
+        zset->tree = tree;
         return;
     }
     AVLNode *cur = zset->tree;
     while (true)
     {
         // 要插入到左子节点还是右子节点
-        AVLNode **from = zless(&node->tree, cur) ? &cur->left : &cur->right;
+        AVLNode **from = zless(tree, cur) ? &cur->left : &cur->right;
         if (!*from)
         {
-            *from = &node->tree;
-            node->tree.parent = cur;
-            zset->tree = avl_fix(&node->tree);
+            *from = tree;
+            tree->parent = cur;
+            zset->tree = avl_fix(tree);
             break;
         }
         cur = *from;
@@ -86,14 +112,23 @@ static void zset_update(ZSet *zset, ZNode *node, double score)
     {
         return;
     }
-    zset->tree = avl_del(&node->tree);
+    if (zset->enc == ZSET_BTREE)
+    {
+        bt_remove(&zset->btree, node);
+        node->score = score;
+        bt_insert(&zset->btree, node);
+        return;
+    }
+    zset->tree = avl_del(&avl_of(node)->tree);
     node->score = score;
-    avl_init(&node->tree);
+    avl_init(&avl_of(node)->tree);
     tree_add(zset, node);
 }
 
-// add 如果存在name就更新或者插入
-bool zset_add(ZSet *zset, const char *name, size_t len, double score)
+static ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
+
+// 树编码 (AVL 或者 B+ 树) 的 add, 如果存在name就更新或者插入
+static bool tree_add_member(ZSet *zset, const char *name, size_t len, double score)
 {
     ZNode *node = zset_lookup(zset, name, len);
     if (node)
@@ -104,16 +139,97 @@ bool zset_add(ZSet *zset, const char *name, size_t len, double score)
     else
     {
         // 新创建一个node
-        node = znode_new(name, len, score);
+        node = znode_new(zset->enc, name, len, score);
         // 根据hashtable的规则进行插入
         // 获取 HMap 以及 HNode 将HNode 插入到 HMap中
         hm_insert(&zset->hmap, &node->hmap);
         // 将节点插入到 set中
-        tree_add(zset, node);
+        if (zset->enc == ZSET_BTREE)
+        {
+            bt_insert(&zset->btree, node);
+        }
+        else
+        {
+            tree_add(zset, node);
+        }
         return true;
     }
 }
 
+struct ZBuild
+{
+    ZSet *zset = NULL;
+    // 建成哪种编码
+    uint8_t enc = ZSET_AVL;
+    void (*next)(void *arg, double *score, const char **name, size_t *len) = NULL;
+    void *arg = NULL;
+};
+
+// 取出下一个成员, 建好节点放进哈希表
+static ZNode *build_node(void *arg)
+{
+    ZBuild *b = (ZBuild *)arg;
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+    b->next(b->arg, &score, &name, &len);
+    ZNode *node = znode_new(b->enc, name, len, score);
+    hm_insert(&b->zset->hmap, &node->hmap);
+    return node;
+}
+
+// 中序地取出 n 个成员建成一棵完全平衡的子树: 左边 n/2 个, 中间一个, 右边剩下的
+// 左右两边的大小最多差 1, 所以高度最多差 1, 满足 AVL 的要求
+static AVLNode *tree_build(ZBuild *b, size_t n)
+{
+    if (n == 0)
+    {
+        return NULL;
+    }
+    AVLNode *left = tree_build(b, n / 2);
+    ZNode *node = build_node(b);
+    AVLNode *right = tree_build(b, n - n / 2 - 1);
+
+    AVLNode *cur = &avl_of(node)->tree;
+    cur->left = left;
+    cur->right = right;
+    uint32_t ld = left ? left->depth : 0;
+    uint32_t rd = right ? right->depth : 0;
+    cur->depth = 1 + (ld > rd ? ld : rd);
+    cur->cnt = (uint32_t)n;
+    if (left)
+    {
+        left->parent = cur;
+    }
+    if (right)
+    {
+        right->parent = cur;
+    }
+    return cur;
+}
+
+// 建成 g_zset_config.index 指定的树编码
+static void zset_build_tree(ZSet *zset, size_t n,
+                            void (*next)(void *arg, double *score, const char **name, size_t *len),
+                            void *arg)
+{
+    assert(!zset->tree && !zset->btree.root);
+    hm_reserve(&zset->hmap, n);
+    ZBuild b;
+    b.zset = zset;
+    b.next = next;
+    b.arg = arg;
+    b.enc = g_zset_config.index;
+    if (b.enc == ZSET_BTREE)
+    {
+        bt_build(&zset->btree, n, &build_node, &b);
+        zset->enc = ZSET_BTREE;
+        return;
+    }
+    zset->tree = tree_build(&b, n);
+    zset->enc = ZSET_AVL;
+}
+
 // 辅助查找的
 struct HKey
 {
@@ -144,9 +260,9 @@ static bool hcmp(HNode *node, HNode *key)
 }
 
 // 根据name查询到对应的节点
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
+static ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
 {
-    if (!zset->tree)
+    if (zset->enc == ZSET_FLAT)
     {
         return NULL;
     }
@@ -166,9 +282,9 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
 }
 
 // 删除一个节点
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
+static ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
 {
-    if (!zset->tree)
+    if (zset->enc == ZSET_FLAT)
     {
         return NULL;
     }
@@ -184,13 +300,19 @@ ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
     }
     ZNode *node = container_of(found, ZNode, hmap);
     // 从树中删除该节点
-    zset->tree = avl_del(&node->tree);
+    if (zset->enc == ZSET_BTREE)
+    {
+        bt_remove(&zset->btree, node);
+    }
+    else
+    {
+        zset->tree = avl_del(&avl_of(node)->tree);
+    }
     return node;
 }
 
-// 查询大于或等于 (score,name) 的元组，然后相对于它进行偏移
-ZNode *zset_query(
-    ZSet *zset, double score, const char *name, size_t len, int64_t offset)
+// 查询大于或等于 (score,name) 的节点
+static AVLNode *tree_seek(ZSet *zset, double score, const char *name, size_t len)
 {
     AVLNode *found = NULL;
     AVLNode *cur = zset->tree;
@@ -206,17 +328,34 @@ ZNode *zset_query(
             cur = cur->left;
         }
     }
-    if (found)
+    return found;
+}
+
+// 分数小于 score 的成员个数 (inclusive 时包括等于的), 沿着一条路径往下数
+static int64_t tree_count_below(AVLNode *cur, double score, bool inclusive)
+{
+    int64_t n = 0;
+    while (cur)
     {
-        found = avl_offset(found, offset);
+        double s = znode_of(cur)->score;
+        if (s < score || (inclusive && s == score))
+        {
+            n += avl_cnt(cur->left) + 1;
+            cur = cur->right;
+        }
+        else
+        {
+            cur = cur->left;
+        }
     }
-    return found ? container_of(found, ZNode, tree) : NULL;
+    return n;
 }
 
-// 释放节点
-void znode_del(ZNode *node)
+// 释放节点, enc 是它所在的 zset 的编码
+static void znode_del(uint8_t enc, ZNode *node)
 {
-    free(node);
+    void *mem = enc == ZSET_AVL ? (void *)avl_of(node) : (void *)node;
+    slab_free(mem, znode_size(enc, node->len));
 }
 
 // 递归整个树
@@ -228,13 +367,533 @@ static void tree_dispose(AVLNode *node)
     }
     tree_dispose(node->left);
     tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
+    znode_del(ZSET_AVL, znode_of(node));
+}
+
+// 下面是小编码
+
+static uint8_t *flat_lens(ZFlat *f)
+{
+    return (uint8_t *)(f->score + f->n);
+}
+
+static char *flat_names(ZFlat *f)
+{
+    return (char *)(flat_lens(f) + f->n);
+}
+
+static size_t flat_max_len()
+{
+    return g_zset_config.max_flat_len < 255 ? g_zset_config.max_flat_len : 255;
+}
+
+static void flat_free(ZFlat *f)
+{
+    if (f)
+    {
+        slab_free(f, sizeof(ZFlat) + f->cap);
+    }
+}
+
+// 前 idx 个名字一共多少字节
+static uint32_t flat_off(ZFlat *f, uint32_t idx)
+{
+    uint8_t *lens = flat_lens(f);
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < idx; i++)
+    {
+        off += lens[i];
+    }
+    return off;
+}
+
+// 换一块 cap 字节的内存, 内容搬过去
+static ZFlat *flat_realloc(ZFlat *f, size_t cap)
+{
+    cap = slab_size(sizeof(ZFlat) + cap) - sizeof(ZFlat);
+    ZFlat *nf = (ZFlat *)slab_alloc(sizeof(ZFlat) + cap);
+    assert(nf);
+    if (f)
+    {
+        memcpy(nf, f, sizeof(ZFlat) + (size_t)f->n * 9 + f->nbytes);
+        flat_free(f);
+    }
+    else
+    {
+        nf->n = 0;
+        nf->nbytes = 0;
+    }
+    nf->cap = (uint32_t)cap;
+    return nf;
+}
+
+// 按名字找, 顺序扫一遍, 长度不一样的不用比
+static bool flat_find(ZFlat *f, const char *name, size_t len, uint32_t *idx, uint32_t *off)
+{
+    if (!f)
+    {
+        return false;
+    }
+    uint8_t *lens = flat_lens(f);
+    char *names = flat_names(f);
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < f->n; i++)
+    {
+        if (lens[i] == len && 0 == memcmp(names + pos, name, len))
+        {
+            *idx = i;
+            *off = pos;
+            return true;
+        }
+        pos += lens[i];
+    }
+    return false;
+}
+
+// 分数小于 score 的成员个数 (inclusive 时包括等于的), 分数是连续的, 二分
+static uint32_t flat_count_below(ZFlat *f, double score, bool inclusive)
+{
+    uint32_t lo = 0;
+    uint32_t hi = f ? f->n : 0;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        double s = f->score[mid];
+        if (s < score || (inclusive && s == score))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool name_less(const char *lhs, size_t llen, const char *rhs, size_t rlen)
+{
+    int rv = memcmp(lhs, rhs, min(llen, rlen));
+    return rv != 0 ? rv < 0 : llen < rlen;
+}
+
+// 第一个大于或等于 (score, name) 的位置: 先二分分数, 分数相同的再顺序比名字
+static uint32_t flat_seek(ZFlat *f, double score, const char *name, size_t len, uint32_t *off)
+{
+    *off = 0;
+    if (!f)
+    {
+        return 0;
+    }
+    uint32_t i = flat_count_below(f, score, false);
+    uint8_t *lens = flat_lens(f);
+    char *names = flat_names(f);
+    *off = flat_off(f, i);
+    while (i < f->n && f->score[i] == score && name_less(names + *off, lens[i], name, len))
+    {
+        *off += lens[i];
+        i++;
+    }
+    return i;
+}
+
+// 插到第 idx 个成员 (名字的偏移是 off) 的前面. 三个区都变长了, 从后往前挪:
+// 名字区往后移 9 字节, 长度区往后移 8 字节, 最后是分数区
+static ZFlat *flat_insert(
+    ZFlat *f, uint32_t idx, uint32_t off, double score, const char *name, size_t len)
+{
+    uint32_t n = f ? f->n : 0;
+    uint32_t nbytes = f ? f->nbytes : 0;
+    size_t need = (size_t)(n + 1) * 9 + nbytes + len;
+    if (!f || f->cap < need)
+    {
+        f = flat_realloc(f, need + need / 8);
+    }
+    char *old_names = (char *)f->score + (size_t)n * 9;
+    char *new_names = old_names + 9;
+    memmove(new_names + off + len, old_names + off, nbytes - off);
+    memmove(new_names, old_names, off);
+    memcpy(new_names + off, name, len);
+    uint8_t *old_lens = (uint8_t *)(f->score + n);
+    uint8_t *new_lens = old_lens + 8;
+    memmove(new_lens + idx + 1, old_lens + idx, n - idx);
+    memmove(new_lens, old_lens, idx);
+    new_lens[idx] = (uint8_t)len;
+    memmove(f->score + idx + 1, f->score + idx, (n - idx) * sizeof(double));
+    f->score[idx] = score;
+    f->n = n + 1;
+    f->nbytes = nbytes + (uint32_t)len;
+    return f;
+}
+
+// 删掉第 idx 个成员, 和插入反过来, 从前往后挪. 空了就释放, 空出一大半就缩小
+static ZFlat *flat_erase(ZFlat *f, uint32_t idx, uint32_t off)
+{
+    uint32_t n = f->n;
+    uint32_t nbytes = f->nbytes;
+    uint8_t *old_lens = flat_lens(f);
+    char *old_names = flat_names(f);
+    uint32_t len = old_lens[idx];
+    memmove(f->score + idx, f->score + idx + 1, (n - idx - 1) * sizeof(double));
+    uint8_t *new_lens = old_lens - 8;
+    memmove(new_lens, old_lens, idx);
+    memmove(new_lens + idx, old_lens + idx + 1, n - idx - 1);
+    char *new_names = old_names - 9;
+    memmove(new_names, old_names, off);
+    memmove(new_names + off, old_names + off + len, nbytes - off - len);
+    f->n = n - 1;
+    f->nbytes = nbytes - len;
+    if (f->n == 0)
+    {
+        flat_free(f);
+        return NULL;
+    }
+    size_t used = (size_t)f->n * 9 + f->nbytes;
+    return f->cap > used * 2 + 64 ? flat_realloc(f, used) : f;
+}
+
+// 游标指向 AVL 树里的节点, NULL 表示走到头了
+static bool iter_node(ZIter *it, AVLNode *node)
+{
+    it->node = node ? container_of(node, ZAVLNode, tree) : NULL;
+    it->pos = BTPos();
+    it->valid = node != NULL;
+    if (it->valid)
+    {
+        it->score = it->node->z.score;
+        it->name = it->node->z.name;
+        it->len = it->node->z.len;
+    }
+    return it->valid;
+}
+
+// 游标指向 B+ 树叶子里的一项
+static bool iter_bt(ZIter *it, BTPos pos)
+{
+    it->node = NULL;
+    it->pos = pos;
+    it->valid = pos.leaf != NULL;
+    if (it->valid)
+    {
+        ZNode *node = bt_node(pos);
+        it->score = node->score;
+        it->name = node->name;
+        it->len = node->len;
+    }
+    return it->valid;
+}
+
+// 游标指向小编码的第 idx 个成员
+static bool iter_flat(ZIter *it, uint32_t idx, uint32_t off)
+{
+    ZFlat *f = it->zset->flat;
+    it->node = NULL;
+    it->pos = BTPos();
+    it->idx = idx;
+    it->off = off;
+    it->valid = f && idx < f->n;
+    if (it->valid)
+    {
+        it->score = f->score[idx];
+        it->name = flat_names(f) + off;
+        it->len = flat_lens(f)[idx];
+    }
+    return it->valid;
+}
+
+static void cb_iter_next(void *arg, double *score, const char **name, size_t *len)
+{
+    ZIter *it = (ZIter *)arg;
+    *score = it->score;
+    *name = it->name;
+    *len = it->len;
+    zset_next(it);
+}
+
+// 小编码换成树, 成员是排好序的, 直接建树
+static void flat_to_tree(ZSet *zset)
+{
+    ZIter it;
+    zset_at(zset, 0, &it);
+    ZFlat *f = zset->flat;
+    zset_build_tree(zset, f ? f->n : 0, &cb_iter_next, &it);
+    flat_free(f);
+    zset->flat = NULL;
+}
+
+// 下面是对外的接口, 按编码分开处理
+
+bool zset_add(ZSet *zset, const char *name, size_t len, double score)
+{
+    if (zset->enc == ZSET_FLAT)
+    {
+        uint32_t idx = 0;
+        uint32_t off = 0;
+        if (flat_find(zset->flat, name, len, &idx, &off))
+        {
+            // 改分数: 删掉再插到新的位置
+            if (zset->flat->score[idx] != score)
+            {
+                zset->flat = flat_erase(zset->flat, idx, off);
+                idx = flat_seek(zset->flat, score, name, len, &off);
+                zset->flat = flat_insert(zset->flat, idx, off, score, name, len);
+            }
+            return false;
+        }
+        if (len <= flat_max_len() && zset_size(zset) < g_zset_config.max_flat_n)
+        {
+            idx = flat_seek(zset->flat, score, name, len, &off);
+            zset->flat = flat_insert(zset->flat, idx, off, score, name, len);
+            return true;
+        }
+        flat_to_tree(zset);
+    }
+    return tree_add_member(zset, name, len, score);
+}
+
+void zset_build(ZSet *zset, size_t n,
+                void (*next)(void *arg, double *score, const char **name, size_t *len),
+                void *arg)
+{
+    assert(zset->enc == ZSET_FLAT && !zset->flat);
+    if (n > g_zset_config.max_flat_n)
+    {
+        return zset_build_tree(zset, n, next, arg);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        double score = 0;
+        const char *name = NULL;
+        size_t len = 0;
+        next(arg, &score, &name, &len);
+        if (zset->enc == ZSET_FLAT && len <= flat_max_len())
+        {
+            // 排好序的, 追加到最后
+            uint32_t off = zset->flat ? zset->flat->nbytes : 0;
+            zset->flat = flat_insert(zset->flat, (uint32_t)i, off, score, name, len);
+        }
+        else
+        {
+            // 名字太长, 前面的换成树, 剩下的一个个加到树里
+            if (zset->enc == ZSET_FLAT)
+            {
+                flat_to_tree(zset);
+            }
+            tree_add_member(zset, name, len, score);
+        }
+    }
+}
+
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score)
+{
+    if (zset->enc == ZSET_FLAT)
+    {
+        uint32_t idx = 0;
+        uint32_t off = 0;
+        if (!flat_find(zset->flat, name, len, &idx, &off))
+        {
+            return false;
+        }
+        *score = zset->flat->score[idx];
+        return true;
+    }
+    ZNode *node = zset_lookup(zset, name, len);
+    if (node)
+    {
+        *score = node->score;
+    }
+    return node != NULL;
+}
+
+bool zset_rem(ZSet *zset, const char *name, size_t len)
+{
+    if (zset->enc == ZSET_FLAT)
+    {
+        uint32_t idx = 0;
+        uint32_t off = 0;
+        if (!flat_find(zset->flat, name, len, &idx, &off))
+        {
+            return false;
+        }
+        zset->flat = flat_erase(zset->flat, idx, off);
+        return true;
+    }
+    ZNode *node = zset_pop(zset, name, len);
+    if (!node)
+    {
+        return false;
+    }
+    znode_del(zset->enc, node);
+    // 删空了, 下次从小编码开始
+    if (zset_size(zset) == 0)
+    {
+        zset->enc = ZSET_FLAT;
+    }
+    return true;
+}
+
+size_t zset_size(ZSet *zset)
+{
+    switch (zset->enc)
+    {
+    case ZSET_AVL:
+        return avl_cnt(zset->tree);
+    case ZSET_BTREE:
+        return zset->btree.size;
+    default:
+        return zset->flat ? zset->flat->n : 0;
+    }
+}
+
+int64_t zset_rank(ZSet *zset, const char *name, size_t len)
+{
+    if (zset->enc == ZSET_FLAT)
+    {
+        uint32_t idx = 0;
+        uint32_t off = 0;
+        return flat_find(zset->flat, name, len, &idx, &off) ? (int64_t)idx : -1;
+    }
+    ZNode *node = zset_lookup(zset, name, len);
+    if (!node)
+    {
+        return -1;
+    }
+    return zset->enc == ZSET_BTREE ? bt_rank(&zset->btree, node) : avl_rank(&avl_of(node)->tree);
+}
+
+bool zset_at(ZSet *zset, int64_t rank, ZIter *it)
+{
+    it->zset = zset;
+    if (rank < 0 || rank >= (int64_t)zset_size(zset))
+    {
+        return iter_node(it, NULL);
+    }
+    switch (zset->enc)
+    {
+    case ZSET_AVL:
+    {
+        // 根的位置就是左子树的大小, 从根偏移过去
+        AVLNode *root = zset->tree;
+        return iter_node(it, avl_offset(root, rank - avl_cnt(root->left)));
+    }
+    case ZSET_BTREE:
+        return iter_bt(it, bt_at(&zset->btree, rank));
+    default:
+        return iter_flat(it, (uint32_t)rank, flat_off(zset->flat, (uint32_t)rank));
+    }
+}
+
+bool zset_query(
+    ZSet *zset, double score, const char *name, size_t len, int64_t offset, ZIter *it)
+{
+    it->zset = zset;
+    switch (zset->enc)
+    {
+    case ZSET_AVL:
+    {
+        AVLNode *found = tree_seek(zset, score, name, len);
+        if (found)
+        {
+            found = avl_offset(found, offset);
+        }
+        return iter_node(it, found);
+    }
+    case ZSET_BTREE:
+    {
+        BTPos pos = bt_seek(&zset->btree, score, name, len);
+        if (offset == 0 || !pos.leaf)
+        {
+            return iter_bt(it, pos);
+        }
+        // 有偏移就先算出排名
+        return zset_at(zset, bt_rank(&zset->btree, bt_node(pos)) + offset, it);
+    }
+    default:
+    {
+        uint32_t off = 0;
+        int64_t idx = flat_seek(zset->flat, score, name, len, &off);
+        if (offset == 0)
+        {
+            return iter_flat(it, (uint32_t)idx, off);
+        }
+        return zset_at(zset, idx < (int64_t)zset_size(zset) ? idx + offset : -1, it);
+    }
+    }
+}
+
+bool zset_next(ZIter *it)
+{
+    if (!it->valid)
+    {
+        return false;
+    }
+    if (it->node)
+    {
+        return iter_node(it, avl_offset(&it->node->tree, +1));
+    }
+    if (it->pos.leaf)
+    {
+        return iter_bt(it, bt_next(it->pos));
+    }
+    return iter_flat(it, it->idx + 1, it->off + (uint32_t)it->len);
+}
+
+bool zset_prev(ZIter *it)
+{
+    if (!it->valid)
+    {
+        return false;
+    }
+    if (it->node)
+    {
+        return iter_node(it, avl_offset(&it->node->tree, -1));
+    }
+    if (it->pos.leaf)
+    {
+        return iter_bt(it, bt_prev(it->pos));
+    }
+    if (it->idx == 0)
+    {
+        return iter_flat(it, it->zset->flat->n, 0);
+    }
+    uint32_t len = flat_lens(it->zset->flat)[it->idx - 1];
+    return iter_flat(it, it->idx - 1, it->off - len);
+}
+
+int64_t zset_count_below(ZSet *zset, double score, bool inclusive)
+{
+    switch (zset->enc)
+    {
+    case ZSET_AVL:
+        return tree_count_below(zset->tree, score, inclusive);
+    case ZSET_BTREE:
+        return bt_count_below(&zset->btree, score, inclusive);
+    default:
+        return flat_count_below(zset->flat, score, inclusive);
+    }
+}
+
+int64_t zset_count(ZSet *zset, double min, bool min_ex, double max, bool max_ex)
+{
+    int64_t hi = zset_count_below(zset, max, !max_ex);
+    int64_t lo = zset_count_below(zset, min, min_ex);
+    return hi > lo ? hi - lo : 0;
 }
 
 void zset_dispose(ZSet *zset)
 {
+    flat_free(zset->flat);
+    zset->flat = NULL;
     // 释放整个树
     tree_dispose(zset->tree);
+    zset->tree = NULL;
+    // B+ 树里的成员顺着叶子释放, 再释放树本身
+    for (BTPos pos = bt_at(&zset->btree, 0); pos.leaf; pos = bt_next(pos))
+    {
+        znode_del(ZSET_BTREE, bt_node(pos));
+    }
+    bt_dispose(&zset->btree);
+    zset->enc = ZSET_FLAT;
     // 释放整个hashtable
     hm_destroy(&zset->hmap);
 }
@@ -1,33 +1,115 @@
 #pragma once
 
 #include "avl.h"
+#include "btree.h"
 #include "hashtable.h"
 
+// zset 的编码
+enum
+{
+    // 一块排好序的内存
+    ZSET_FLAT = 0,
+    // AVL 树 + 哈希表
+    ZSET_AVL = 1,
+    // B+ 树 + 哈希表
+    ZSET_BTREE = 2,
+};
+
+// 成员少的时候整个 zset 是一块排好序的内存 (小编码), 成员多了或者名字长了换成 index 指定的编码,
+// 之后不再换回去 (删空了除外). 每个 zset 记着自己的编码, 改了 index 只影响之后转换的
+struct ZSetConfig
+{
+    // ZSET_AVL 或者 ZSET_BTREE
+    uint8_t index = ZSET_AVL;
+    // 小编码最多多少个成员
+    size_t max_flat_n = 128;
+    // 小编码里成员名最长多少字节, 不能超过 255
+    size_t max_flat_len = 64;
+};
+
+extern ZSetConfig g_zset_config;
+
+// 小编码: 头部后面依次是 n 个 score, n 个名字的长度, 所有的名字挨在一起, 都按 (score, name) 排好序
+// 分数连续放着, 可以直接二分
+struct ZFlat
+{
+    uint32_t n = 0;
+    // 名字一共多少字节
+    uint32_t nbytes = 0;
+    // 头部后面分配了多少字节
+    uint32_t cap = 0;
+    double score[0];
+};
+
 struct ZSet
 {
+    uint8_t enc = ZSET_FLAT;
+    ZFlat *flat = NULL;
     AVLNode *tree = NULL;
+    BTree btree;
     HMap hmap;
 };
 
+// 一个成员: 哈希表的节点, 分数和名字. B+ 树编码的成员就是这样, 树里存的是它的指针
 struct ZNode
 {
-    AVLNode tree;
     HNode hmap;
     double score = 0;
     size_t len = 0;
     char name[0];
 };
 
+// AVL 编码的成员在 ZNode 前面多一个树节点, 名字还是在最后
+struct ZAVLNode
+{
+    AVLNode tree;
+    ZNode z;
+};
+
+// 指向一个成员的游标, 每种编码都一样用. 改了 zset 之后就失效了
+struct ZIter
+{
+    ZSet *zset = NULL;
+    // AVL 编码: 当前节点
+    ZAVLNode *node = NULL;
+    // B+ 树编码: 叶子里的位置
+    BTPos pos;
+    // 小编码: 第几个成员, 名字在名字区里的偏移
+    uint32_t idx = 0;
+    uint32_t off = 0;
+    // 当前的成员, 走到头了 valid 是 false
+    bool valid = false;
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
 // 向zset中添加
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
-// 查找 by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-// 查找并弹出
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
-// 范围查询
-ZNode *zset_query(
-    ZSet *zset, double score, const char *name, size_t len, int64_t offset);
+// 从按 (score, name) 排好序, 没有重复的 n 个成员直接建好, O(n). zset 必须是空的
+// next 每调用一次给出下一个成员
+void zset_build(ZSet *zset, size_t n,
+                void (*next)(void *arg, double *score, const char **name, size_t *len),
+                void *arg);
+// 按名字查分数, 不存在返回 false
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score);
+// 按名字删除, 不存在返回 false
+bool zset_rem(ZSet *zset, const char *name, size_t len);
+// 成员个数
+size_t zset_size(ZSet *zset);
+// 成员按 (score, name) 排序后的位置, 从 0 开始, 不存在返回 -1
+int64_t zset_rank(ZSet *zset, const char *name, size_t len);
+// 游标指向排在第 rank 位的成员, 超出范围返回 false
+bool zset_at(ZSet *zset, int64_t rank, ZIter *it);
+// 范围查询: 游标指向大于或等于 (score,name) 的第一个成员, 再偏移 offset 个
+bool zset_query(
+    ZSet *zset, double score, const char *name, size_t len, int64_t offset, ZIter *it);
+// 游标移到下一个 (上一个) 成员, 没有了返回 false. 平均每步 O(1)
+bool zset_next(ZIter *it);
+bool zset_prev(ZIter *it);
+// 分数小于 score 的成员个数 (inclusive 时包括等于的), 也就是分数范围一端的排名
+int64_t zset_count_below(ZSet *zset, double score, bool inclusive);
+// 分数在 min 和 max 之间的成员个数, *_ex 表示不包括端点
+int64_t zset_count(ZSet *zset, double min, bool min_ex, double max, bool max_ex);
 // 消耗
 void zset_dispose(ZSet *zset);
-// 删除一个节点
-void znode_del(ZNode *node);